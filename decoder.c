@@ -1,7 +1,16 @@
 #include <stdio.h>   // 標準輸入輸出函式庫
+#include <stdint.h>  // uint64_t：bit reader 的 64-bit 緩衝
 #include <stdlib.h>  // 標準函式庫
 #include <string.h>  // 處理字串用，例如 strchr(), sscanf()
+#include <time.h>    // clock_gettime(): 量測解碼 throughput
+#include <unistd.h>  // ftruncate(), close()
+#include <pthread.h> // 平行解碼
+#include <sys/stat.h> // fstat(): 輸入檔案的大小
+#include <sys/mman.h> // mmap(): 把 encoded.bin 與輸出檔直接映射進記憶體
+#include <fcntl.h>    // open(), posix_fallocate(): 開啟並預先放大輸出檔
 #include "logger.h"  // 自訂 logger 函式庫
+#include "huffman.h" // encoder / decoder 共用的 Huffman 工具（canonical code）
+#include "libhuff.h" // 解碼樹、查表與 bit reader（與 huff_decode 共用）
 
 /*
  * ============================================================================
@@ -16,6 +25,54 @@
  * argv[1] - enc_fn : 編碼檔案路徑（由 encoder 產生的二進位檔案）
  * argv[2] - cb_fn  : codebook 檔案路徑（符號與編碼的對應表）
  * argv[3] - out_fn : 解碼輸出檔案路徑（還原後的原始文字檔）
+ *
+ * 【選項】
+ * --engine=lut  : （預設）查表解碼，一次 peek 多個 bit 直接查出 symbol
+ * --engine=tree : 原本逐 bit 走解碼樹的解碼方式，方便比較
+ * --engine=multi : 多 symbol 查表，一次查表最多解出 4 個短 code 的 symbol，
+ *                 適合低 entropy 的資料（平行 / framed / 多 stream 路徑改用 lut）
+ * --engine=fsm  : 逐 byte 的狀態機，每個輸入 byte 查一次 [狀態][byte] 表，
+ *                 不需要 bit 位移（平行 / framed / 多 stream 路徑改用 lut）
+ * --engine=canon : 只用每個長度的 first / count / offset 與 symbol 清單
+ *                 （約 500 bytes）逐長度比較解碼，不建樹也不建表；
+ *                 需要 canonical codebook、code 長度不超過 32，一律循序解碼
+ *                 （framed / 多 stream 路徑改用 lut）
+ * --export-csv=path : 把讀到的 codebook 另存成 CSV（例如檢視二進位 codebook）
+ * --threads=N   : container 帶有 sync index（encoder --sync-interval）時，
+ *                 用 N 個執行緒平行解碼；0（預設）表示依 CPU 核心數自動決定，
+ *                 1 表示一律循序解碼。沒有 index 的舊格式 encoded.bin 則用
+ *                 推測式平行解碼（各段猜起點、利用 Huffman code 的自我同步
+ *                 接起來），輸出與循序解碼完全相同。所有平行工作共用一個
+ *                 work-stealing 執行緒池（真的要分段時才建立），有分段時
+ *                 finish 之前每個 worker 多一行 pool_worker 統計
+ * --manifest=path : 批次模式，一個 process 解碼很多檔案；manifest 每行是
+ *                 "enc_fn cb_fn out_fn"（格式見 huffman.h，"-" 表示從 stdin
+ *                 讀）。命令列上也可以直接給好幾組 enc_fn cb_fn out_fn。
+ *                 用同一個 cb_fn 的檔案共用一份解碼樹與查表（只建一次）；
+ *                 每個檔案照常輸出 metrics summary，最後多一行 batch_summary。
+ *                 批次模式下 --threads 預設為 1，不能和 --export-csv 一起用
+ * -j N / --jobs=N : 批次模式同時解碼的檔案數；0（預設）表示依 CPU 核心數。
+ *                 --threads 比較大時執行緒池以 --threads 為準
+ *
+ * 【單檔 container】
+ * enc_fn 開頭若是 magic "HUFC"（encoder --container 產生，格式見 huffman.h），
+ * code 長度、payload bit 數與原始大小都在 header 裡，cb_fn 會被忽略（可給 "-"）
+ * header 為 version 2 時 payload 是多個交錯的 stream（encoder --streams），
+ * 各 stream 在同一輪解碼迴圈裡一起推進
+ *
+ * 【framed 格式】
+ * enc_fn 開頭若是 magic "HUFF"（encoder --block-size 產生，格式見 huffman.h），
+ * 每個 block 自帶 code 長度，逐 block 建樹解碼；cb_fn 同樣會被忽略
+ *
+ * 【codebook 的 code 指定方式】
+ * - tree-shaped（舊檔案，預設）：直接使用 codebook 裡的 code 字串
+ * - canonical：codebook 第一行為 "# code_assignment=canonical"，
+ *   只取每個 symbol 的 code 長度，再依 (長度, symbol) 重建 code
+ * - 二進位 codebook（開頭為 magic "HUFB"，格式見 huffman.h）：
+ *   只存長度，一律視為 canonical
+ *
+ * 【編譯】
+ * gcc -O2 -o decoder decoder.c libhuff.c huffman.c logger.c -lm -lpthread
  * 
  * 【Log 輸出規範】
  * - 使用 log_info() 記錄正常流程（輸出到 stdout）
@@ -25,53 +82,1225 @@
  * ============================================================================
  */
 
+/*
+ * 解碼樹（HuffDTree）、查表（HuffLutTable）、bit reader 與 lut / tree 兩種
+ * 基本解碼迴圈都在 libhuff（見 libhuff.h），這裡只留 decoder 自己的
+ * 多 symbol 表、狀態機、canonical 解碼與平行 / 多 stream 的路徑。
+ * 函式庫在記憶體不足時回傳錯誤碼，decoder 照舊直接結束。
+ */
+
+#define DEC_OUT_BUF_SIZE (1 << 16)   // 沒有輸出映射時一批解幾個 symbol
+
+static void dec_nomem(void) {
+    // 這裡用 fprintf 是避免 logger 本身也出問題時陷入循環
+    fprintf(stderr, "decoder: memory allocation failed\n");
+    exit(1);
+}
+
+static void lut_build(HuffLutTable* t, const HuffDTree* tree) {
+    if (huff_lut_build(t, tree) != 0) dec_nomem();
+}
+
+/* 建樹；節點不夠用（code 不合法）時回傳 -1 */
+static int dtree_build(HuffDTree* t, char codes[HUFF_NUM_SYMBOLS][HUFF_MAX_CODE_LEN + 1]) {
+    int rc = huff_dtree_build(t, codes);
+    if (rc == HUFF_ERR_NOMEM) dec_nomem();
+    return rc != 0 ? -1 : 0;
+}
+
+static int tree_from_lengths(HuffDTree* tree, const int lens[HUFF_NUM_SYMBOLS],
+                             char codes[HUFF_NUM_SYMBOLS][HUFF_MAX_CODE_LEN + 1]) {
+    int rc = huff_dtree_from_lengths(tree, lens, codes);
+    if (rc == HUFF_ERR_NOMEM) dec_nomem();
+    return rc != 0 ? -1 : 0;
+}
+
+/* ------------------------------ 輸入來源 ---------------------------------- */
+
+/*
+ * encoded.bin 是一般檔案時整個 mmap 進來，bit reader 與平行解碼直接讀
+ * 映射，不必再 fread 一份；pipe 等無法 mmap 的輸入則維持用 FILE 讀。
+ * 檔頭（container / framed header）仍用 fread 解析，FILE 的位置代表
+ * 已經讀到哪裡，兩種來源都以它為準。
+ */
+typedef struct DecInput {
+    const unsigned char *map;   // 整個檔案的映射；NULL 表示沒有 mmap
+    size_t               len;   // 檔案大小
+    unsigned char        head[4];   // 沒有 mmap 時，已經從 FILE 讀走、
+    size_t               head_len;  // 要先交給 bit reader 的 bytes
+} DecInput;
+
+static void input_map(DecInput* in, FILE* fp) {
+    struct stat st;
+    in->map = NULL;
+    in->len = 0;
+    if (in->head_len > 0) return;   // pipe：本來就不能 mmap
+    if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) return;
+
+    void* m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (m == MAP_FAILED) return;   // 例如檔案系統不支援：退回 fread
+    in->map = (const unsigned char*)m;
+    in->len = (size_t)st.st_size;
+}
+
+static void input_unmap(DecInput* in) {
+    if (in->map) munmap((void*)in->map, in->len);
+    in->map = NULL;
+}
+
+/*
+ * 取得從 fp 目前位置開始的最多 want bytes，並把 fp 往後移過這些 bytes。
+ * 有 mmap 時直接指到映射裡（*owned 為 NULL），否則 malloc 一塊來 fread
+ * （*owned 由呼叫端 free）。實際拿到的 byte 數放在 *got。
+ */
+static const unsigned char* input_take(const DecInput* in, FILE* fp, size_t want,
+                                       size_t* got, unsigned char** owned) {
+    if (in->map) {
+        long   pos   = ftell(fp);
+        size_t avail = (pos >= 0 && (size_t)pos < in->len) ? in->len - (size_t)pos : 0;
+        *got   = want < avail ? want : avail;
+        *owned = NULL;
+        fseek(fp, (long)*got, SEEK_CUR);
+        return in->map + (avail ? (size_t)pos : 0);
+    }
+
+    *owned = (unsigned char*)malloc(want ? want : 1);
+    if (!*owned) {
+        fprintf(stderr, "decoder: memory allocation failed\n");
+        exit(1);
+    }
+    *got = fread(*owned, 1, want, fp);
+    return *owned;
+}
+
+/* 從 fp 目前位置開始讀 payload（最多 bit_limit 個有效 bit，-1 表示到檔尾）：
+   有 mmap 時直接讀映射，否則用檔案模式的 bit reader */
+static void br_init_input(HuffBitReader* br, const DecInput* in, FILE* fp, long bit_limit) {
+    if (!in->map) {
+        if (huff_br_init(br, fp, bit_limit) != 0) dec_nomem();
+        memcpy(br->own_buf, in->head, in->head_len);
+        br->buf_len = in->head_len;
+        return;
+    }
+    size_t got;
+    unsigned char* owned;
+    const unsigned char* data = input_take(in, fp, in->len, &got, &owned);
+    long total = (long)got * 8;
+    if (bit_limit >= 0 && bit_limit < total) total = bit_limit;
+    huff_br_init_mem(br, data, got, total);
+}
+
+/* ------------------------------ 輸出 -------------------------------------- */
+
+/*
+ * 解碼前就知道要輸出幾個 symbol，輸出是一般檔案時先用 posix_fallocate
+ * 把檔案放大到這個大小（空間先配好，之後寫映射不會因為磁碟滿而 SIGBUS），
+ * 再整個 mmap 進來，解碼器直接把 symbol 寫進檔案對應的記憶體；平行解碼
+ * 的各段也各自寫自己的位置，不需要協調。pipe、framed 格式（事先不知道
+ * 總大小）或放大失敗時，退回整批 fwrite。結束時依實際寫出的數量截斷
+ * 檔案，出錯時只留下出錯前的部分，與 fwrite 的結果相同。
+ */
+typedef struct DecOutput {
+    FILE          *fp;
+    const char    *enc_fn; // 正在解的檔案，只用在錯誤訊息
+    unsigned char *map;    // 輸出檔的映射；NULL 表示用 fwrite
+    size_t         size;   // 映射（預先放大後的檔案）大小
+    long           pos;    // 已經寫出的 byte 數
+} DecOutput;
+
+// 開啟輸出檔。寫入映射需要可讀寫的 fd，只對一般檔案重開成 O_RDWR（pipe
+// 用 O_RDWR 開會連讀取端一起持有，讀的一方結束後不會收到 SIGPIPE）；
+// 重開失敗（例如只有寫入權限）就維持純寫入，之後退回 fwrite
+static FILE* output_fopen(const char* fn) {
+    struct stat st;
+    int fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        int rw = open(fn, O_RDWR);
+        if (rw >= 0) {
+            close(fd);
+            fd = rw;
+        }
+    }
+    FILE* fp = fdopen(fd, "w");
+    if (!fp) close(fd);
+    return fp;
+}
+
+static void output_open(DecOutput* o, FILE* fp, const char* enc_fn, long size) {
+    struct stat st;
+    o->fp     = fp;
+    o->enc_fn = enc_fn;
+    o->map    = NULL;
+    o->size   = 0;
+    o->pos    = 0;
+    if (size <= 0 || fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode)) return;
+    if (posix_fallocate(fileno(fp), 0, (off_t)size) != 0) return;
+
+    void* m = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(fp), 0);
+    if (m == MAP_FAILED) {
+        // 退回 fwrite：先把預先放大的部分截掉
+        if (ftruncate(fileno(fp), 0) != 0) {
+            log_error("decoder", "cannot_truncate_output size=0 input_encoded=%s", o->enc_fn);
+        }
+        return;
+    }
+    o->map  = (unsigned char*)m;
+    o->size = (size_t)size;
+}
+
+// 下一批輸出要放哪裡：有映射時直接是檔案裡的位置，否則是暫存區 buf
+static unsigned char* output_at(const DecOutput* o, unsigned char* buf) {
+    return o->map ? o->map + o->pos : buf;
+}
+
+// 寫出從 p 開始的 n 個 symbol（p 已經是映射裡的下一個位置時只要往前移）
+static void output_put(DecOutput* o, const unsigned char* p, long n) {
+    if (n <= 0) return;
+    if (!o->map) {
+        fwrite(p, 1, (size_t)n, o->fp);
+    } else if (p != o->map + o->pos) {
+        memcpy(o->map + o->pos, p, (size_t)n);
+    }
+    o->pos += n;
+}
+
+// 一次放得下 n 個 symbol 的輸出區：映射夠大時就是映射本身，否則 malloc
+static unsigned char* output_region(const DecOutput* o, long n) {
+    if (o->map && (size_t)(o->pos + n) <= o->size) return o->map + o->pos;
+    unsigned char* p = (unsigned char*)malloc(n > 0 ? (size_t)n : 1);
+    if (!p) {
+        fprintf(stderr, "decoder: memory allocation failed\n");
+        exit(1);
+    }
+    return p;
+}
+
+static void output_region_free(const DecOutput* o, unsigned char* p) {
+    if (!o->map || p < o->map || p >= o->map + o->size) free(p);
+}
+
+// 解除映射，並把檔案截到實際寫出的大小
+static void output_close(DecOutput* o) {
+    if (!o->map) return;
+    munmap(o->map, o->size);
+    o->map = NULL;
+    if ((size_t)o->pos < o->size && ftruncate(fileno(o->fp), (off_t)o->pos) != 0) {
+        log_error("decoder", "cannot_truncate_output size=%ld input_encoded=%s",
+                  o->pos, o->enc_fn);
+    }
+}
+
+
+// 查表解一個 symbol：成功回傳 1；資料用完回傳 0；invalid codeword 回傳 -1
+static inline int lut_decode_one(const HuffLutEntry* tab, HuffBitReader* br,
+                                 unsigned char* sym, long* bad_bit) {
+    huff_br_refill(br);
+    const HuffLutEntry* e = &tab[huff_br_peek(br, HUFF_LUT_ROOT_BITS)];
+
+    while (e->kind == HUFF_LUT_SUB) {
+        huff_br_consume(br, e->len);
+        huff_br_refill(br);
+        e = &tab[e->next + huff_br_peek(br, e->sub_bits)];
+    }
+
+    long end = huff_br_consumed(br) + e->len;
+    if (!huff_br_within(br, end)) return 0;
+    if (e->kind == HUFF_LUT_INVALID) {
+        *bad_bit = end;
+        return -1;
+    }
+    huff_br_consume(br, e->len);
+    *sym = e->symbol;
+    return 1;
+}
+
+/* ============================================================================
+ * 多 symbol 查表（一次查表解出好幾個 symbol）
+ * ==========================================================================*/
+
+/*
+ * 文字的平均 code 長度只有 4~5 bits，一次 peek MULTI_BITS 個 bit 常常能
+ * 涵蓋兩三個完整的 code。表格的每個 entry 存這些 bit 能完整解出的
+ * 前幾個 symbol（最多 MULTI_MAX_SYMS 個，打包成一個 uint32）以及它們
+ * 總共用掉的 bit 數，解碼時一次寫出 4 bytes、前進 nsym 個 symbol。
+ *
+ * 第一個 code 就超過 MULTI_BITS（或是 invalid codeword）的 entry 的
+ * nsym 為 0，改用一般的 LUT 解一個 symbol，所以結果與 LUT 完全相同。
+ */
+
+#define MULTI_BITS     12   // 2^12 個 entry
+#define MULTI_MAX_SYMS 4    // 每個 entry 最多幾個 symbol（packed 進 uint32）
+
+typedef struct MultiEntry {
+    uint32_t syms;   // symbol 依序放在 byte 0、1、2、3（little-endian 寫出即為原順序）
+    uint8_t  nsym;   // 0 表示要改用一般 LUT
+    uint8_t  bits;   // nsym 個 symbol 總共用掉的 bit 數
+} MultiEntry;
+
+typedef struct MultiTable {
+    MultiEntry *entries;   // 2^MULTI_BITS 個
+    HuffLutTable    lut;       // nsym == 0 或最後不滿一批時用
+} MultiTable;
+
+static void multi_build(MultiTable* m, const HuffDTree* tree) {
+    size_t size = (size_t)1 << MULTI_BITS;
+    m->entries = (MultiEntry*)calloc(size, sizeof(MultiEntry));
+    if (!m->entries) {
+        fprintf(stderr, "decoder: memory allocation failed\n");
+        exit(1);
+    }
+    lut_build(&m->lut, tree);
+
+    for (size_t idx = 0; idx < size; idx++) {
+        MultiEntry e = {0, 0, 0};
+        int cur = 0;
+
+        for (int b = 0; b < MULTI_BITS && e.nsym < MULTI_MAX_SYMS; b++) {
+            int  bit = (int)((idx >> (MULTI_BITS - 1 - b)) & 1);
+            HuffDRef k   = tree->kids[cur][bit];
+            if (k == HUFF_DT_NONE) break;   // invalid：前面已解出的照用，後面交給 LUT
+            if (k & HUFF_DT_LEAF) {
+                e.syms |= (uint32_t)(uint8_t)k << (8 * e.nsym);
+                e.nsym++;
+                e.bits = (uint8_t)(b + 1);
+                cur = 0;
+            } else {
+                cur = k;
+            }
+        }
+        m->entries[idx] = e;
+    }
+}
+
+static void multi_free(MultiTable* m) {
+    free(m->entries);
+    m->entries = NULL;
+    huff_lut_free(&m->lut);
+}
+
+/*
+ * 用多 symbol 表解碼最多 max_syms 個 symbol（與 huff_decode_lut 相同介面）。
+ * 一次寫出 4 bytes，所以只在還剩至少 MULTI_MAX_SYMS 個名額時走快速路徑。
+ */
+static long decode_multi(const MultiTable* m, HuffBitReader* br,
+                         unsigned char* out, long max_syms, long* bad_bit) {
+    const MultiEntry* tab = m->entries;
+    const HuffLutEntry*   lut = m->lut.entries;
+    long n = 0;
+
+    while (n + MULTI_MAX_SYMS <= max_syms) {
+        huff_br_refill(br);
+        const MultiEntry* e = &tab[huff_br_peek(br, MULTI_BITS)];
+        if (e->nsym > 0 && huff_br_within(br, huff_br_consumed(br) + e->bits)) {
+            unsigned char w[4];
+            w[0] = (unsigned char)e->syms;
+            w[1] = (unsigned char)(e->syms >> 8);
+            w[2] = (unsigned char)(e->syms >> 16);
+            w[3] = (unsigned char)(e->syms >> 24);
+            memcpy(out + n, w, 4);
+            n += e->nsym;
+            huff_br_consume(br, e->bits);
+            continue;
+        }
+        // 長 code、invalid codeword 或資料快用完：一次解一個
+        if (lut_decode_one(lut, br, &out[n], bad_bit) != 1) return n;
+        n++;
+    }
+    while (n < max_syms) {
+        if (lut_decode_one(lut, br, &out[n], bad_bit) != 1) break;
+        n++;
+    }
+    return n;
+}
+
+/* ============================================================================
+ * 逐 byte 的有限狀態機（FSM）解碼
+ * ==========================================================================*/
+
+/*
+ * 解碼樹的每個內部節點直接當成一個狀態（節點編號就是狀態編號，root
+ * 為狀態 0）。從某個狀態吃進一整個 byte，會走過 8 個 bit、沿路解出 0~8 個
+ * symbol，最後停在另一個內部節點；這些結果事先算好存成 [狀態][byte]
+ * 表格，解碼時每個 byte 只查一次表，完全不需要 bit 位移。
+ *
+ * 走到不存在的路徑（invalid codeword）時記下是這個 byte 的第幾個 bit，
+ * 錯誤位置因此與逐 bit 解碼相同。container 最後一個不完整的 byte
+ * （payload_bits 不是 8 的倍數）改用樹的 kids[] 逐 bit 走。
+ */
+
+typedef struct FsmEntry {
+    uint16_t next;      // 吃完這個 byte 後的狀態
+    uint8_t  nsym;      // 解出幾個 symbol
+    uint8_t  bad;       // 0 = 正常；1~8 = 第幾個 bit 走到不存在的路徑
+    uint8_t  syms[8];
+} FsmEntry;
+
+typedef struct Fsm {
+    FsmEntry   *table;     // nstates * 256 個 entry
+    const HuffDRef (*kids)[2]; // 借用解碼樹的 kids[狀態][bit]
+    int         nstates;
+} Fsm;
+
+static void fsm_build(Fsm* f, const HuffDTree* tree) {
+    f->nstates = tree->nnodes;
+    f->kids    = (const HuffDRef (*)[2])tree->kids;
+    f->table   = (FsmEntry*)calloc((size_t)f->nstates * 256, sizeof(FsmEntry));
+    if (!f->table) {
+        fprintf(stderr, "decoder: memory allocation failed\n");
+        exit(1);
+    }
+
+    for (int st = 0; st < f->nstates; st++) {
+        for (int byte = 0; byte < 256; byte++) {
+            FsmEntry* e = &f->table[st * 256 + byte];
+            int cur = st;
+            for (int b = 0; b < 8; b++) {
+                HuffDRef k = f->kids[cur][(byte >> (7 - b)) & 1];
+                if (k == HUFF_DT_NONE) {
+                    e->bad = (uint8_t)(b + 1);
+                    break;
+                }
+                if (k & HUFF_DT_LEAF) {
+                    e->syms[e->nsym++] = (uint8_t)k;
+                    cur = 0;
+                } else {
+                    cur = k;
+                }
+            }
+            e->next = (uint16_t)cur;
+        }
+    }
+}
+
+static void fsm_free(Fsm* f) {
+    free(f->table);
+    f->table = NULL;
+    f->kids  = NULL;
+}
+
+/*
+ * 從 br 逐 byte 讀 payload，解出最多 max_syms 個 symbol 寫到 o。
+ * 回傳解出的數量；invalid codeword 的位置放在 *bad_bit（從 1 起算）。
+ * 每補一次 bit 就把 acc 裡所有完整的 byte（至少 7 個）一口氣查完。
+ */
+static long decode_fsm(const Fsm* f, HuffBitReader* br, DecOutput* o,
+                       long max_syms, long* bad_bit) {
+    // 一輪最多查 8 個 byte、每個固定寫 8 bytes，所以多留 64 bytes
+    unsigned char* out = (unsigned char*)malloc(DEC_OUT_BUF_SIZE + 64);
+    if (!out) {
+        fprintf(stderr, "decoder: memory allocation failed\n");
+        exit(1);
+    }
+
+    long n     = 0;     // 已解出的 symbol 數
+    long nout  = 0;     // out 中還沒寫出的數量
+    int  state = 0;
+    int  done  = 0;
+
+    while (!done && n < max_syms) {
+        if (nout > DEC_OUT_BUF_SIZE) {
+            output_put(o, out, nout);
+            nout = 0;
+        }
+
+        huff_br_refill(br);
+        long base   = huff_br_consumed(br);
+        int  nbytes = br->nbits >> 3;   // acc 裡完整的 byte 數
+        while (nbytes > 0 && !huff_br_within(br, base + 8L * nbytes)) nbytes--;
+
+        if (nbytes == 0) {
+            // 最後一個不完整的 byte（或已經沒有資料）：只走到有效的 bit 為止
+            for (int b = 0; huff_br_within(br, base + b + 1) && n < max_syms; b++) {
+                HuffDRef k = f->kids[state][huff_br_peek(br, 1)];
+                huff_br_consume(br, 1);
+                if (k == HUFF_DT_NONE) {
+                    *bad_bit = base + b + 1;
+                    break;
+                }
+                if (k & HUFF_DT_LEAF) {
+                    out[nout++] = (unsigned char)k;
+                    n++;
+                    state = 0;
+                } else {
+                    state = k;
+                }
+            }
+            break;
+        }
+
+        uint64_t w = br->acc;
+        int k;
+        for (k = 0; k < nbytes; k++) {
+            const FsmEntry* e = &f->table[state * 256 + (int)(w >> 56)];
+            w <<= 8;
+
+            long take = e->nsym;
+            if (take > max_syms - n) take = max_syms - n;
+            memcpy(out + nout, e->syms, 8);   // 固定 8 bytes，多的會被下一批蓋掉
+            nout += take;
+            n    += take;
+            if (n == max_syms) {   // 夠了，後面的 bit（含 padding）不用看
+                done = 1;
+                break;
+            }
+            if (e->bad) {
+                *bad_bit = base + 8L * k + e->bad;
+                done = 1;
+                break;
+            }
+            state = e->next;
+        }
+        huff_br_consume(br, 8 * (k < nbytes ? k + 1 : nbytes));
+    }
+
+    output_put(o, out, nout);
+    free(out);
+    return n;
+}
+
 /* ============================================================================
- * Huffman 解碼樹節點定義與相關函式
+ * 以計數為基礎的 canonical 解碼（不建樹、不建表）
  * ==========================================================================*/
 
-typedef struct DNode {
-    char symbol;           // 葉節點存放的字元
-    int  isLeaf;           // 1 = 葉節點, 0 = 內部節點
-    struct DNode *left;
-    struct DNode *right;
-} DNode;
-
-// 建立新節點
-static DNode* create_node(void) {
-    DNode* n = (DNode*)malloc(sizeof(DNode));
-    if (!n) {
-        // 這裡用 fprintf 是避免 logger 本身也出問題時陷入循環
+/*
+ * canonical code 裡同一長度的 code 是連續的整數，因此只要知道每個長度
+ * 的第一個 code（first）、有幾個 code（count）、以及它們在依
+ * (長度, symbol) 排好的 symbol 清單中的起點（offset），就能解碼：
+ * 從最短的長度開始，取接下來 len 個 bit 當成整數 code，
+ * 若 code - first[len] < count[len]，symbol 就是 symbol[offset[len] + 差值]。
+ *
+ * 整個解碼器只有五百多 bytes，適合同時開很多 stream、記憶體又很緊的情境；
+ * 代價是每個 symbol 要逐一比較長度，比查表慢。
+ */
+
+#define CANON_MAX_LEN 32   // first 用 uint32 存，更長的 code 請改用其他 engine
+
+typedef struct CanonDecoder {
+    uint32_t first[CANON_MAX_LEN + 1];   // 每個長度第一個 code 的值
+    uint16_t count[CANON_MAX_LEN + 1];   // 每個長度有幾個 code
+    uint16_t offset[CANON_MAX_LEN + 1];  // 每個長度在 symbol[] 中的起點
+    uint8_t  symbol[HUFF_NUM_SYMBOLS];   // 依 (長度, symbol) 排序
+    uint8_t  min_len;                    // 最短 / 最長的 code 長度（沒有 code 時為 0）
+    uint8_t  max_len;
+} CanonDecoder;
+
+/* 由 code 長度建出解碼器；長度超過 CANON_MAX_LEN 時回傳 -1。
+   長度本身是否合法（Kraft 不等式）由 huff_canonical_codes 檢查 */
+static int canon_build(CanonDecoder* c, const int lens[HUFF_NUM_SYMBOLS]) {
+    memset(c, 0, sizeof(*c));
+    for (int s = 0; s < HUFF_NUM_SYMBOLS; s++) {
+        if (lens[s] > CANON_MAX_LEN) return -1;
+        if (lens[s] > 0) c->count[lens[s]]++;
+    }
+
+    uint64_t code = 0;
+    int      idx  = 0;
+    for (int len = 1; len <= CANON_MAX_LEN; len++) {
+        code = (code + c->count[len - 1]) << 1;   // count[0] 恆為 0
+        c->first[len]  = (uint32_t)code;
+        c->offset[len] = (uint16_t)idx;
+        for (int s = 0; s < HUFF_NUM_SYMBOLS; s++) {
+            if (lens[s] == len) c->symbol[idx++] = (uint8_t)s;
+        }
+        if (c->count[len] > 0) {
+            if (c->min_len == 0) c->min_len = (uint8_t)len;
+            c->max_len = (uint8_t)len;
+        }
+    }
+    return 0;
+}
+
+/*
+ * 接下來的 bit 對不上任何 code 時，找出逐 bit 走樹會在第幾個 bit 走到
+ * 不存在的路徑（從 win 的最高位起算）。canonical code 的樹在每一層都是
+ * 先排葉節點、再排內部節點，所以第 len 層存在的節點是從 first[len] 起
+ * 連續的 nodes[len] 個：nodes[len] = count[len] + ceil(nodes[len+1] / 2)。
+ */
+static int canon_bad_len(const CanonDecoder* c, uint64_t win) {
+    uint32_t nodes[CANON_MAX_LEN + 2];
+    nodes[c->max_len + 1] = 0;
+    for (int len = c->max_len; len >= 1; len--) {
+        nodes[len] = c->count[len] + (nodes[len + 1] + 1) / 2;
+    }
+    for (int len = 1; len <= c->max_len; len++) {
+        uint32_t code = (uint32_t)(win >> (64 - len));
+        if (code - c->first[len] >= nodes[len]) return len;
+    }
+    return c->max_len;   // 不會發生：走完 max_len 層一定會碰到葉節點或空路徑
+}
+
+/*
+ * 以長度比較解碼最多 max_syms 個 symbol（與 huff_decode_lut 相同介面）。
+ */
+static long decode_canon(const CanonDecoder* c, HuffBitReader* br,
+                         unsigned char* out, long max_syms, long* bad_bit) {
+    int  min_len = c->min_len, max_len = c->max_len;
+    long n = 0;
+
+    if (max_len == 0) return 0;   // 空的 codebook：沒有任何 symbol 可解
+
+    while (n < max_syms) {
+        huff_br_refill(br);
+        uint64_t win = br->acc;
+        int len = min_len;
+        for (; len <= max_len; len++) {
+            uint32_t code = (uint32_t)(win >> (64 - len));
+            if (code - c->first[len] < c->count[len]) break;
+        }
+
+        if (len > max_len) {
+            // invalid codeword：只在出錯位置仍是有效資料時才回報
+            long end = huff_br_consumed(br) + canon_bad_len(c, win);
+            if (huff_br_within(br, end)) *bad_bit = end;
+            break;
+        }
+
+        long end = huff_br_consumed(br) + len;
+        if (!huff_br_within(br, end)) break;   // 剩下的 bit 不足一個完整 codeword
+
+        uint32_t code = (uint32_t)(win >> (64 - len));
+        out[n++] = c->symbol[c->offset[len] + (code - c->first[len])];
+        huff_br_consume(br, len);
+    }
+    return n;
+}
+
+/* ============================================================================
+ * framed 格式解碼
+ * ==========================================================================*/
+
+/*
+ * 逐一讀 block header → 用該 block 的 code 長度建解碼樹（lut engine 再建表）
+ * → 讀入 payload 解出 raw_len 個 symbol。格式定義見 huffman.h。
+ * fenc 必須已經讀過檔案 header。成功回傳 0。
+ */
+static int decode_framed(FILE* fenc, const char* enc_fn, DecOutput* o, long block_size,
+                         int use_lut, long* num_decoded, long* expected, long* num_blocks) {
+    unsigned char  hdr[HUFF_FR_BLOCK_HEADER_SIZE];
+    unsigned char* payload     = NULL;
+    size_t         payload_cap = 0;
+    unsigned char* out_buf     = (unsigned char*)malloc((size_t)block_size);
+    int            ret         = 0;
+    // code 字串表（64 KiB）：批次模式下可能同時解好幾個檔案，不能是 static
+    char (*codes)[HUFF_MAX_CODE_LEN + 1] =
+        (char (*)[HUFF_MAX_CODE_LEN + 1])malloc(sizeof(char[HUFF_NUM_SYMBOLS][HUFF_MAX_CODE_LEN + 1]));
+
+    if (!out_buf || !codes) {
         fprintf(stderr, "decoder: memory allocation failed\n");
         exit(1);
     }
-    n->symbol = 0;
-    n->isLeaf = 0;
-    n->left = n->right = NULL;
+
+    while (1) {
+        if (fread(hdr, 1, HUFF_FR_END_SIZE, fenc) != HUFF_FR_END_SIZE) {
+            log_error("decoder", "invalid_frame block=%ld reason=truncated_header input_encoded=%s",
+                      *num_blocks, enc_fn);
+            ret = -1;
+            break;
+        }
+        if (huff_frame_raw_len(hdr) == 0) break;   // 結束標記
+
+        HuffFrameBlock blk;
+        size_t rest = HUFF_FR_BLOCK_HEADER_SIZE - HUFF_FR_END_SIZE;
+        if (fread(hdr + HUFF_FR_END_SIZE, 1, rest, fenc) != rest ||
+            huff_frame_parse_block(hdr, &blk) != 0 || blk.raw_len > block_size) {
+            log_error("decoder", "invalid_frame block=%ld reason=bad_header input_encoded=%s",
+                      *num_blocks, enc_fn);
+            ret = -1;
+            break;
+        }
+
+        HuffDTree tree;
+        if (tree_from_lengths(&tree, blk.lens, codes) != 0) {
+            log_error("decoder", "invalid_frame block=%ld reason=code_lengths input_encoded=%s",
+                      *num_blocks, enc_fn);
+            ret = -1;
+            break;
+        }
+
+        size_t nbytes = (size_t)((blk.payload_bits + 7) / 8);
+        if (nbytes > payload_cap) {
+            unsigned char* np = (unsigned char*)realloc(payload, nbytes);
+            if (!np) {
+                fprintf(stderr, "decoder: memory allocation failed\n");
+                exit(1);
+            }
+            payload     = np;
+            payload_cap = nbytes;
+        }
+        if (fread(payload, 1, nbytes, fenc) != nbytes) {
+            log_error("decoder", "invalid_frame block=%ld reason=truncated_payload input_encoded=%s",
+                      *num_blocks, enc_fn);
+            huff_dtree_free(&tree);
+            ret = -1;
+            break;
+        }
+
+        HuffBitReader br;
+        long bad_bit = 0;
+        long got;
+        huff_br_init_mem(&br, payload, nbytes, blk.payload_bits);
+        if (use_lut) {
+            HuffLutTable lut;
+            lut_build(&lut, &tree);
+            got = huff_decode_lut(&lut, &br, out_buf, blk.raw_len, &bad_bit);
+            huff_lut_free(&lut);
+        } else {
+            got = huff_decode_tree(&tree, &br, out_buf, blk.raw_len, &bad_bit);
+        }
+        huff_dtree_free(&tree);
+
+        output_put(o, out_buf, got);
+        *num_decoded += got;
+        *expected    += blk.raw_len;
+        (*num_blocks)++;
+
+        if (bad_bit > 0) {
+            log_error("decoder",
+                      "invalid_codeword block=%ld bit_position=%ld reason=unexpected_prefix "
+                      "input_encoded=%s",
+                      *num_blocks - 1, bad_bit, enc_fn);
+            ret = -1;
+            break;
+        }
+        if (got != blk.raw_len) break;   // payload 不足，交給呼叫端比對數量
+    }
+
+    free(payload);
+    free(out_buf);
+    free(codes);
+    return ret;
+}
+
+/* ============================================================================
+ * sync index 平行解碼
+ * ==========================================================================*/
+
+/*
+ * container 的 sync index 記錄了每 interval 個 symbol 在 payload 中的
+ * bit offset。相鄰的 checkpoint 區間分成幾組連續的段，每個執行緒從段首
+ * 的 bit offset 開始解，結果直接寫到輸出緩衝區中對應的 symbol 位置。
+ * 解碼樹 / 查表只讀不寫，所有執行緒共用。各段都是共用執行緒池（見
+ * huffman.h 與下面的 DecPool）裡的 task，pool 是 NULL 時循序執行，結果
+ * 相同。
+ */
+#define MAX_THREADS     HUFF_POOL_MAX_THREADS
+#define POOL_QUEUE_CAP  64   // 每個 worker 的 deque 容量（見 huffman.h 的執行緒池）
+
+/*
+ * 單檔模式的 pool 在真的要分成多段解碼時才建立：小檔案或循序解碼不必
+ * 開執行緒。批次模式由 main 事先建好（threads 為 0），各檔案同時使用時
+ * 不會再寫入這個結構。
+ */
+typedef struct DecPool {
+    HuffPool *pool;      // NULL 表示還沒建立或單執行緒
+    int       threads;   // 單檔模式要開的 worker 數；批次模式為 0
+    int       tried;     // 已經試過建立（失敗就維持單執行緒，不再重試）
+} DecPool;
+
+static HuffPool* dec_pool(DecPool* dp) {
+    if (!dp->pool && !dp->tried && dp->threads > 1) {
+        dp->pool  = huff_pool_new(dp->threads, POOL_QUEUE_CAP);
+        dp->tried = 1;
+    }
+    return dp->pool;
+}
+
+// 每個 worker 一行忙碌／閒置統計（沒有 pool 或沒有執行過 task 時不輸出）
+static void log_pool_stats(HuffPool* pool) {
+    long tasks = 0;
+    for (int w = 0; w < huff_pool_threads(pool) && pool; w++) {
+        HuffPoolStats st;
+        huff_pool_stats(pool, w, &st);
+        tasks += st.tasks;
+    }
+    for (int w = 0; w < huff_pool_threads(pool) && tasks > 0; w++) {
+        HuffPoolStats st;
+        huff_pool_stats(pool, w, &st);
+        log_info("metrics", "pool_worker worker=%d tasks=%ld steals=%ld "
+                 "busy_sec=%.15f idle_sec=%.15f",
+                 w, st.tasks, st.steals, st.busy_sec, st.idle_sec);
+    }
+}
+
+typedef struct SegTask {
+    const HuffLutTable      *lut;       // NULL 表示用 tree engine
+    const HuffDTree         *tree;
+    const unsigned char *payload;
+    size_t               payload_len;
+    long                 payload_bits;
+    long                 bit_start;  // 這段在 payload 中的起始 bit
+    long                 bit_end;    // 下一段的起始 bit（解完應該剛好停在這裡）
+    unsigned char       *out;        // 這段輸出的開頭
+    long                 nsyms;      // 這段應解出的 symbol 數
+    long                 got;        // 實際解出的 symbol 數
+    long                 bad_bit;    // invalid codeword 的位置（payload 中的絕對 bit）
+    long                 end_bit;    // 實際停下來的 bit
+} SegTask;
+
+static void* seg_worker(void* arg) {
+    SegTask* t = (SegTask*)arg;
+    HuffBitReader br;
+    long base = huff_br_init_at(&br, t->payload, t->payload_len, t->payload_bits,
+                           t->bit_start);
+
+    t->bad_bit = 0;
+    if (t->lut) t->got = huff_decode_lut(t->lut, &br, t->out, t->nsyms, &t->bad_bit);
+    else        t->got = huff_decode_tree(t->tree, &br, t->out, t->nsyms, &t->bad_bit);
+    if (t->bad_bit > 0) t->bad_bit += base;
+    t->end_bit = huff_br_consumed(&br) + base;
+    return NULL;
+}
+
+/*
+ * 讀入整個 payload 與 sync index 後平行解碼（fenc 已讀過 container header）。
+ * 寫出的內容與循序解碼相同；出錯時只寫出出錯位置之前的部分。
+ * 成功回傳 0；*used_threads 為實際使用的執行緒數，*sync_points 為 checkpoint 數。
+ */
+static int decode_container_parallel(DecPool* dp, const DecInput* in, FILE* fenc,
+                                     const char* enc_fn, DecOutput* o, const HuffContainerHeader* ct,
+                                     const HuffDTree* tree, int use_lut, int threads,
+                                     long* num_decoded, int* used_threads,
+                                     long* sync_points) {
+    size_t         nbytes   = (size_t)((ct->payload_bits + 7) / 8);
+    unsigned char* out      = output_region(o, ct->original_size);
+    long*          offs     = NULL;
+    long           interval = 0;
+    long           count    = 0;
+    int            ret      = 0;
+
+    size_t         got_bytes;
+    unsigned char* owned;
+    const unsigned char* payload = input_take(in, fenc, nbytes, &got_bytes, &owned);
+    long   payload_bits = ct->payload_bits;
+    if (got_bytes < nbytes) {
+        // 檔案被截斷：跟循序解碼一樣解到資料用完為止
+        payload_bits = (long)got_bytes * 8;
+        interval     = 1;
+    } else if (huff_sync_read(fenc, &interval, &offs, &count) != 0 ||
+        (count > 0 && (count > (ct->original_size - 1) / interval ||
+                       offs[count - 1] > ct->payload_bits))) {
+        // index 壞了不影響 payload：當成沒有 checkpoint，整段循序解
+        log_error("decoder", "invalid_sync_index reason=truncated_or_inconsistent input_encoded=%s",
+                  enc_fn);
+        free(offs);
+        offs     = NULL;
+        count    = 0;
+        interval = 1;
+    }
+    *sync_points = count;
+
+    HuffLutTable lut;
+    if (use_lut) lut_build(&lut, tree);
+
+    // count 個 checkpoint 把 payload 切成 count + 1 個區間，再平均分給各執行緒
+    long nseg = count + 1;
+    int  n    = threads < nseg ? threads : (int)nseg;
+    SegTask* tasks = (SegTask*)malloc(sizeof(SegTask) * (size_t)n);
+    if (!tasks) {
+        fprintf(stderr, "decoder: memory allocation failed\n");
+        exit(1);
+    }
+    for (int t = 0; t < n; t++) {
+        long a = nseg * t / n;         // 這組第一個區間
+        long b = nseg * (t + 1) / n;   // 下一組第一個區間
+        long sym_a = a * interval;
+        long sym_b = (b == nseg) ? ct->original_size : b * interval;
+
+        tasks[t].lut          = use_lut ? &lut : NULL;
+        tasks[t].tree         = tree;
+        tasks[t].payload      = payload;
+        tasks[t].payload_len  = got_bytes;
+        tasks[t].payload_bits = payload_bits;
+        tasks[t].bit_start    = (a == 0) ? 0 : offs[a - 1];
+        tasks[t].bit_end      = (b == nseg) ? payload_bits : offs[b - 1];
+        tasks[t].out          = out + sym_a;
+        tasks[t].nsyms        = sym_b - sym_a;
+    }
+    *used_threads = huff_pool_run(n > 1 ? dec_pool(dp) : NULL, tasks, sizeof(SegTask), n,
+                                  seg_worker);
+
+    // 依序檢查每一段；第一個出錯的段之前的輸出都是正確的
+    long good = 0;
+    for (int t = 0; t < n; t++) {
+        SegTask* sg = &tasks[t];
+        good += sg->got;
+        if (sg->bad_bit > 0) {
+            log_error("decoder",
+                      "invalid_codeword bit_position=%ld reason=unexpected_prefix input_encoded=%s",
+                      sg->bad_bit, enc_fn);
+            ret = -1;
+            break;
+        }
+        if (t == n - 1 && sg->got < sg->nsyms) {
+            break;   // payload 不足，交給呼叫端比對數量（與循序解碼相同）
+        }
+        if (sg->got != sg->nsyms || sg->end_bit != sg->bit_end) {
+            log_error("decoder",
+                      "invalid_sync_index segment=%d bit_position=%ld expected_bit=%ld "
+                      "input_encoded=%s",
+                      t, sg->end_bit, sg->bit_end, enc_fn);
+            ret = -1;
+            break;
+        }
+    }
+    output_put(o, out, good);
+    *num_decoded = good;
+
+    if (use_lut) huff_lut_free(&lut);
+    free(tasks);
+    free(owned);
+    output_region_free(o, out);
+    free(offs);
+    return ret;
+}
+
+/* ============================================================================
+ * 沒有 index 的舊檔案：推測式平行解碼
+ * ==========================================================================*/
+
+/*
+ * 舊的 encoded.bin 沒有任何 checkpoint，但 Huffman code 通常在幾十個
+ * bit 之內就會自我同步：從錯誤的位置開始解，解出的 symbol 邊界很快
+ * 就會跟正確的邊界重合，之後的結果就完全正確。
+ *
+ * 1. 檔案依 byte 平均切成 n 段，各執行緒從段首開始「猜」著解，一直解到
+ *    第一個超過段尾的 symbol 邊界，並記下開頭 SPEC_SYNC_WINDOW 個邊界。
+ * 2. 主執行緒依序接起來：第 0 段的起點本來就是對的；前一段結束的位置
+ *    是正確的邊界，從那裡開始逐個 symbol 循序解，直到碰上下一段記錄的
+ *    某個邊界（同步），之後直接沿用該段的結果。
+ * 3. 視窗內都同步不上（或該段在同步前就遇到 invalid codeword）時，
+ *    整段改成循序解碼，所以結果一定與循序解碼完全相同。
+ */
+#define SPEC_MIN_CHUNK   (256 * 1024)   // 每段至少的 bytes，太小不值得開執行緒
+#define SPEC_SYNC_WINDOW 4096           // 每段開頭記錄的 symbol 邊界數
+
+typedef struct DecEngine {
+    const HuffLutTable *lut;       // NULL 表示用 tree engine
+    const HuffDTree    *tree;
+    int             max_len;   // 最長 code 的長度
+} DecEngine;
+
+static long engine_decode(const DecEngine* d, HuffBitReader* br,
+                          unsigned char* out, long max_syms, long* bad_bit) {
+    if (d->lut) return huff_decode_lut(d->lut, br, out, max_syms, bad_bit);
+    return huff_decode_tree(d->tree, br, out, max_syms, bad_bit);
+}
+
+/*
+ * 一直解到位置 >= limit（相對於 br 起點）、解滿 max_syms 個、資料用完
+ * 或遇到 invalid codeword 為止。每批最多解 (limit - 目前位置) / max_len
+ * 個 symbol，保證不會超過 limit 之後的第一個邊界。
+ */
+static long decode_until(const DecEngine* d, HuffBitReader* br, long limit,
+                         unsigned char* out, long max_syms, long* bad_bit) {
+    long n = 0;
+    while (n < max_syms && huff_br_consumed(br) < limit) {
+        long batch = (limit - huff_br_consumed(br)) / d->max_len;
+        if (batch < 1) batch = 1;
+        if (batch > max_syms - n) batch = max_syms - n;
+
+        long got = engine_decode(d, br, out + n, batch, bad_bit);
+        n += got;
+        if (got < batch) break;
+    }
     return n;
 }
 
-// 將一個 codeword 插入 Huffman 解碼樹中
-static void insert_code(DNode* root, const char* code, char symbol) {
-    DNode* cur = root;
-    for (int i = 0; code[i] != '\0'; i++) {
-        if (code[i] == '0') {
-            if (!cur->left) cur->left = create_node();
-            cur = cur->left;
-        } else if (code[i] == '1') {
-            if (!cur->right) cur->right = create_node();
-            cur = cur->right;
+typedef struct SpecTask {
+    const DecEngine     *dec;
+    const unsigned char *payload;
+    size_t               len;
+    long                 total_bits;
+    long                 bit_start;   // 這段的起點（猜的）
+    long                 bit_limit;   // 這段的終點；解到第一個 >= 它的邊界
+    unsigned char       *out;         // 這段解出的 symbol（私有緩衝區）
+    long                 cap;
+    long                 got;
+    long                 bounds[SPEC_SYNC_WINDOW + 1];  // bounds[j]：第 j 個 symbol 的起點
+    long                 nbounds;
+    long                 end_bit;     // 實際停下來的位置
+    long                 bad_bit;     // invalid codeword 的絕對位置，0 表示沒有
+} SpecTask;
+
+static void* spec_worker(void* arg) {
+    SpecTask* t = (SpecTask*)arg;
+    HuffBitReader br;
+    long base  = huff_br_init_at(&br, t->payload, t->len, t->total_bits, t->bit_start);
+    long limit = t->bit_limit - base;
+
+    t->got        = 0;
+    t->bad_bit    = 0;
+    t->nbounds    = 1;
+    t->bounds[0]  = t->bit_start;
+
+    // 開頭逐個 symbol 解，記下每個邊界，供接段時比對
+    while (t->nbounds <= SPEC_SYNC_WINDOW && huff_br_consumed(&br) < limit) {
+        if (engine_decode(t->dec, &br, t->out + t->got, 1, &t->bad_bit) != 1) break;
+        t->got++;
+        t->bounds[t->nbounds++] = huff_br_consumed(&br) + base;
+    }
+
+    // 其餘整批解，緩衝區不夠就加倍
+    while (t->bad_bit == 0 && huff_br_consumed(&br) < limit &&
+           huff_br_within(&br, huff_br_consumed(&br) + 1)) {
+        if (t->got == t->cap) {
+            unsigned char* nb = (unsigned char*)realloc(t->out, (size_t)t->cap * 2);
+            if (!nb) {
+                fprintf(stderr, "decoder: memory allocation failed\n");
+                exit(1);
+            }
+            t->out  = nb;
+            t->cap *= 2;
+        }
+        long got = decode_until(t->dec, &br, limit, t->out + t->got,
+                                t->cap - t->got, &t->bad_bit);
+        t->got += got;
+        if (got == 0) break;
+    }
+
+    if (t->bad_bit > 0) t->bad_bit += base;
+    t->end_bit = huff_br_consumed(&br) + base;
+    return NULL;
+}
+
+/*
+ * 整個舊格式 payload 已在記憶體中（len bytes），用 threads 個執行緒解出
+ * 最多 expected 個 symbol 寫到 o。結果（包含出錯時寫出的部分與錯誤
+ * 位置）與循序解碼相同。成功回傳 0，遇到 invalid codeword 回傳 -1。
+ */
+static int decode_speculative(DecPool* dp, const char* enc_fn,
+                              const unsigned char* payload, size_t len, const DecEngine* dec, int threads, long expected,
+                              DecOutput* o, long* num_decoded, int* used_threads,
+                              long* fallbacks, long* resync_bits) {
+    long total_bits = (long)len * 8;
+    int  n = (int)(len / SPEC_MIN_CHUNK);
+    if (n > threads) n = threads;
+    if (n < 1) n = 1;
+
+    SpecTask*      tasks = (SpecTask*)malloc(sizeof(SpecTask) * (size_t)n);
+    unsigned char* out   = output_region(o, expected);
+    if (!tasks) {
+        fprintf(stderr, "decoder: memory allocation failed\n");
+        exit(1);
+    }
+    for (int t = 0; t < n; t++) {
+        size_t b0 = len * (size_t)t / (size_t)n;
+        size_t b1 = len * (size_t)(t + 1) / (size_t)n;
+        tasks[t].dec        = dec;
+        tasks[t].payload    = payload;
+        tasks[t].len        = len;
+        tasks[t].total_bits = total_bits;
+        tasks[t].bit_start  = (long)b0 * 8;
+        tasks[t].bit_limit  = (long)b1 * 8;
+        tasks[t].cap        = (long)(b1 - b0) * 2 + SPEC_SYNC_WINDOW;
+        tasks[t].out        = (unsigned char*)malloc((size_t)tasks[t].cap);
+        if (!tasks[t].out) {
+            fprintf(stderr, "decoder: memory allocation failed\n");
+            exit(1);
+        }
+    }
+    *used_threads = huff_pool_run(n > 1 ? dec_pool(dp) : NULL, tasks, sizeof(SpecTask), n,
+                                  spec_worker);
+
+    // 依序接段：pos 是目前確定正確的邊界，total 是已確定的 symbol 數
+    long pos     = 0;
+    long total   = 0;
+    long bad_bit = 0;
+    *fallbacks   = 0;
+    *resync_bits = 0;
+
+    for (int t = 0; t < n && total < expected && bad_bit == 0; t++) {
+        SpecTask* sg = &tasks[t];
+        HuffBitReader br;
+        long base = huff_br_init_at(&br, payload, len, total_bits, pos);
+        long j    = 0;
+
+        // 從 pos 循序解，直到落在這段記錄的某個邊界上
+        while (total < expected) {
+            long cur = huff_br_consumed(&br) + base;
+            while (j < sg->nbounds && sg->bounds[j] < cur) j++;
+            if (j == sg->nbounds || sg->bounds[j] == cur) break;
+            if (engine_decode(dec, &br, out + total, 1, &bad_bit) != 1) break;
+            total++;
+        }
+        if (bad_bit > 0) {
+            bad_bit += base;
+            break;
+        }
+        if (total == expected) break;
+        *resync_bits += huff_br_consumed(&br) + base - pos;
+
+        long cur = huff_br_consumed(&br) + base;
+        if (j < sg->nbounds && sg->bounds[j] == cur) {
+            // 同步了：第 j 個 symbol 之後都與循序解碼相同
+            long take = sg->got - j;
+            if (take > expected - total) take = expected - total;
+            memcpy(out + total, sg->out + j, (size_t)take);
+            total += take;
+            if (total < expected && sg->bad_bit > 0) bad_bit = sg->bad_bit;
+            pos = sg->end_bit;
+        } else {
+            // 視窗內同步不上：整段循序解
+            long limit = (t == n - 1) ? total_bits : sg->bit_limit;
+            (*fallbacks)++;
+            total += decode_until(dec, &br, limit - base, out + total,
+                                  expected - total, &bad_bit);
+            if (bad_bit > 0) bad_bit += base;
+            pos = huff_br_consumed(&br) + base;
+            if (pos < limit && bad_bit == 0) break;   // 資料用完
         }
     }
-    cur->isLeaf = 1;
-    cur->symbol = symbol;
+
+    output_put(o, out, total);
+    *num_decoded = total;
+
+    if (bad_bit > 0) {
+        log_error("decoder",
+                  "invalid_codeword bit_position=%ld reason=unexpected_prefix input_encoded=%s",
+                  bad_bit, enc_fn);
+    }
+    for (int t = 0; t < n; t++) free(tasks[t].out);
+    free(tasks);
+    output_region_free(o, out);
+    return bad_bit > 0 ? -1 : 0;
 }
 
-// 釋放整棵樹
-static void free_tree(DNode* root) {
-    if (!root) return;
-    free_tree(root->left);
-    free_tree(root->right);
-    free(root);
+/* ============================================================================
+ * 多 stream container 解碼
+ * ==========================================================================*/
+
+/*
+ * 第 i 個 symbol 在第 i % n 個 stream。每一輪迴圈每個 stream 各解一個
+ * symbol：n 條查表鏈彼此沒有相依，CPU 可以同時執行，不必等上一個
+ * symbol 的長度算出來才能做下一次查表。
+ */
+
+// n 固定時由編譯器展開內層迴圈
+static inline long decode_lut_streams_n(const HuffLutTable* t, HuffBitReader* brs, int n,
+                                        unsigned char* out, long count,
+                                        long* bad_bit, int* bad_stream) {
+    const HuffLutEntry* tab = t->entries;
+    long i = 0;
+
+    // 每個 stream 都還要解一個 symbol 的完整輪
+    for (; i + n <= count; i += n) {
+        for (int k = 0; k < n; k++) {
+            if (lut_decode_one(tab, &brs[k], &out[i + k], bad_bit) != 1) {
+                *bad_stream = k;
+                return i + k;
+            }
+        }
+    }
+    // 最後不滿一輪
+    for (int k = 0; i < count; i++, k++) {
+        if (lut_decode_one(tab, &brs[k], &out[i], bad_bit) != 1) {
+            *bad_stream = k;
+            return i;
+        }
+    }
+    return count;
+}
+
+static long decode_lut_streams(const HuffLutTable* t, HuffBitReader* brs, int n,
+                               unsigned char* out, long count,
+                               long* bad_bit, int* bad_stream) {
+    switch (n) {
+        case 4:  return decode_lut_streams_n(t, brs, 4, out, count, bad_bit, bad_stream);
+        case 8:  return decode_lut_streams_n(t, brs, 8, out, count, bad_bit, bad_stream);
+        default: return decode_lut_streams_n(t, brs, n, out, count, bad_bit, bad_stream);
+    }
+}
+
+// tree engine：同樣依 stream 輪流，一次解一個 symbol
+static long decode_tree_streams(const HuffDTree* tree, HuffBitReader* brs, int n,
+                                unsigned char* out, long count,
+                                long* bad_bit, int* bad_stream) {
+    for (long i = 0; i < count; i++) {
+        int k = (int)(i % n);
+        if (huff_decode_tree(tree, &brs[k], &out[i], 1, bad_bit) != 1) {
+            *bad_stream = k;
+            return i;
+        }
+    }
+    return count;
+}
+
+/*
+ * 讀入整個多 stream payload（fenc 已讀過 container header），依 jump table
+ * 為每個 stream 建 bit reader 後解碼。成功回傳 0。
+ */
+static int decode_container_streams(const DecInput* in, FILE* fenc, const char* enc_fn,
+                                    DecOutput* o,
+                                    const HuffContainerHeader* ct,
+                                    const HuffDTree* tree, int use_lut,
+                                    long* num_decoded) {
+    int            n       = ct->streams;
+    size_t         nbytes  = (size_t)((ct->payload_bits + 7) / 8);
+    unsigned char* out     = output_region(o, ct->original_size);
+    HuffBitReader      brs[HUFF_CT_MAX_STREAMS];
+    int            ret     = 0;
+
+    // jump table → 各 stream 的起點；長度對不上就是壞檔
+    size_t         got;
+    unsigned char* owned;
+    const unsigned char* payload = input_take(in, fenc, nbytes, &got, &owned);
+    size_t off = 8 * (size_t)n;
+    int    ok  = (got == nbytes && nbytes >= off);
+    for (int k = 0; ok && k < n; k++) {
+        uint64_t bits = 0;
+        for (int b = 7; b >= 0; b--) bits = (bits << 8) | payload[8 * k + b];
+        size_t sbytes = (size_t)((bits + 7) / 8);
+        if (bits > (uint64_t)nbytes * 8 || sbytes > nbytes - off) {
+            ok = 0;
+            break;
+        }
+        huff_br_init_mem(&brs[k], payload + off, sbytes, (long)bits);
+        off += sbytes;
+    }
+    if (!ok) {
+        log_error("decoder", "invalid_container reason=stream_table input_encoded=%s", enc_fn);
+        free(owned);
+        output_region_free(o, out);
+        return -1;
+    }
+
+    long bad_bit    = 0;
+    int  bad_stream = 0;
+    HuffLutTable lut;
+    if (use_lut) {
+        lut_build(&lut, tree);
+        *num_decoded = decode_lut_streams(&lut, brs, n, out, ct->original_size,
+                                          &bad_bit, &bad_stream);
+        huff_lut_free(&lut);
+    } else {
+        *num_decoded = decode_tree_streams(tree, brs, n, out, ct->original_size,
+                                           &bad_bit, &bad_stream);
+    }
+    output_put(o, out, *num_decoded);
+
+    if (bad_bit > 0) {
+        log_error("decoder",
+                  "invalid_codeword stream=%d bit_position=%ld reason=unexpected_prefix "
+                  "input_encoded=%s",
+                  bad_stream, bad_bit, enc_fn);
+        ret = -1;
+    }
+    free(owned);
+    output_region_free(o, out);
+    return ret;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void print_usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [--engine=lut|tree|multi|fsm|canon] [--export-csv=path] "
+                    "[--threads=N] [--manifest=path] [-j N] "
+                    "enc_fn cb_fn out_fn [enc_fn cb_fn out_fn ...]\n", prog);
 }
 
 /*
@@ -99,58 +1328,102 @@ static char parse_symbol(const char* line) {
 }
 
 /* ============================================================================
- * 主程式
+ * codebook：讀檔、重建 code、建解碼樹與查表
  * ==========================================================================*/
 
-int main(int argc, char **argv) {
-    /* ========================================================================
-     * 步驟 1: 參數驗證
-     * ======================================================================== */
-    
-    if (argc != 4) {
-        log_error("decoder", "invalid_arguments argc=%d", argc);
-        fprintf(stderr, "Usage: %s enc_fn cb_fn out_fn\n", argv[0]);
-        return 1;
-    }
+/*
+ * 一份 codebook 解碼時需要的全部狀態。建好之後只讀不寫：批次模式下
+ * 用同一個 codebook 檔的檔案（可能同時在不同執行緒上解）共用同一份，
+ * CSV 只解析一次，樹與查表也只建一次。container 的 codebook 在各自的
+ * header 裡，每個檔案各建一份。
+ */
+typedef struct DecBook {
+    HuffCodebook cb;              // 讀進來的長度 / counts（匯出 CSV 用）
+    char  codes[HUFF_NUM_SYMBOLS][HUFF_MAX_CODE_LEN + 1];
+    int   canonical;              // codebook 是否為 canonical code
+    long  expected_symbols;       // 從 count 加總出來的符號總數
+    HuffDTree        tree;            // canon engine 不建樹
+    CanonDecoder canon;           // 只有 canon engine 用
+    int          tables;          // 建好了哪些查表（BOOK_*）
+    HuffLutTable     lut;
+    MultiTable   multi;
+    Fsm          fsm;
+} DecBook;
 
-    const char *enc_fn = argv[1];  // 編碼檔案（二進位資料）
-    const char *cb_fn  = argv[2];  // codebook 檔案（符號編碼表）
-    const char *out_fn = argv[3];  // 輸出檔案（還原的文字）
+#define BOOK_LUT   1
+#define BOOK_MULTI 2
+#define BOOK_FSM   4
 
-    /* ========================================================================
-     * 步驟 2: 記錄程式開始執行
-     * ======================================================================== */
-    
-    log_info("decoder",
-             "start input_encoded=%s input_codebook=%s output_file=%s",
-             enc_fn, cb_fn, out_fn);
+static DecBook* book_new(void) {
+    DecBook* b = (DecBook*)calloc(1, sizeof(DecBook));
+    if (!b) {
+        fprintf(stderr, "decoder: memory allocation failed\n");
+        exit(1);
+    }
+    return b;
+}
 
-    /* ========================================================================
-     * 步驟 3: Huffman 解碼主要邏輯
-     * ======================================================================== */
+// 釋放 codebook 與它的樹、查表（b 可以是 NULL）
+static void book_free(DecBook* b) {
+    if (!b) return;
+    huff_dtree_free(&b->tree);
+    if (b->tables & BOOK_LUT)   huff_lut_free(&b->lut);
+    if (b->tables & BOOK_MULTI) multi_free(&b->multi);
+    if (b->tables & BOOK_FSM)   fsm_free(&b->fsm);
+    free(b);
+}
 
-    int status_ok = 1;             // 解碼是否成功
-    long num_decoded_symbols = 0;  // 實際解出多少個 symbol
-    long expected_symbols = 0;     // 從 codebook 的 count 加總出來的符號總數
+// container header 裡的 codebook：只有長度，一律是 canonical code
+static void book_from_container(DecBook* b, const HuffContainerHeader* ct) {
+    memcpy(b->cb.lens, ct->lens, sizeof(b->cb.lens));
+    b->cb.total_symbols = ct->original_size;
+    b->canonical        = 1;
+    b->expected_symbols = ct->original_size;
+}
 
-    // 3-1. 讀取 codebook，建立 Huffman 解碼樹
-    FILE *fcb = fopen(cb_fn, "r");
+// 讀 codebook 檔（CSV 或二進位），失敗時記錄原因並回傳 -1；
+// enc_fn 是要用它解的檔案，只用在錯誤訊息
+static int book_read(DecBook* b, const char* cb_fn, const char* enc_fn) {
+    FILE* fcb = fopen(cb_fn, "rb");
     if (!fcb) {
-        log_error("decoder", "cannot_open_codebook file=%s", cb_fn);
-        log_info("decoder", "finish status=error");
-        return 1;
+        log_error("decoder", "cannot_open_codebook file=%s input_encoded=%s", cb_fn, enc_fn);
+        return -1;
     }
 
-    DNode* root = create_node();
+    unsigned char magic[4] = {0};
+    int is_bin = (fread(magic, 1, 4, fcb) == 4 && huff_codebook_is_bin(magic));
+    rewind(fcb);
+
+    if (is_bin) {
+        // 二進位 codebook：只有長度，一律是 canonical code
+        if (huff_codebook_read_bin(fcb, &b->cb) != 0) {
+            log_error("decoder", "invalid_codebook file=%s reason=binary_format input_encoded=%s",
+                      cb_fn, enc_fn);
+            fclose(fcb);
+            return -1;
+        }
+        fclose(fcb);
+        b->canonical        = 1;
+        b->expected_symbols = b->cb.total_symbols;
+        return 0;
+    }
 
     char line[512];
     while (fgets(line, sizeof(line), fcb)) {
+        // 註解行：目前只用來標示 code 指定方式
+        if (line[0] == '#') {
+            if (strstr(line, "code_assignment=canonical")) b->canonical = 1;
+            continue;
+        }
+
         // 解析 symbol（第一欄）
         char symbol = parse_symbol(line);
 
-        // 找到第一欄結束的雙引號位置
-        char *p = strchr(line + 1, '"');
-        if (!p) continue; // 格式怪怪的就跳過
+        // 第一欄固定是 "x" 或跳脫過的 "\x"，直接依位置找結尾的雙引號；
+        // 不能用 strchr 找，symbol 本身可能就是 '"' 或 '\0'
+        if (line[0] != '"') continue; // 格式怪怪的就跳過
+        char *p = line + ((line[1] == '\\') ? 3 : 2);
+        if (*p != '"') continue;
         p++;              // 指到雙引號後面
         if (*p == ',') p++; // 移到 count 的開頭
 
@@ -163,68 +1436,448 @@ int main(int argc, char **argv) {
         int n = sscanf(p, "%ld,%lf,\"%255[01]\",%lf",
                        &count, &prob, code, &self_info);
         if (n == 4) {
-            insert_code(root, code, symbol);
-            expected_symbols += count;
+            unsigned char us = (unsigned char)symbol;
+            b->cb.lens[us]   = (int)strlen(code);
+            b->cb.counts[us] = count;
+            if (!b->canonical) strcpy(b->codes[us], code);
+            b->expected_symbols += count;
         }
     }
     fclose(fcb);
+    b->cb.has_counts    = 1;
+    b->cb.total_symbols = b->expected_symbols;
+    return 0;
+}
+
+/* 重建 canonical code，建出解碼樹（canon engine 改建計數表）與 tables
+   指定的查表；src_fn 是 codebook 的來源、enc_fn 是要用它解的檔案，
+   只用在錯誤訊息。失敗回傳 -1 */
+static int book_build(DecBook* b, const char* engine, int use_canon, int tables,
+                      const char* src_fn, const char* enc_fn) {
+    if (use_canon && !b->canonical) {
+        log_error("decoder", "engine_requires_canonical engine=%s file=%s input_encoded=%s",
+                  engine, src_fn, enc_fn);
+        return -1;
+    }
+
+    if (b->canonical) {
+        // 只用長度重建 canonical code
+        if (huff_canonical_codes(b->cb.lens, b->codes) != 0) {
+            log_error("decoder", "invalid_codebook file=%s reason=code_lengths input_encoded=%s",
+                      src_fn, enc_fn);
+            return -1;
+        }
+    }
+
+    if (use_canon) {
+        // canon engine 直接用長度解碼，不需要解碼樹
+        if (canon_build(&b->canon, b->cb.lens) != 0) {
+            log_error("decoder",
+                      "unsupported_codebook engine=%s reason=code_length_over_%d input_encoded=%s",
+                      engine, CANON_MAX_LEN, enc_fn);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (dtree_build(&b->tree, b->codes) != 0) {
+        log_error("decoder", "invalid_codebook file=%s reason=tree_too_large input_encoded=%s",
+                  src_fn, enc_fn);
+        return -1;
+    }
+    if (tables & BOOK_LUT)   lut_build(&b->lut, &b->tree);
+    if (tables & BOOK_MULTI) multi_build(&b->multi, &b->tree);
+    if (tables & BOOK_FSM)   fsm_build(&b->fsm, &b->tree);
+    b->tables = tables;
+    return 0;
+}
+
+/*
+ * 批次模式裡一個 codebook 檔對應一個 slot。第一個真的需要它的檔案
+ * 在 slot 的鎖裡讀檔、建表，同時需要的其他檔案等它建好直接拿去用；
+ * 用這個 codebook 檔的檔案全部解完時釋放，記憶體只跟同時在解的
+ * codebook 數有關，不會隨著檔案數累積。
+ */
+typedef struct BookSlot {
+    pthread_mutex_t lock;
+    const char*     cb_fn;
+    long            users;   // 還沒解完、用這個 codebook 檔的檔案數
+    int             state;   // 0 = 還沒讀，1 = 建好了，-1 = 讀取或建表失敗
+    DecBook*        book;
+} BookSlot;
+
+// 取得 slot 的 codebook（需要時先建好）；失敗回傳 NULL
+static DecBook* slot_acquire(BookSlot* s, const char* engine, int use_canon, int tables,
+                             const char* enc_fn) {
+    pthread_mutex_lock(&s->lock);
+    if (s->state == 0) {
+        DecBook* b = book_new();
+        s->state = -1;
+        if (book_read(b, s->cb_fn, enc_fn) == 0 &&
+            book_build(b, engine, use_canon, tables, s->cb_fn, enc_fn) == 0) {
+            s->book  = b;
+            s->state = 1;
+        } else {
+            book_free(b);
+        }
+    } else if (s->state < 0) {
+        // 原因在第一次讀的時候已經記錄過
+        log_error("decoder", "invalid_codebook file=%s reason=failed_earlier input_encoded=%s",
+                  s->cb_fn, enc_fn);
+    }
+    DecBook* b = s->book;
+    pthread_mutex_unlock(&s->lock);
+    return b;
+}
+
+// 一個用這個 codebook 檔的檔案解完了；最後一個解完時釋放
+static void slot_release(BookSlot* s) {
+    pthread_mutex_lock(&s->lock);
+    if (--s->users == 0) {
+        book_free(s->book);
+        s->book = NULL;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* ============================================================================
+ * 解碼一個檔案
+ * ==========================================================================*/
+
+// 命令列選項；批次模式下所有檔案共用同一份（只讀）
+typedef struct DecOptions {
+    const char *engine;           // --engine=lut|tree|multi|fsm|canon
+    const char *export_csv_fn;    // --export-csv=path
+    int  threads;                 // --threads=N，0 表示自動偵測
+    DecPool  *pool;               // 所有平行工作共用的執行緒池
+} DecOptions;
+
+/*
+ * enc_fn（+ cb_fn）→ out_fn。log 與單檔執行時完全相同：start、
+ * metrics summary、finish 各一行。slot 不是 NULL 時舊格式的 codebook
+ * 用批次模式共用的那份，否則自己讀。解出的 byte 數放在 *decoded。
+ * 成功回傳 0，失敗回傳 1。
+ */
+static int decode_file(const DecOptions* opt, BookSlot* slot, const char* enc_fn,
+                       const char* cb_fn, const char* out_fn, long* decoded) {
+    const char *engine        = opt->engine;
+    const char *export_csv_fn = opt->export_csv_fn;
+    int  threads              = opt->threads;
 
-    // 3-2. 開啟 encoded.bin 與 output 檔案
+    *decoded = 0;
+
+    /* ========================================================================
+     * 步驟 2: 記錄開始解碼這個檔案
+     * ======================================================================== */
+    
+    log_info("decoder",
+             "start input_encoded=%s input_codebook=%s output_file=%s",
+             enc_fn, cb_fn, out_fn);
+
+    /* ========================================================================
+     * 步驟 3: Huffman 解碼主要邏輯
+     * ======================================================================== */
+
+    int status_ok = 1;             // 解碼是否成功
+    long num_decoded_symbols = 0;  // 實際解出多少個 symbol
+    long expected_symbols = 0;     // 從 codebook 的 count 加總出來的符號總數
+
+    // 3-1. 開啟 encoded 檔案；若開頭是 container 的 magic，codebook 就在
+    //      header 裡，整個解碼只需要這一個檔案、從頭循序讀完
     FILE *fenc = fopen(enc_fn, "rb");
     if (!fenc) {
         log_error("decoder", "cannot_open_encoded_file file=%s", enc_fn);
-        log_info("decoder", "finish status=error");
-        free_tree(root);
+        log_info("decoder", "finish status=error input_encoded=%s", enc_fn);
         return 1;
     }
 
-    FILE *fout = fopen(out_fn, "w");
+    HuffContainerHeader ct;
+    unsigned char ct_buf[HUFF_CT_HEADER_SIZE];
+    int  is_container = 0;
+    int  is_framed    = 0;
+    long bit_limit    = -1;     // payload 的有效 bit 數，-1 表示到檔尾為止
+    long block_size   = 0;      // framed 格式的 block 大小
+    long num_blocks   = 0;      // framed 格式解了幾個 block
+
+    size_t magic_len = fread(ct_buf, 1, 4, fenc);
+    size_t head_len  = 0;       // 讀走了又倒不回去的 bytes（pipe 上的舊格式）
+    int    got_magic = (magic_len == 4);
+    if (got_magic && huff_frame_is(ct_buf)) {
+        // framed 格式：每個 block 自帶 codebook，cb_fn 不需要
+        if (fread(ct_buf + 4, 1, HUFF_FR_HEADER_SIZE - 4, fenc) != HUFF_FR_HEADER_SIZE - 4 ||
+            huff_frame_parse_header(ct_buf, &block_size) != 0) {
+            log_error("decoder", "invalid_frame file=%s reason=file_header", enc_fn);
+            log_info("decoder", "finish status=error input_encoded=%s", enc_fn);
+            fclose(fenc);
+            return 1;
+        }
+        is_framed = 1;
+    } else if (got_magic && huff_container_is(ct_buf)) {
+        if (fread(ct_buf + 4, 1, sizeof(ct_buf) - 4, fenc) != sizeof(ct_buf) - 4 ||
+            huff_container_parse_header(ct_buf, &ct) != 0) {
+            log_error("decoder", "invalid_container file=%s", enc_fn);
+            log_info("decoder", "finish status=error input_encoded=%s", enc_fn);
+            fclose(fenc);
+            return 1;
+        }
+        is_container = 1;
+        bit_limit    = ct.payload_bits;
+    } else if (fseek(fenc, 0, SEEK_SET) != 0) {
+        // 舊格式：整個檔案都是 payload；pipe 無法倒回去，剛剛讀走的
+        // bytes 之後直接放進 bit reader 的緩衝區
+        head_len = magic_len;
+    }
+
+    // 3-2. 取得 codebook（container header、CSV 或二進位 codebook），
+    //      建立 Huffman 解碼樹與 engine 用的查表
+
+    // canon engine 直接用長度解碼，不需要解碼樹（多 stream 路徑仍走 lut）
+    int use_canon = strcmp(engine, "canon") == 0 && !is_framed &&
+                    !(is_container && ct.streams > 0);
+    int use_tables = strcmp(engine, "tree") != 0;   // tree 以外的 engine 在平行 / framed / 多 stream 路徑都用查表
+    if (threads == 0) threads = huff_detect_threads();
+    if (use_canon) threads = 1;   // canon engine 只有循序解碼
+
+    // 循序解碼用 engine 自己的查表，舊格式平行（推測式）解碼用 lut；
+    // 多 stream 與 sync index 平行解碼的查表在各自的函式裡建
+    int tables = 0;
+    if (is_container && (ct.streams > 0 || ((ct.flags & HUFF_CT_HAS_SYNC) && threads > 1))) {
+        tables = 0;
+    } else if (strcmp(engine, "lut") == 0) {
+        tables = BOOK_LUT;
+    } else if (strcmp(engine, "multi") == 0) {
+        tables = BOOK_MULTI;
+    } else if (strcmp(engine, "fsm") == 0) {
+        tables = BOOK_FSM;
+    }
+    if (!is_container && threads > 1 && use_tables) tables |= BOOK_LUT;
+
+    DecBook* book  = NULL;   // 這個檔案用的 codebook（framed 格式逐 block 建，沒有）
+    DecBook* local = NULL;   // 自己建的那份（解完要釋放；共用的不是）
+    if (is_framed) {
+        // codebook 在每個 block header 裡，解碼時再逐 block 建樹
+    } else if (is_container || !slot) {
+        book = local = book_new();
+        int rc;
+        if (is_container) {
+            book_from_container(local, &ct);
+            rc = book_build(local, engine, use_canon, tables, enc_fn, enc_fn);
+        } else {
+            rc = book_read(local, cb_fn, enc_fn);
+            if (rc == 0) rc = book_build(local, engine, use_canon, tables, cb_fn, enc_fn);
+        }
+        if (rc != 0) {
+            log_info("decoder", "finish status=error input_encoded=%s", enc_fn);
+            fclose(fenc);
+            book_free(local);
+            return 1;
+        }
+    } else {
+        book = slot_acquire(slot, engine, use_canon, tables, enc_fn);
+        if (!book) {
+            log_info("decoder", "finish status=error input_encoded=%s", enc_fn);
+            fclose(fenc);
+            return 1;
+        }
+    }
+    if (book) expected_symbols = book->expected_symbols;
+
+    if (export_csv_fn && is_framed) {
+        // 每個 block 各有一份 codebook，沒有單一份可以匯出
+        log_error("decoder", "cannot_export_csv reason=framed_input input_encoded=%s", enc_fn);
+    } else if (export_csv_fn) {
+        // 把讀到的 codebook 匯出成人看得懂的 CSV
+        FILE *fcsv = fopen(export_csv_fn, "w");
+        if (!fcsv) {
+            log_error("decoder", "cannot_open_csv_export file=%s input_encoded=%s",
+                      export_csv_fn, enc_fn);
+        } else {
+            huff_codebook_write_csv(fcsv, &book->cb,
+                                    (const char (*)[HUFF_MAX_CODE_LEN + 1])book->codes,
+                                    book->canonical);
+            fclose(fcsv);
+        }
+    }
+
+    // 3-3. 開啟 output 檔案（一般檔案可讀寫，才能 mmap 寫入）
+    FILE *fout = output_fopen(out_fn);
     if (!fout) {
-        log_error("decoder", "cannot_open_output_file file=%s", out_fn);
-        log_info("decoder", "finish status=error");
+        log_error("decoder", "cannot_open_output_file file=%s input_encoded=%s", out_fn, enc_fn);
+        log_info("decoder", "finish status=error input_encoded=%s", enc_fn);
         fclose(fenc);
-        free_tree(root);
+        book_free(local);
         return 1;
     }
 
-    // 3-3. 逐 bit 解碼
-    DNode* cur = root;
-    unsigned char byte;
-    long bit_position = 0;   // 若有錯誤，可以記錄第幾個 bit 出事
+    double t_dec = now_seconds();
+    int  dec_threads = 1;      // 實際用來解碼的執行緒數
+    long sync_points = 0;      // 用到的 sync index checkpoint 數
+    const char *decode_mode = "serial";   // serial / sync_index / speculative / streams
+    long spec_fallbacks   = 0;  // 推測式解碼中同步失敗、改成循序解的段數
+    long spec_resync_bits = 0;  // 推測式解碼接段時循序解過的 bit 數
+    DecInput in;               // 一般檔案整個 mmap 進來（framed 逐 block 讀，不需要）
+    memcpy(in.head, ct_buf, head_len);
+    in.head_len = head_len;
+    in.map      = NULL;
+    if (!is_framed) input_map(&in, fenc);
 
-    while (fread(&byte, 1, 1, fenc) == 1 && num_decoded_symbols < expected_symbols) {
-        // 從最高位元開始 (bit 7 -> bit 0)
-        for (int b = 7; b >= 0 && num_decoded_symbols < expected_symbols; b--) {
-            int bit = (byte >> b) & 1;
-            bit_position++;
+    // 輸出檔預先放大成 expected_symbols bytes 再 mmap；輸入大小已知時
+    // 先確認它至少有這麼多 bit（每個 symbol 至少 1 bit），壞掉的 header
+    // 不會讓我們配出一個巨大的檔案
+    DecOutput dout;
+    long presize = 0;
+    if (!is_framed && in.map && expected_symbols <= (long)in.len * 8) presize = expected_symbols;
+    output_open(&dout, fout, enc_fn, presize);
 
-            cur = (bit == 0) ? cur->left : cur->right;
+    if (is_framed) {
+        // 3-4. framed 格式：逐 block 建樹、解碼
+        if (decode_framed(fenc, enc_fn, &dout, block_size, use_tables,
+                          &num_decoded_symbols, &expected_symbols, &num_blocks) != 0) {
+            status_ok = 0;
+            log_info("decoder", "finish status=error input_encoded=%s", enc_fn);
 
-            if (!cur) {
-                // 代表 bit stream 中出現無法對應的路徑
-                log_error("decoder",
-                          "invalid_codeword bit_position=%ld reason=unexpected_prefix",
-                          bit_position);
-                status_ok = 0;
-                log_info("decoder", "finish status=error");
+            output_close(&dout);
+            input_unmap(&in);
+            fclose(fenc);
+            fclose(fout);
+            book_free(local);
+            return 1;
+        }
+    } else if (is_container && ct.streams > 0) {
+        // 3-4. 多 stream payload：各 stream 在同一輪迴圈裡一起推進
+        decode_mode = "streams";
+        if (decode_container_streams(&in, fenc, enc_fn, &dout, &ct, &book->tree,
+                                     use_tables,
+                                     &num_decoded_symbols) != 0) {
+            status_ok = 0;
+            log_info("decoder", "finish status=error input_encoded=%s", enc_fn);
 
-                fclose(fenc);
-                fclose(fout);
-                free_tree(root);
-                return 1;
-            }
+            output_close(&dout);
+            input_unmap(&in);
+            fclose(fenc);
+            fclose(fout);
+            book_free(local);
+            return 1;
+        }
+    } else if (is_container && (ct.flags & HUFF_CT_HAS_SYNC) && threads > 1) {
+        // 3-4. 有 sync index：各執行緒從 checkpoint 開始平行解碼
+        decode_mode = "sync_index";
+        if (decode_container_parallel(opt->pool, &in, fenc, enc_fn, &dout, &ct, &book->tree,
+                                      use_tables, threads,
+                                      &num_decoded_symbols, &dec_threads,
+                                      &sync_points) != 0) {
+            status_ok = 0;
+            log_info("decoder", "finish status=error input_encoded=%s", enc_fn);
 
-            if (cur->isLeaf) {
-                // 找到一個完整 symbol，輸出到檔案
-                fputc(cur->symbol, fout);
-                num_decoded_symbols++;
-                cur = root;  // 回到根節點，準備解下一個 symbol
-            }
+            output_close(&dout);
+            input_unmap(&in);
+            fclose(fenc);
+            fclose(fout);
+            book_free(local);
+            return 1;
+        }
+    } else if (!is_container && threads > 1 && expected_symbols > 0 &&
+               in.map && in.len >= 2 * SPEC_MIN_CHUNK) {
+        // 3-4. 舊格式：整個檔案已經 mmap 進來，推測式平行解碼
+        DecEngine dec;
+        dec.lut     = use_tables ? &book->lut : NULL;
+        dec.tree    = &book->tree;
+        dec.max_len = huff_dtree_depth(&book->tree, 0);
+        decode_mode = "speculative";
+        int rc = decode_speculative(opt->pool, enc_fn, in.map, in.len, &dec, threads,
+                                    expected_symbols, &dout, &num_decoded_symbols,
+                                    &dec_threads, &spec_fallbacks, &spec_resync_bits);
+
+        if (rc != 0) {
+            status_ok = 0;
+            log_info("decoder", "finish status=error input_encoded=%s", enc_fn);
+
+            output_close(&dout);
+            input_unmap(&in);
+            fclose(fenc);
+            fclose(fout);
+            book_free(local);
+            return 1;
+        }
+    } else if (strcmp(engine, "fsm") == 0) {
+        // 3-4. 狀態機解碼：每個輸入 byte 查一次表
+        HuffBitReader br;
+        long bad_bit = 0;
+        br_init_input(&br, &in, fenc, bit_limit);
+        num_decoded_symbols = decode_fsm(&book->fsm, &br, &dout, expected_symbols, &bad_bit);
+        huff_br_free(&br);
+
+        if (bad_bit > 0) {
+            log_error("decoder",
+                      "invalid_codeword bit_position=%ld reason=unexpected_prefix input_encoded=%s",
+                      bad_bit, enc_fn);
+            status_ok = 0;
+            log_info("decoder", "finish status=error input_encoded=%s", enc_fn);
+
+            output_close(&dout);
+            input_unmap(&in);
+            fclose(fenc);
+            fclose(fout);
+            book_free(local);
+            return 1;
+        }
+    } else {
+        // 3-4. 循序解碼（lut / multi / canon / tree）：輸出檔有映射時
+        //      直接解進檔案裡，否則每次解一批到緩衝區再整批寫出
+        int use_multi = strcmp(engine, "multi") == 0;
+        int use_lut   = use_tables && !use_multi && !use_canon;
+
+        HuffBitReader* br = (HuffBitReader*)malloc(sizeof(HuffBitReader));
+        unsigned char* out_buf = (unsigned char*)malloc(DEC_OUT_BUF_SIZE);
+        if (!br || !out_buf) {
+            fprintf(stderr, "decoder: memory allocation failed\n");
+            exit(1);
+        }
+        br_init_input(br, &in, fenc, bit_limit);
+
+        long bad_bit = 0;
+        while (num_decoded_symbols < expected_symbols) {
+            long want = expected_symbols - num_decoded_symbols;
+            if (want > DEC_OUT_BUF_SIZE && !dout.map) want = DEC_OUT_BUF_SIZE;
+
+            unsigned char* dst = output_at(&dout, out_buf);
+            long got;
+            if (use_canon)      got = decode_canon(&book->canon, br, dst, want, &bad_bit);
+            else if (use_multi) got = decode_multi(&book->multi, br, dst, want, &bad_bit);
+            else if (use_lut)   got = huff_decode_lut(&book->lut, br, dst, want, &bad_bit);
+            else                got = huff_decode_tree(&book->tree, br, dst, want, &bad_bit);
+            output_put(&dout, dst, got);
+            num_decoded_symbols += got;
+            if (got < want) break;   // 輸入用完或遇到 invalid codeword
+        }
+
+        free(out_buf);
+        huff_br_free(br);
+        free(br);
+
+        if (bad_bit > 0) {
+            log_error("decoder",
+                      "invalid_codeword bit_position=%ld reason=unexpected_prefix input_encoded=%s",
+                      bad_bit, enc_fn);
+            status_ok = 0;
+            log_info("decoder", "finish status=error input_encoded=%s", enc_fn);
+
+            output_close(&dout);
+            input_unmap(&in);
+            fclose(fenc);
+            fclose(fout);
+            book_free(local);
+            return 1;
         }
     }
 
+    output_close(&dout);
+    input_unmap(&in);
     fclose(fenc);
     fclose(fout);
+    book_free(local);
+    double dec_seconds = now_seconds() - t_dec;
+    *decoded = num_decoded_symbols;
 
     if (num_decoded_symbols != expected_symbols) {
         // 正常情況下應該完全對上，否則標記為錯誤
@@ -237,20 +1890,290 @@ int main(int argc, char **argv) {
     
     log_info("metrics",
              "summary input_encoded=%s input_codebook=%s output_file=%s "
-             "num_decoded_symbols=%ld expected_symbols=%ld status=%s",
+             "num_decoded_symbols=%ld expected_symbols=%ld status=%s "
+             "engine=%s decode_bytes_per_sec=%.15f input_format=%s num_blocks=%ld "
+             "threads=%d sync_points=%ld decode_mode=%s "
+             "spec_fallbacks=%ld spec_resync_bits=%ld",
              enc_fn,
              cb_fn,
              out_fn,
              num_decoded_symbols,
              expected_symbols,
-             status_ok ? "ok" : "error");
+             status_ok ? "ok" : "error",
+             engine,
+             dec_seconds > 0.0 ? (double)num_decoded_symbols / dec_seconds : 0.0,
+             is_framed ? "framed" : (is_container ? "container" : "raw"),
+             num_blocks,
+             dec_threads,
+             sync_points,
+             decode_mode,
+             spec_fallbacks,
+             spec_resync_bits);
 
     /* ========================================================================
-     * 步驟 5: 記錄程式結束
+     * 步驟 5: 記錄這個檔案結束
      * ======================================================================== */
     
-    log_info("decoder", "finish status=%s", status_ok ? "ok" : "error");
+    if (opt->pool->threads > 0) log_pool_stats(opt->pool->pool);   // 批次模式在 batch_finish 之前
+    log_info("decoder", "finish status=%s input_encoded=%s", status_ok ? "ok" : "error", enc_fn);
 
-    free_tree(root);
     return status_ok ? 0 : 1;
 }
+
+/* ============================================================================
+ * 批次模式：一個 process 解碼很多檔案
+ * ==========================================================================*/
+
+/*
+ * 每個檔案是執行緒池裡的一個 task，由 -j 個 worker 依序領取、互相偷。
+ * 開始前先把 manifest 依 codebook 路徑分組，同一個 codebook 檔的檔案共用
+ * 一個 BookSlot（見上面），解碼樹與查表只建一次、所有 worker 唯讀共用。
+ * 每個檔案照常輸出自己的 metrics summary，全部結束後再輸出一行
+ * batch_summary。
+ */
+typedef struct BatchShared {
+    const DecOptions*   opt;
+    const HuffManifest* jobs;
+    BookSlot*           slots;
+    long*               slot_of;   // 每個檔案用哪個 slot
+    int*                status;    // 每個檔案 decode_file 的回傳值
+    long*               decoded;   // 每個檔案解出的 bytes
+} BatchShared;
+
+typedef struct BatchTask {
+    BatchShared* sh;
+    long         k;        // 第幾個檔案
+} BatchTask;
+
+static void* batch_worker(void* arg) {
+    BatchShared* sh   = ((BatchTask*)arg)->sh;
+    long         k    = ((BatchTask*)arg)->k;
+    const char** f    = sh->jobs->paths + 3 * k;
+    BookSlot*    slot = &sh->slots[sh->slot_of[k]];
+
+    sh->status[k] = decode_file(sh->opt, slot, f[0], f[1], f[2], &sh->decoded[k]);
+    slot_release(slot);
+    return NULL;
+}
+
+typedef struct BookKey {
+    const char* cb_fn;
+    long        job;
+} BookKey;
+
+static int book_key_cmp(const void* a, const void* b) {
+    return strcmp(((const BookKey*)a)->cb_fn, ((const BookKey*)b)->cb_fn);
+}
+
+// 解碼 jobs 裡的所有檔案，全部成功回傳 0
+static int decode_batch(const DecOptions* opt, const HuffManifest* jobs) {
+    BatchShared sh;
+    size_t      n        = (size_t)jobs->count + 1;
+    int         num_jobs = huff_pool_threads(opt->pool->pool);
+
+    if (num_jobs > jobs->count) num_jobs = jobs->count > 0 ? (int)jobs->count : 1;
+    log_info("decoder", "batch_start files=%ld jobs=%d", jobs->count, num_jobs);
+
+    BookKey*   keys  = (BookKey*)malloc(sizeof(BookKey) * n);
+    BatchTask* tasks = (BatchTask*)malloc(sizeof(BatchTask) * n);
+    sh.opt     = opt;
+    sh.jobs    = jobs;
+    sh.slots   = (BookSlot*)calloc(n, sizeof(BookSlot));
+    sh.slot_of = (long*)malloc(sizeof(long) * n);
+    sh.status  = (int*)malloc(sizeof(int) * n);
+    sh.decoded = (long*)calloc(n, sizeof(long));
+    if (!keys || !tasks || !sh.slots || !sh.slot_of || !sh.status || !sh.decoded) {
+        fprintf(stderr, "decoder: memory allocation failed\n");
+        exit(1);
+    }
+
+    // 依 codebook 路徑排序後，相同路徑的檔案分到同一個 slot
+    long num_slots = 0;
+    for (long k = 0; k < jobs->count; k++) {
+        keys[k].cb_fn = jobs->paths[3 * k + 1];
+        keys[k].job   = k;
+        sh.status[k]  = 1;
+        tasks[k].sh   = &sh;
+        tasks[k].k    = k;
+    }
+    qsort(keys, (size_t)jobs->count, sizeof(BookKey), book_key_cmp);
+    for (long k = 0; k < jobs->count; k++) {
+        if (k == 0 || strcmp(keys[k].cb_fn, keys[k - 1].cb_fn) != 0) {
+            BookSlot* s = &sh.slots[num_slots++];
+            pthread_mutex_init(&s->lock, NULL);
+            s->cb_fn = keys[k].cb_fn;
+        }
+        sh.slots[num_slots - 1].users++;
+        sh.slot_of[keys[k].job] = num_slots - 1;
+    }
+    free(keys);
+
+    double t0   = now_seconds();
+    int    used = huff_pool_run(opt->pool->pool, tasks, sizeof(BatchTask), jobs->count,
+                                batch_worker);
+    double secs = now_seconds() - t0;
+    free(tasks);
+
+    long failed = 0, decoded = 0, codebooks = 0;
+    for (long k = 0; k < jobs->count; k++) {
+        if (sh.status[k] != 0) failed++;
+        decoded += sh.decoded[k];
+    }
+    for (long k = 0; k < num_slots; k++) {
+        if (sh.slots[k].state == 1) codebooks++;
+        pthread_mutex_destroy(&sh.slots[k].lock);
+    }
+    free(sh.slots);
+    free(sh.slot_of);
+    free(sh.status);
+    free(sh.decoded);
+
+    log_info("metrics",
+             "batch_summary files=%ld ok=%ld failed=%ld jobs=%d "
+             "shared_codebooks=%ld decoded_bytes=%ld seconds=%.15f "
+             "files_per_sec=%.15f decode_bytes_per_sec=%.15f",
+             jobs->count, jobs->count - failed, failed, used,
+             codebooks, decoded, secs,
+             secs > 0.0 ? (double)jobs->count / secs : 0.0,
+             secs > 0.0 ? (double)decoded / secs : 0.0);
+    log_pool_stats(opt->pool->pool);
+    log_info("decoder", "batch_finish status=%s", failed ? "error" : "ok");
+    return failed ? 1 : 0;
+}
+
+/* ============================================================================
+ * 主程式
+ * ==========================================================================*/
+
+int main(int argc, char **argv) {
+    /* ========================================================================
+     * 步驟 1: 參數驗證
+     * ======================================================================== */
+    
+    int  num_args = 0;             // 位置參數（enc_fn cb_fn out_fn，可以有好幾組）的個數
+    const char *engine = "lut";    // --engine=lut|tree|multi|fsm|canon
+    const char *export_csv_fn = NULL;  // --export-csv=path
+    int  threads = 0;              // --threads=N，0 表示自動偵測
+    const char *manifest_fn = NULL;    // --manifest=path，"-" 表示從 stdin 讀
+    int  num_jobs = 0;             // -j N / --jobs=N：批次模式同時解碼的檔案數，0 表示自動偵測
+
+    for (int a = 1; a < argc; a++) {
+        if (strncmp(argv[a], "--engine=", 9) == 0) {
+            engine = argv[a] + 9;
+            if (strcmp(engine, "lut") != 0 && strcmp(engine, "tree") != 0 &&
+                strcmp(engine, "multi") != 0 && strcmp(engine, "fsm") != 0 &&
+                strcmp(engine, "canon") != 0) {
+                log_error("decoder", "unknown_engine engine=%s", engine);
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (strncmp(argv[a], "--export-csv=", 13) == 0) {
+            export_csv_fn = argv[a] + 13;
+        } else if (strncmp(argv[a], "--threads=", 10) == 0) {
+            char* end = NULL;
+            long n = strtol(argv[a] + 10, &end, 10);
+            if (end == argv[a] + 10 || *end != '\0' || n < 0 || n > MAX_THREADS) {
+                log_error("decoder", "invalid_threads value=%s", argv[a] + 10);
+                print_usage(argv[0]);
+                return 1;
+            }
+            threads = (int)n;
+        } else if (strncmp(argv[a], "--manifest=", 11) == 0) {
+            manifest_fn = argv[a] + 11;
+        } else if (strcmp(argv[a], "-j") == 0 || strncmp(argv[a], "--jobs=", 7) == 0) {
+            const char* v = (argv[a][1] == 'j') ? (a + 1 < argc ? argv[++a] : "")
+                                                : argv[a] + 7;
+            char* end = NULL;
+            long n = strtol(v, &end, 10);
+            if (end == v || *end != '\0' || n < 0 || n > MAX_THREADS) {
+                log_error("decoder", "invalid_jobs value=%s", v);
+                print_usage(argv[0]);
+                return 1;
+            }
+            num_jobs = (int)n;
+        } else if (strncmp(argv[a], "--", 2) == 0) {
+            log_error("decoder", "unknown_option option=%s", argv[a]);
+            print_usage(argv[0]);
+            return 1;
+        } else {
+            // 位置參數往前搬到 argv[1..num_args]（永遠不會蓋到還沒看過的參數）
+            argv[++num_args] = argv[a];
+        }
+    }
+
+    if (num_args % 3 != 0 || (num_args == 0 && !manifest_fn)) {
+        log_error("decoder", "invalid_arguments argc=%d", argc);
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // 要解碼的檔案：先是命令列上的每三個一組，再接 manifest 的每一行
+    HuffManifest jobs;
+    huff_manifest_init(&jobs);
+    for (int a = 1; a < num_args; a += 3) {
+        if (huff_manifest_add(&jobs, argv[a], argv[a + 1], argv[a + 2]) != 0) {
+            fprintf(stderr, "decoder: memory allocation failed\n");
+            exit(1);
+        }
+    }
+    if (manifest_fn) {
+        FILE* fm = strcmp(manifest_fn, "-") == 0 ? stdin : fopen(manifest_fn, "r");
+        if (!fm) {
+            log_error("decoder", "cannot_open_manifest file=%s", manifest_fn);
+            huff_manifest_free(&jobs);
+            return 1;
+        }
+        long bad = huff_manifest_read(&jobs, fm);
+        if (fm != stdin) fclose(fm);
+        if (bad != 0) {
+            if (bad > 0) {
+                log_error("decoder", "invalid_manifest file=%s line=%ld reason=expected_3_paths",
+                          manifest_fn, bad);
+            } else {
+                log_error("decoder", "cannot_read_manifest file=%s", manifest_fn);
+            }
+            huff_manifest_free(&jobs);
+            return 1;
+        }
+    }
+    int batch = manifest_fn != NULL || jobs.count > 1;
+
+    if (batch && export_csv_fn) {
+        // 每個檔案都會寫到同一個路徑
+        log_error("decoder", "conflicting_options options=--export-csv,batch");
+        print_usage(argv[0]);
+        huff_manifest_free(&jobs);
+        return 1;
+    }
+
+    DecOptions opt;
+    opt.engine        = engine;
+    opt.export_csv_fn = export_csv_fn;
+    opt.threads       = threads;
+
+    // 所有平行工作共用一個 pool：單檔是 --threads 個 worker（真的要分段
+    // 時才建立），批次是 -j 個（--threads 比較大時取 --threads）
+    DecPool pool = {NULL, 0, 0};
+    int pool_threads = threads ? threads : huff_detect_threads();
+    if (batch) {
+        // 檔案之間已經平行了；沒指定 --threads 時每個檔案只用一個執行緒
+        if (threads == 0) opt.threads = 1;
+        pool_threads = num_jobs ? num_jobs : huff_detect_threads();
+        if (pool_threads > jobs.count) pool_threads = (int)jobs.count;
+        if (pool_threads < opt.threads) pool_threads = opt.threads;
+    }
+    if (batch) pool.pool    = huff_pool_new(pool_threads, POOL_QUEUE_CAP);
+    else       pool.threads = pool_threads;
+    opt.pool = &pool;
+
+    int rc;
+    if (batch) {
+        rc = decode_batch(&opt, &jobs);
+    } else {
+        long decoded;
+        rc = decode_file(&opt, NULL, jobs.paths[0], jobs.paths[1], jobs.paths[2], &decoded);
+    }
+    huff_pool_free(pool.pool);
+    huff_manifest_free(&jobs);
+    return rc;
+}
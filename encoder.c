@@ -10,16 +10,27 @@
                      // - 實際實作 Huffman encoder 時還需要：
                      //   fopen(), fclose(), fread(), fwrite(), fgetc() 等
 
+#include <stdint.h>  // uint64_t：bit writer 的 64-bit 累加器
 #include <stdlib.h>  // 標準函式庫
                      // - malloc(), free(): 動態記憶體配置
                      // - exit(), EXIT_SUCCESS, EXIT_FAILURE: 程式結束
 
 #include <string.h>  // 處理字串：strcpy(), strlen(), memset(), 等
 #include <math.h>    // 計算 entropy、perplexity 用到 log(), pow()
+#include <time.h>    // clock_gettime(): 量測各 pass 的 throughput
+
+#include <fcntl.h>     // open(), posix_fallocate()
+#include <errno.h>     // EINTR
+#include <unistd.h>    // read(), write(), close()
+#include <sys/mman.h>  // mmap(), madvise(), munmap()：輸入與輸出檔
+#include <sys/stat.h>  // fstat(): 判斷輸入 / 輸出是不是一般檔案
 
 #include "logger.h"  // 自訂的 logger 函式庫（使用雙引號表示本地標頭檔）
                      // - log_info(): 記錄一般資訊（輸出到 stdout）
                      // - log_error(): 記錄錯誤訊息（輸出到 stderr）
+#include "huffman.h" // encoder / decoder 共用的 Huffman 工具
+#include "libhuff.h" // 記憶體對記憶體的編碼函式庫：頻率統計、code 打包
+                     // （canonical code、codebook 的 CSV / 二進位格式）
 
 /*
  * ============================================================================
@@ -35,45 +46,210 @@
  * argv[2] - cb_fn  : codebook 輸出檔案路徑（儲存符號與編碼的對應表）
  * argv[3] - enc_fn : 編碼輸出檔案路徑（儲存編碼後的二進位資料）
  * 
+ * 【選項】
+ * --no-mmap   : 不使用 mmap，一律把輸入讀進記憶體緩衝區
+ *               （in_fn 是 pipe 或 "-"（stdin）時會自動走這條路）
+ * --canonical : 只算出 Huffman code 長度（不建 tree），再依 (長度, symbol)
+ *               順序指定 canonical code；codebook 第一行會標註
+ *               "# code_assignment=canonical"，decoder 只需長度即可重建 code
+ * --max-code-len=N : 限制最長 code 為 N bits（1~64，例如 11/12/15），
+ *               Huffman code 超過時改用 package-merge 算最佳的限長 code；
+ *               隱含 --canonical
+ * --codebook-format=csv|bin : codebook 格式（預設 csv）。bin 是精簡的二進位
+ *               格式（magic、版本、symbol 總數、每個 symbol 的 code 長度），
+ *               格式定義見 huffman.h；隱含 --canonical
+ * --codebook-counts : bin 格式額外附上每個 symbol 的出現次數
+ * --export-csv=path : 另外輸出一份 CSV codebook 供人閱讀／除錯
+ * --container : enc_fn 寫成單檔 container（header 內含 code 長度、payload
+ *               的精確 bit 數與原始大小，格式見 huffman.h）；隱含 --canonical。
+ *               此時 cb_fn 可以給 "-" 表示不另外輸出 codebook
+ * --block-size=N[K|M] : enc_fn 寫成分 block 的 framed 格式（例如 128K ~ 4M），
+ *               每個 block 各自建 codebook，可獨立編碼／解碼／串流（格式見
+ *               huffman.h）。cb_fn 仍是整個檔案的 codebook（只供參考，
+ *               解碼用不到，可給 "-"）
+ * --sync-interval=N : 每 N 個 symbol 記錄一個 checkpoint（payload 中的 bit
+ *               offset），寫成 container 尾端的 sync index，讓 decoder 可以
+ *               多執行緒平行解碼（格式見 huffman.h）；隱含 --container
+ * --streams=N : payload 拆成 N 個（2~16，例如 4 或 8）交錯的 stream，第 i 個
+ *               symbol 放進第 i % N 個 stream，前面加上記錄各 stream 長度的
+ *               jump table；decoder 可在同一輪迴圈同時推進所有 stream。
+ *               隱含 --container（header 為 version 2，格式見 huffman.h）
+ * --threads=N : 頻率統計與編碼使用的執行緒數；0（預設）表示依 CPU 核心數
+ *               自動決定。輸入太小時會自動減少，每個執行緒至少分到 1 MiB。
+ *               raw / container 輸出以 code 長度的 prefix sum 平行打包，
+ *               framed 輸出的各 block 平行建表、打包，結果與單執行緒逐 bit
+ *               寫出完全相同。所有平行工作共用一個 work-stealing 執行緒池
+ *               （第一次真的要分工時才建立），有分工時 finish 之前每個
+ *               worker 多一行 pool_worker 統計
+ * --manifest=path : 批次模式，一個 process 編碼很多檔案；manifest 每行是
+ *               "in_fn cb_fn enc_fn"（格式見 huffman.h，"-" 表示從 stdin
+ *               讀）。命令列上也可以直接給好幾組 in_fn cb_fn enc_fn。每個
+ *               檔案照常輸出 metrics summary，最後多一行 batch_summary。
+ *               批次模式下 --threads 預設為 1，不能和 --export-csv 一起用
+ * -j N / --jobs=N : 批次模式同時編碼的檔案數；0（預設）表示依 CPU 核心數。
+ *               --threads 比較大時執行緒池以 --threads 為準
+ *
+ * 【編譯】
+ * gcc -O2 -o encoder encoder.c libhuff.c huffman.c logger.c -lm -lpthread
+ *
  * 【執行範例】
  * ./encoder input.txt codebook.csv encoded.bin > encoder.log 2>&1
+ * cat input.txt | ./encoder - codebook.csv encoded.bin
+ * ./encoder --container -j 8 --manifest=files.txt > encoder.log
  * 
  * ============================================================================
  */
 
-/* ============================================================================
- * Huffman Tree 節點定義
- * ==========================================================================*/
+/* ---------------------- 整數 code table 與 64-bit bit writer ---------------- */
+
+/*
+ * 編碼迴圈不逐字走 '0'/'1' 的 code 字串，而是查一張平坦的
+ * per-symbol 表：code 以整數存放（靠右對齊，MSB 先輸出）。
+ * 64-bit 累加器裝滿時整個 word 以 big-endian 寫入緩衝區，輸出的 bit
+ * 順序與原本逐 byte 寫出完全相同。緩衝區通常就是預先配好大小的整個
+ * 輸出（見下面的 EncOutput），直接打包到最終位置；只有事先不知道大小
+ * 的 framed 格式才用 1MB 的緩衝區，滿了再 write() 出去。
+ */
+
+#define ENC_OUT_BUF_SIZE (1 << 20)   // bit writer 輸出緩衝區大小（8 的倍數）
+
+typedef struct BitWriter {
+    uint64_t       acc;       // 尚未寫出的位元（靠左對齊）
+    int            nbits;     // acc 中有效的 bit 數（0~63）
+    unsigned char *buf;       // 輸出緩衝區
+    size_t         pos;       // buf 已使用的 byte 數
+    size_t         cap;       // buf 大小
+    int            fd;        // 緩衝區滿時寫出的檔案；-1 表示 buf 就是最終輸出
+    int            io_error;  // write 失敗時設為 1
+} BitWriter;
+
+// 把 n bytes 全部寫到 fd（處理部分寫入與 EINTR），失敗回傳 -1
+static int write_all(int fd, const unsigned char* p, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+// 串流模式：緩衝區滿了就寫到 fd
+static int bw_init(BitWriter* bw, int fd) {
+    bw->acc      = 0;
+    bw->nbits    = 0;
+    bw->pos      = 0;
+    bw->cap      = ENC_OUT_BUF_SIZE;
+    bw->fd       = fd;
+    bw->io_error = 0;
+    bw->buf      = (unsigned char*)malloc(bw->cap);
+    return bw->buf ? 0 : -1;
+}
+
+// 直接打包進呼叫端的 buf（大小必須剛好放得下全部輸出，不會 flush）
+static void bw_init_mem(BitWriter* bw, unsigned char* buf, size_t size) {
+    bw->acc      = 0;
+    bw->nbits    = 0;
+    bw->pos      = 0;
+    bw->cap      = size;
+    bw->fd       = -1;
+    bw->io_error = 0;
+    bw->buf      = buf;
+}
+
+static void bw_flush_buffer(BitWriter* bw) {
+    if (bw->fd < 0) return;
+    if (bw->pos > 0 && write_all(bw->fd, bw->buf, bw->pos) != 0) {
+        bw->io_error = 1;
+    }
+    bw->pos = 0;
+}
 
-typedef struct Node {
-    unsigned char symbol;        // 字元 (0~255)
-    long          count;         // 出現次數
-    double        prob;          // 機率
-    struct Node  *left;
-    struct Node  *right;
-    char          code[256];     // Huffman code (0/1 字串)
-} Node;
-
-/* ----------------- min-heap for Huffman tree building -------------------- */
-
-static Node* heap[512];
-static int   heapSize = 0;
-
-static void heap_push(Node* n) {
-    heap[++heapSize] = n;
-    int i = heapSize;
-    while (i > 1 && heap[i]->count < heap[i/2]->count) {
-        Node* tmp = heap[i];
-        heap[i]   = heap[i/2];
-        heap[i/2] = tmp;
+// 寫入 len 個 bit（1 <= len <= 64），bits 高於 len 的部分必須為 0
+static inline void bw_put(BitWriter* bw, uint64_t bits, int len) {
+    int room = 64 - bw->nbits;
+    if (len < room) {
+        bw->acc   |= bits << (room - len);
+        bw->nbits += len;
+        return;
+    }
+
+    // 累加器滿了：補滿這個 word 後整個寫出，剩下的 bit 留在 acc
+    int rest = len - room;
+    bw->acc |= bits >> rest;
+    huff_store_be64(bw->buf + bw->pos, bw->acc);
+    bw->pos += 8;
+    if (bw->pos == bw->cap) bw_flush_buffer(bw);
+
+    bw->acc   = rest ? bits << (64 - rest) : 0;
+    bw->nbits = rest;
+}
+
+// 寫出剩餘的 bit（最後不足 8 bits 的 byte 以 0 padding）並 flush
+static void bw_finish(BitWriter* bw) {
+    int nbytes = (bw->nbits + 7) / 8;
+    for (int k = 0; k < nbytes; k++) {
+        bw->buf[bw->pos++] = (unsigned char)(bw->acc >> (56 - 8 * k));
+        if (bw->pos == bw->cap) bw_flush_buffer(bw);
+    }
+    bw->acc   = 0;
+    bw->nbits = 0;
+    if (bw->fd < 0) return;
+    bw_flush_buffer(bw);
+    free(bw->buf);
+    bw->buf = NULL;
+}
+
+// 補 0 到 byte 邊界（framed 格式的每個 block 都從整數 byte 開始）
+static void bw_align(BitWriter* bw) {
+    int pad = (8 - (bw->nbits & 7)) & 7;
+    if (pad) bw_put(bw, 0, pad);
+}
+
+// 在 byte 邊界上寫入一段原始 bytes（header）
+static void bw_put_bytes(BitWriter* bw, const unsigned char* p, size_t n) {
+    for (size_t k = 0; k < n; k++) bw_put(bw, p[k], 8);
+}
+
+/* ------------------------- tree code（預設模式） --------------------------- */
+
+/*
+ * 預設（非 canonical）模式的 code 由 Huffman tree 的形狀決定，codebook
+ * 裡存的就是這些 code。為了和既有的 codebook 完全相同，合併順序維持
+ * min-heap 的行為；節點放在呼叫端的 HuffTree 裡、heap 只存 index，
+ * 不 malloc 也沒有 file-static 狀態。code 直接以整數一路走訪產生。
+ */
+#define TREE_MAX_NODES (2 * 256 - 1)
+
+typedef struct HuffTree {
+    long    count[TREE_MAX_NODES];
+    int16_t left[TREE_MAX_NODES];    // -1 表示葉節點
+    int16_t right[TREE_MAX_NODES];
+    uint8_t symbol[TREE_MAX_NODES];
+    int16_t heap[TREE_MAX_NODES + 1];   // min-heap（從 1 起算），存節點 index
+    int     heap_size;
+    int     nnodes;
+} HuffTree;
+
+static void tree_heap_push(HuffTree* t, int node) {
+    int16_t* h = t->heap;
+    h[++t->heap_size] = (int16_t)node;
+    int i = t->heap_size;
+    while (i > 1 && t->count[h[i]] < t->count[h[i / 2]]) {
+        int16_t tmp = h[i];
+        h[i]     = h[i / 2];
+        h[i / 2] = tmp;
         i /= 2;
     }
 }
 
-static Node* heap_pop(void) {
-    if (heapSize == 0) return NULL;
-    Node* root = heap[1];
-    heap[1] = heap[heapSize--];
+static int tree_heap_pop(HuffTree* t) {
+    int16_t* h = t->heap;
+    int root = h[1];
+    h[1] = h[t->heap_size--];
 
     int i = 1;
     while (1) {
@@ -81,109 +257,725 @@ static Node* heap_pop(void) {
         int right = i * 2 + 1;
         int min_i = i;
 
-        if (left <= heapSize && heap[left]->count < heap[min_i]->count)
+        if (left <= t->heap_size && t->count[h[left]] < t->count[h[min_i]])
             min_i = left;
-        if (right <= heapSize && heap[right]->count < heap[min_i]->count)
+        if (right <= t->heap_size && t->count[h[right]] < t->count[h[min_i]])
             min_i = right;
 
         if (min_i == i) break;
 
-        Node* tmp = heap[i];
-        heap[i]   = heap[min_i];
-        heap[min_i] = tmp;
+        int16_t tmp = h[i];
+        h[i]     = h[min_i];
+        h[min_i] = tmp;
         i = min_i;
     }
     return root;
 }
 
-/* --------------------- 產生 Huffman code 的遞迴函式 ----------------------- */
+// 依 freq 建 tree，回傳 root 的 index（freq 全為 0 時回傳 -1）
+static int tree_build(HuffTree* t, const long freq[256]) {
+    t->heap_size = 0;
+    t->nnodes    = 0;
+    for (int s = 0; s < 256; s++) {
+        if (freq[s] <= 0) continue;
+        int n = t->nnodes++;
+        t->count[n]  = freq[s];
+        t->left[n]   = t->right[n] = -1;
+        t->symbol[n] = (uint8_t)s;
+        tree_heap_push(t, n);
+    }
+    if (t->heap_size == 0) return -1;
+
+    while (t->heap_size > 1) {
+        int a = tree_heap_pop(t);
+        int b = tree_heap_pop(t);
+        int p = t->nnodes++;
+        t->count[p]  = t->count[a] + t->count[b];
+        t->left[p]   = (int16_t)a;
+        t->right[p]  = (int16_t)b;
+        t->symbol[p] = 0;
+        tree_heap_push(t, p);
+    }
+    return tree_heap_pop(t);
+}
 
-static void generate_codes(Node* root, const char* prefix) {
-    if (!root) return;
+// 走訪 tree 指定 code（左 0 右 1），寫進 table；只有一種 symbol 時給 "0"。
+// 深度超過 HUFF_MAX_TABLE_CODE_LEN 的 code 只記長度（bits 無意義），由呼叫端檢查
+static void tree_code_table(const HuffTree* t, int root, HuffCodeEntry table[256]) {
+    int16_t  stack[TREE_MAX_NODES];
+    uint64_t bits[TREE_MAX_NODES];
+    int      depth[TREE_MAX_NODES];
+    int      sp = 0;
 
-    // 葉節點：指定 code
-    if (!root->left && !root->right) {
-        if (prefix[0] == '\0') {
-            // 特例：只有一種 symbol，給它 "0"
-            strcpy(root->code, "0");
-        } else {
-            strcpy(root->code, prefix);
+    memset(table, 0, sizeof(HuffCodeEntry) * 256);
+    if (root < 0) return;
+    stack[sp] = (int16_t)root;
+    bits[sp]  = 0;
+    depth[sp] = 0;
+    sp++;
+    while (sp > 0) {
+        sp--;
+        int      n = stack[sp];
+        uint64_t b = bits[sp];
+        int      d = depth[sp];
+        if (t->left[n] < 0) {
+            table[t->symbol[n]].bits = b;
+            table[t->symbol[n]].len  = d ? d : 1;
+            continue;
         }
-        return;
+        stack[sp] = t->right[n];
+        bits[sp]  = (b << 1) | 1;
+        depth[sp] = d + 1;
+        sp++;
+        stack[sp] = t->left[n];
+        bits[sp]  = b << 1;
+        depth[sp] = d + 1;
+        sp++;
+    }
+}
+
+/* ----------------------------- 頻率統計 ---------------------------------- */
+
+/*
+ * 所有平行工作（頻率統計、打包、framed 的 block、批次的檔案）都丟進
+ * 同一個 work-stealing pool（見 huffman.h 與下面的 EncPool），不再各自
+ * 開關執行緒；pool 是 NULL（單執行緒）時在呼叫端循序執行，結果相同。
+ * 各 task 的結果存在自己的 task 結構裡、依順序合併，所以輸出與執行緒數
+ * 無關。
+ */
+#define MAX_THREADS     HUFF_POOL_MAX_THREADS
+#define POOL_QUEUE_CAP  64   // 每個 worker 的 deque 容量，滿了丟 task 的人自己先做
+
+/*
+ * 單檔模式的 pool 在第一個真的要分工的步驟才建立：小檔案整個流程都不會
+ * 分工，就不必開執行緒。批次模式由 main 事先建好（threads 為 0），各檔案
+ * 同時使用時不會再寫入這個結構。
+ */
+typedef struct EncPool {
+    HuffPool *pool;      // NULL 表示還沒建立或單執行緒
+    int       threads;   // 單檔模式要開的 worker 數；批次模式為 0
+    int       tried;     // 已經試過建立（失敗就維持單執行緒，不再重試）
+} EncPool;
+
+static HuffPool* enc_pool(EncPool* ep) {
+    if (!ep->pool && !ep->tried && ep->threads > 1) {
+        ep->pool  = huff_pool_new(ep->threads, POOL_QUEUE_CAP);
+        ep->tried = 1;
+    }
+    return ep->pool;
+}
+
+/*
+ * 多執行緒頻率統計：輸入切成連續的 slice，每個 task 統計到自己的
+ * 私有 histogram，全部結束後再合併，task 之間不共用任何計數器。
+ * slice 數是執行緒數的幾倍，先做完的 worker 可以去偷別人的 slice。
+ */
+#define HIST_MIN_SLICE       (1 << 20)   // 每個 slice 至少的 bytes，太小不值得分出去
+#define HIST_SLICES_PER_THREAD 4
+
+typedef struct HistTask {
+    const unsigned char *data;
+    size_t               size;
+    long                 freq[256];
+} HistTask;
+
+static void* hist_worker(void* arg) {
+    HistTask* t = (HistTask*)arg;
+    huff_histogram(t->data, t->size, t->freq);
+    return NULL;
+}
+
+// 每個 worker 一行忙碌／閒置統計（沒有 pool 或沒有執行過 task 時不輸出）
+static void log_pool_stats(HuffPool* pool) {
+    long tasks = 0;
+    for (int w = 0; w < huff_pool_threads(pool) && pool; w++) {
+        HuffPoolStats st;
+        huff_pool_stats(pool, w, &st);
+        tasks += st.tasks;
+    }
+    for (int w = 0; w < huff_pool_threads(pool) && tasks > 0; w++) {
+        HuffPoolStats st;
+        huff_pool_stats(pool, w, &st);
+        log_info("metrics", "pool_worker worker=%d tasks=%ld steals=%ld "
+                 "busy_sec=%.15f idle_sec=%.15f",
+                 w, st.tasks, st.steals, st.busy_sec, st.idle_sec);
+    }
+}
+
+// 統計 freq[256]（由這裡清為 0），回傳實際使用的執行緒數
+static int parallel_histogram(EncPool* ep, const unsigned char* data, size_t size,
+                              int threads, long freq[256]) {
+    size_t max_by_size = size / HIST_MIN_SLICE;
+    size_t n = (size_t)threads * HIST_SLICES_PER_THREAD;
+    if (n > max_by_size) n = max_by_size;
+
+    if (threads <= 1 || n <= 1) {
+        huff_histogram(data, size, freq);
+        return 1;
+    }
+
+    HistTask* tasks = (HistTask*)malloc(sizeof(HistTask) * n);
+    if (!tasks) {
+        huff_histogram(data, size, freq);
+        return 1;
     }
 
-    char left_prefix[256];
-    char right_prefix[256];
+    size_t slice = size / n;
+    for (size_t t = 0; t < n; t++) {
+        tasks[t].data = data + slice * t;
+        tasks[t].size = (t == n - 1) ? size - slice * t : slice;
+    }
+    int used = huff_pool_run(enc_pool(ep), tasks, sizeof(HistTask), (long)n, hist_worker);
 
-    snprintf(left_prefix,  sizeof(left_prefix),  "%s0", prefix);
-    snprintf(right_prefix, sizeof(right_prefix), "%s1", prefix);
+    memcpy(freq, tasks[0].freq, sizeof(tasks[0].freq));
+    for (size_t t = 1; t < n; t++) {
+        for (int s = 0; s < 256; s++) freq[s] += tasks[t].freq[s];
+    }
 
-    generate_codes(root->left,  left_prefix);
-    generate_codes(root->right, right_prefix);
+    free(tasks);
+    return used;
 }
 
-/* ----------------------------- 釋放樹的記憶體 ----------------------------- */
+/* ------------------------- 平行編碼（raw / container） ---------------------- */
+
+/*
+ * 每個 symbol 的 code 長度在編碼前就已知道，所以每一段輸入會輸出幾個
+ * bit 可以先算出來；對各段的 bit 數做 prefix sum，就得到每段在輸出中
+ * 的精確起始 bit，各執行緒便能同時把自己那段打包進同一個輸出緩衝區。
+ *
+ * 相鄰兩段的交界多半落在同一個 byte 的中間：各段頭尾這兩個 byte
+ * 不直接寫進緩衝區，而是先存在 task 裡（head / tail），全部執行緒
+ * 結束後再由主執行緒 OR 進去，因此不會有兩個執行緒寫同一個 byte。
+ * 每段至少 PAR_ENC_MIN_CHUNK 個 symbol，頭尾一定是不同的 byte。
+ *
+ * 各段直接打包進預先配好的整個輸出（out），不再經過暫存區。輸入一輪
+ * 處理 threads * PAR_ENC_ROUND_CHUNK bytes，每輪的起始 bit 接在上一輪
+ * 後面；上一輪最後不滿 8 bits 的 byte 在清掉交界前先保留下來再 OR 回去。
+ * 輸出與單執行緒的 bit writer 完全相同。
+ */
+#define PAR_ENC_MIN_CHUNK   (1 << 20)   // 每段至少的 symbol 數
+#define PAR_ENC_ROUND_CHUNK (8 << 20)   // 每輪每個執行緒處理的 bytes
+
+typedef struct PackTask {
+    const unsigned char *data;      // 這段輸入
+    size_t               size;
+    const HuffCodeEntry *table;
+    unsigned char       *out;       // 整個 payload 的輸出區
+    uint64_t             bit_off;   // 這段在 out 中的起始 bit
+    uint64_t             nbits;     // 這段輸出的 bit 數
+    unsigned char        head;      // out[bit_off / 8]
+    unsigned char        tail;      // out[(bit_off + nbits - 1) / 8]
+} PackTask;
+
+static void* count_bits_worker(void* arg) {
+    PackTask* t = (PackTask*)arg;
+    uint64_t bits = 0;
+    for (size_t k = 0; k < t->size; k++) bits += (uint64_t)t->table[t->data[k]].len;
+    t->nbits = bits;
+    return NULL;
+}
 
-static void free_tree(Node* root) {
-    if (!root) return;
-    free_tree(root->left);
-    free_tree(root->right);
-    free(root);
+static void* pack_worker(void* arg) {
+    PackTask* t = (PackTask*)arg;
+    huff_pack_span(t->table, t->data, t->size, t->out + t->bit_off / 8,
+                   (int)(t->bit_off % 8), &t->head, &t->tail);
+    return NULL;
 }
 
-/* ---------------------- codebook 排序用比較函式 --------------------------- */
+// 平行編碼整份輸入打包進 out（大小至少是 payload 的 byte 數），
+// 回傳實際使用的執行緒數；記憶體不足回傳 -1
+static int parallel_encode(EncPool* ep, const unsigned char* data, size_t size,
+                           const HuffCodeEntry table[256], int threads,
+                           unsigned char* out) {
+    HuffPool* pool  = enc_pool(ep);
+    PackTask* tasks = (PackTask*)malloc(sizeof(PackTask) * (size_t)threads);
+    uint64_t  bit   = 0;    // 目前已經輸出的 bit 數
+    int       used  = 1;
 
-static int compare_nodes(const void* a, const void* b) {
-    const Node* na = *(const Node**)a;
-    const Node* nb = *(const Node**)b;
+    if (!tasks) return -1;
 
-    if (na->count != nb->count)
-        return (na->count < nb->count) ? -1 : 1;
-    if (na->symbol != nb->symbol)
-        return (na->symbol < nb->symbol) ? -1 : 1;
+    for (size_t off = 0; off < size; ) {
+        // 這一輪切成 n 段，每段至少 PAR_ENC_MIN_CHUNK（最後一輪的尾巴併進最後一段）
+        size_t round = size - off;
+        if (round > (size_t)threads * PAR_ENC_ROUND_CHUNK) {
+            round = (size_t)threads * PAR_ENC_ROUND_CHUNK;
+        }
+        int n = (int)(round / PAR_ENC_MIN_CHUNK);
+        if (n > threads) n = threads;
+        if (n < 1) n = 1;
+
+        size_t chunk = round / (size_t)n;
+        for (int t = 0; t < n; t++) {
+            tasks[t].data  = data + off + chunk * (size_t)t;
+            tasks[t].size  = (t == n - 1) ? round - chunk * (size_t)t : chunk;
+            tasks[t].table = table;
+            tasks[t].out   = out;
+        }
+        huff_pool_run(pool, tasks, sizeof(PackTask), n, count_bits_worker);
+
+        // prefix sum：各段在輸出中的起始 bit
+        uint64_t start = bit;
+        for (int t = 0; t < n; t++) {
+            tasks[t].bit_off = bit;
+            bit += tasks[t].nbits;
+        }
+        // 上一輪最後不滿 8 bits 的 byte
+        unsigned char carry = (start % 8) ? out[start / 8] : 0;
+
+        int u = huff_pool_run(pool, tasks, sizeof(PackTask), n, pack_worker);
+        if (u > used) used = u;
+
+        // 接上交界的 byte：先清成 0 再把各段的 head / tail 與 carry OR 進去
+        for (int t = 0; t < n; t++) {
+            out[tasks[t].bit_off / 8] = 0;
+            out[(tasks[t].bit_off + tasks[t].nbits - 1) / 8] = 0;
+        }
+        out[start / 8] |= carry;
+        for (int t = 0; t < n; t++) {
+            out[tasks[t].bit_off / 8] |= tasks[t].head;
+            out[(tasks[t].bit_off + tasks[t].nbits - 1) / 8] |= tasks[t].tail;
+        }
+        off += round;
+    }
+
+    free(tasks);
+    return used;
+}
+
+/* ------------------------------- sync index -------------------------------- */
+
+/*
+ * 第 k 個 checkpoint 是第 (k+1) * interval 個 symbol 在 payload 中的
+ * bit offset，只要把 code 長度累加起來就知道，不必真的編碼。
+ * 回傳 malloc 的 offset 陣列（checkpoint 數存到 *count），失敗回傳 NULL。
+ */
+static long* build_sync_index(const unsigned char* data, size_t size,
+                              const HuffCodeEntry table[256], long interval,
+                              long* count) {
+    long  n    = (size > 0) ? (long)((size - 1) / (size_t)interval) : 0;
+    long* offs = (long*)malloc(sizeof(long) * (size_t)(n > 0 ? n : 1));
+    if (!offs) return NULL;
+
+    long   bit  = 0;
+    long   k    = 0;
+    size_t next = (size_t)interval;
+    for (size_t pos = 0; k < n; pos++) {
+        if (pos == next) {
+            offs[k++] = bit;
+            next += (size_t)interval;
+        }
+        bit += table[data[pos]].len;
+    }
+    *count = n;
+    return offs;
+}
+
+/* ---------------------------- 多 stream 編碼 ------------------------------- */
+
+/*
+ * 第 i 個 symbol 編進第 i % n 個 stream。各 stream 的 bit 數先算好寫成
+ * jump table，接著依序寫出每個 stream（各自補 0 到 byte 邊界），
+ * decoder 讀完 jump table 就知道每個 stream 從哪裡開始。格式見 huffman.h。
+ */
+static void stream_bit_counts(const unsigned char* data, size_t size,
+                              const HuffCodeEntry table[256], int n, long bits[]) {
+    for (int k = 0; k < n; k++) bits[k] = 0;
+    for (size_t pos = 0; pos < size; pos++) {
+        bits[pos % (size_t)n] += table[data[pos]].len;
+    }
+}
+
+// payload 的總 byte 數（jump table + 各 stream 補齊後的大小）
+static long stream_payload_bytes(int n, const long bits[]) {
+    long bytes = 8L * n;
+    for (int k = 0; k < n; k++) bytes += (bits[k] + 7) / 8;
+    return bytes;
+}
+
+static void encode_streams(const unsigned char* data, size_t size,
+                           const HuffCodeEntry table[256], int n, const long bits[],
+                           BitWriter* bw) {
+    // jump table：每個 stream 的 bit 數（u64 little-endian）
+    for (int k = 0; k < n; k++) {
+        unsigned char le[8];
+        for (int b = 0; b < 8; b++) le[b] = (unsigned char)((uint64_t)bits[k] >> (8 * b));
+        bw_put_bytes(bw, le, 8);
+    }
+
+    for (int k = 0; k < n; k++) {
+        for (size_t pos = (size_t)k; pos < size; pos += (size_t)n) {
+            const HuffCodeEntry* e = &table[data[pos]];
+            bw_put(bw, e->bits, e->len);
+        }
+        bw_align(bw);
+    }
+}
+
+/* ------------------------------ framed 編碼 ------------------------------- */
+
+/*
+ * 輸入切成 block_size 大小的 block，每個 block 各自統計頻率、建 codebook，
+ * 寫出 block header（code 長度與 payload bit 數）後緊接著該 block 的 payload。
+ * 格式定義見 huffman.h。
+ *
+ * block 之間互不相關：一次把最多 window 個 block 丟進 pool，各自統計、
+ * 建表並打包到自己的緩衝區，全部做完後再依 block 順序寫出。每個 block
+ * 的 payload 補齊到 byte 邊界，所以和逐個 symbol 寫進 bit writer 的結果
+ * 完全相同；同時在記憶體中的只有 window 個 block 的輸出。block 可以大到
+ * 1 GiB，所以 window 除了跟著執行緒數，也受 FRAME_WINDOW_MAX_BYTES 限制
+ * （至少 1 個 block）。
+ */
+#define FRAME_WINDOW_PER_THREAD 4
+#define FRAME_WINDOW_MAX_BYTES  (64L << 20)   // window 內所有輸出緩衝區的上限
+
+typedef struct FrameStats {
+    long num_blocks;     // block 數
+    long header_bytes;   // 檔案 header + 所有 block header + 結束標記
+    long payload_bits;   // 所有 block payload 的 bit 數總和
+    long payload_bytes;  // 所有 block payload 補齊到 byte 之後的 bytes
+} FrameStats;
+
+typedef struct FrameTask {
+    const unsigned char *data;   // 這個 block 的輸入
+    size_t               size;
+    int                  max_code_len;
+    HuffFrameBlock       blk;
+    unsigned char       *out;    // 打包好的 payload（至少 size + 8 bytes）
+    int                  err;    // code 長度超過 max_code_len
+} FrameTask;
+
+static void* frame_worker(void* arg) {
+    FrameTask* t = (FrameTask*)arg;
+    long bf[256];
+    HuffCodeEntry table[256];
+
+    huff_histogram(t->data, t->size, bf);
+    t->blk.raw_len = (long)t->size;
+    t->err = huff_code_lengths(bf, t->max_code_len, t->blk.lens) != 0 ||
+             huff_code_table(t->blk.lens, table) != 0;
+    if (t->err) return NULL;
+    t->blk.payload_bits = 0;
+    for (int s = 0; s < 256; s++) {
+        t->blk.payload_bits += (long)table[s].len * bf[s];
+    }
+    // Huffman code 的平均長度不超過 8 bits，payload 不會比輸入大
+    huff_pack(table, t->data, t->size, t->out);
+    return NULL;
+}
+
+static int encode_framed(EncPool* ep, const unsigned char* data, size_t size,
+                         long block_size, int max_code_len, BitWriter* bw,
+                         FrameStats* st) {
+    unsigned char hdr[HUFF_FR_BLOCK_HEADER_SIZE];
+    int ret = 0;
+
+    memset(st, 0, sizeof(*st));
+    huff_frame_pack_header(hdr, block_size);
+    bw_put_bytes(bw, hdr, HUFF_FR_HEADER_SIZE);
+    st->header_bytes += HUFF_FR_HEADER_SIZE;
+
+    size_t nblocks = (size + (size_t)block_size - 1) / (size_t)block_size;
+    HuffPool* pool = nblocks > 1 ? enc_pool(ep) : NULL;
+    size_t blk_cap = size < (size_t)block_size ? size : (size_t)block_size;
+    size_t window  = (size_t)huff_pool_threads(pool) * FRAME_WINDOW_PER_THREAD;
+    size_t by_mem  = (size_t)FRAME_WINDOW_MAX_BYTES / (blk_cap + 8);
+    if (window > by_mem) window = by_mem;
+    if (!pool || window < 1) window = 1;
+    if (window > nblocks) window = nblocks;
+
+    FrameTask* tasks = (FrameTask*)calloc(window ? window : 1, sizeof(FrameTask));
+    if (!tasks) return -2;
+    for (size_t k = 0; k < window; k++) {
+        tasks[k].out = (unsigned char*)malloc(blk_cap + 8);
+        if (!tasks[k].out) ret = -2;
+    }
+
+    for (size_t first = 0; ret == 0 && first < nblocks; first += window) {
+        size_t n = nblocks - first < window ? nblocks - first : window;
+        for (size_t k = 0; k < n; k++) {
+            size_t off = (first + k) * (size_t)block_size;
+            tasks[k].data         = data + off;
+            tasks[k].size         = size - off < (size_t)block_size ? size - off
+                                                                    : (size_t)block_size;
+            tasks[k].max_code_len = max_code_len;
+        }
+        huff_pool_run(pool, tasks, sizeof(FrameTask), (long)n, frame_worker);
+
+        for (size_t k = 0; k < n; k++) {
+            FrameTask* t = &tasks[k];
+            if (t->err) {
+                ret = -1;
+                break;
+            }
+            huff_frame_pack_block(hdr, &t->blk);
+            bw_put_bytes(bw, hdr, HUFF_FR_BLOCK_HEADER_SIZE);
+            bw_put_bytes(bw, t->out, (size_t)((t->blk.payload_bits + 7) / 8));
+
+            st->num_blocks++;
+            st->header_bytes += HUFF_FR_BLOCK_HEADER_SIZE;
+            st->payload_bits += t->blk.payload_bits;
+            st->payload_bytes += (t->blk.payload_bits + 7) / 8;
+        }
+    }
+    for (size_t k = 0; k < window; k++) free(tasks[k].out);
+    free(tasks);
+    if (ret != 0) return ret;
+
+    // 結束標記：raw_len = 0
+    memset(hdr, 0, HUFF_FR_END_SIZE);
+    bw_put_bytes(bw, hdr, HUFF_FR_END_SIZE);
+    st->header_bytes += HUFF_FR_END_SIZE;
     return 0;
 }
 
-/* ------------------------ 輸出 symbol 字串（含跳脫） ---------------------- */
-
-static void print_symbol(FILE* fp, unsigned char s) {
-    // 依 decoder 的 parse_symbol 寫法，\n, \t, \r 用跳脫字元
-    if (s == '\n') {
-        fprintf(fp, "\"\\n\"");
-    } else if (s == '\t') {
-        fprintf(fp, "\"\\t\"");
-    } else if (s == '\r') {
-        fprintf(fp, "\"\\r\"");
-    } else if (s == '\"') {
-        fprintf(fp, "\"\\\"\"");
-    } else if (s == '\\') {
-        fprintf(fp, "\"\\\\\"");
+/* ------------------------- 輸入資料（mmap / 緩衝區） ------------------------ */
+
+/*
+ * 輸入檔只讀進來一次：一般檔案直接 mmap，頻率統計與編碼兩個 pass
+ * 都掃同一塊映射；pipe / stdin 這類無法 mmap 的輸入則整個讀進
+ * malloc 的緩衝區。
+ */
+typedef struct InputData {
+    const unsigned char *data;    // 輸入內容
+    size_t               size;    // 位元組數
+    int                  mapped;  // 1 = mmap, 0 = malloc 緩衝區
+} InputData;
+
+static int read_all_fd(int fd, InputData* in) {
+    size_t cap = 1 << 16;
+    size_t len = 0;
+    unsigned char* buf = (unsigned char*)malloc(cap);
+    if (!buf) return -1;
+
+    while (1) {
+        if (len == cap) {
+            unsigned char* nbuf = (unsigned char*)realloc(buf, cap * 2);
+            if (!nbuf) {
+                free(buf);
+                return -1;
+            }
+            buf = nbuf;
+            cap *= 2;
+        }
+        ssize_t n = read(fd, buf + len, cap - len);
+        if (n < 0) {
+            free(buf);
+            return -1;
+        }
+        if (n == 0) break;
+        len += (size_t)n;
+    }
+
+    in->data   = buf;
+    in->size   = len;
+    in->mapped = 0;
+    return 0;
+}
+
+// 開啟輸入：成功回傳 0，失敗回傳 -1
+static int input_open(InputData* in, const char* fn, int allow_mmap) {
+    int fd = (strcmp(fn, "-") == 0) ? STDIN_FILENO : open(fn, O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    int ret = -1;
+    if (allow_mmap && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size > 0) {
+        void* p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            in->data   = (const unsigned char*)p;
+            in->size   = (size_t)st.st_size;
+            in->mapped = 1;
+            ret = 0;
+        }
+    }
+    if (ret != 0) {
+        // fallback：pipe、空檔案或 mmap 失敗時，整個讀進記憶體
+        ret = read_all_fd(fd, in);
+    }
+
+    if (fd != STDIN_FILENO) close(fd);
+    return ret;
+}
+
+// 每個 pass 開始前提示 kernel 接下來是循序讀取
+static void input_advise_sequential(const InputData* in) {
+    if (in->mapped) {
+        madvise((void*)in->data, in->size, MADV_SEQUENTIAL);
+    }
+}
+
+static void input_close(InputData* in) {
+    if (in->mapped) {
+        munmap((void*)in->data, in->size);
+    } else {
+        free((void*)in->data);
+    }
+    in->data = NULL;
+    in->size = 0;
+}
+
+/* ------------------------------ 輸出 -------------------------------------- */
+
+/*
+ * 非 framed 格式的輸出大小在開檔前就能精確算出：header + payload
+ * （(total_bits + 7) / 8，多 stream 再加 jump table 與 padding）+ sync
+ * index。一般檔案先用 posix_fallocate 配好這個大小（之後寫映射不會因為
+ * 磁碟滿而 SIGBUS），再整個 mmap 進來，bit writer 與平行編碼都直接打包
+ * 到檔案裡的最終位置；pipe 這類無法映射的輸出則配一塊同樣大小的緩衝區，
+ * 最後一次 write() 出去。輸出路徑完全不經過 stdio。
+ */
+typedef struct EncOutput {
+    int            fd;
+    unsigned char *buf;      // 預留的輸出區；NULL 表示還沒預留（framed 直接串流）
+    size_t         size;     // 輸出的精確大小
+    int            mapped;   // 1 = 檔案的映射，0 = malloc 緩衝區
+} EncOutput;
+
+// 開啟輸出檔：成功回傳 0，失敗回傳 -1
+static int output_open(EncOutput* o, const char* fn) {
+    struct stat st;
+    o->buf    = NULL;
+    o->size   = 0;
+    o->mapped = 0;
+    o->fd     = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (o->fd < 0) return -1;
+
+    // 寫入映射需要可讀寫的 fd，只對一般檔案重開（pipe 用 O_RDWR 開會
+    // 連讀取端一起持有，讀的一方結束後 write 就不會收到 SIGPIPE）；
+    // 重開失敗（例如只有寫入權限）就維持純寫入
+    if (fstat(o->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        int rw = open(fn, O_RDWR);
+        if (rw >= 0) {
+            close(o->fd);
+            o->fd = rw;
+        }
+    }
+    return 0;
+}
+
+// 預留 size bytes 的輸出區：一般檔案放大後 mmap，否則 malloc；失敗回傳 -1
+static int output_reserve(EncOutput* o, size_t size) {
+    struct stat st;
+    o->size = size;
+    if (size > 0 && fstat(o->fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        posix_fallocate(o->fd, 0, (off_t)size) == 0) {
+        void* m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, o->fd, 0);
+        if (m != MAP_FAILED) {
+            o->buf    = (unsigned char*)m;
+            o->mapped = 1;
+            return 0;
+        }
+        // 退回緩衝區：先把預先放大的部分截掉
+        if (ftruncate(o->fd, 0) != 0) return -1;
+    }
+    o->buf = (unsigned char*)malloc(size > 0 ? size : 1);
+    return o->buf ? 0 : -1;
+}
+
+// 發布輸出並關檔：映射直接解除（內容已在檔案裡），緩衝區一次 write()；
+// 寫入或關檔失敗回傳 -1
+static int output_close(EncOutput* o) {
+    int ret = 0;
+    if (o->mapped) {
+        munmap(o->buf, o->size);
+    } else if (o->buf) {
+        if (write_all(o->fd, o->buf, o->size) != 0) ret = -1;
+        free(o->buf);
+    }
+    o->buf = NULL;
+    if (close(o->fd) != 0) ret = -1;
+    return ret;
+}
+
+// 出錯時放棄輸出：不寫出緩衝區，只釋放資源
+static void output_abort(EncOutput* o) {
+    if (o->mapped) {
+        munmap(o->buf, o->size);
     } else {
-        fprintf(fp, "\"%c\"", s);
+        free(o->buf);
     }
+    o->buf = NULL;
+    close(o->fd);
+}
+
+// 單調時鐘（秒），用來計算 bytes/s
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static double bytes_per_sec(size_t bytes, double seconds) {
+    return (seconds > 0.0) ? (double)bytes / seconds : 0.0;
+}
+
+static void print_usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [--no-mmap] [--canonical] [--max-code-len=N] "
+                    "[--codebook-format=csv|bin] [--codebook-counts] "
+                    "[--export-csv=path] [--container] [--block-size=N[K|M]] "
+                    "[--sync-interval=N] [--streams=N] [--threads=N] "
+                    "[--manifest=path] [-j N] "
+                    "in_fn cb_fn enc_fn [in_fn cb_fn enc_fn ...]\n", prog);
 }
 
 /* ============================================================================
- * 主程式
+ * 編碼一個檔案
  * ==========================================================================*/
 
-int main(int argc, char **argv) {
-    /* ========================================================================
-     * 步驟 1: 參數驗證
-     * ======================================================================== */
-    
-    if (argc != 4) {
-        log_error("encoder", "invalid_arguments argc=%d", argc);
-        fprintf(stderr, "Usage: %s in_fn cb_fn enc_fn\n", argv[0]);
-        return 1;
-    }
+// 命令列選項；批次模式下所有檔案共用同一份（只讀）
+typedef struct EncOptions {
+    int  use_mmap;                // --no-mmap 時為 0
+    int  canonical;               // --canonical 時為 1
+    int  max_code_len;            // --max-code-len=N，0 表示不限制
+    int  cb_binary;               // --codebook-format=bin 時為 1
+    int  cb_counts;               // --codebook-counts 時為 1
+    const char *export_csv_fn;    // --export-csv=path
+    int  container;               // --container 時為 1
+    long block_size;              // --block-size=N，0 表示不分 block
+    int  threads;                 // --threads=N，0 表示自動偵測
+    long sync_interval;           // --sync-interval=N，0 表示不輸出 sync index
+    int  streams;                 // --streams=N，0 表示單一 stream
+    EncPool  *pool;               // 所有平行工作共用的執行緒池
+} EncOptions;
 
-    const char *in_fn  = argv[1];  // 輸入檔案（原始文字）
-    const char *cb_fn  = argv[2];  // codebook 檔案（符號編碼表）
-    const char *enc_fn = argv[3];  // 編碼輸出檔案（二進位資料）
+// 每個 worker 重複使用的工作區（codebook 的 code 字串表有 64 KiB，
+// 不放在 stack 上，也不能是 static：批次模式下多個檔案同時在編碼）
+typedef struct EncScratch {
+    char cb_codes[HUFF_NUM_SYMBOLS][HUFF_MAX_CODE_LEN + 1];
+} EncScratch;
+
+// 一個檔案的大小統計，批次模式的總結用
+typedef struct EncResult {
+    long input_bytes;    // 輸入的 bytes
+    long output_bytes;   // codebook 加上 encoded 檔的 bytes
+} EncResult;
+
+/*
+ * in_fn → cb_fn（codebook）+ enc_fn。log 與單檔執行時完全相同：
+ * start、metrics summary、finish 各一行。成功回傳 0，失敗回傳 1。
+ */
+static int encode_file(const EncOptions* opt, EncScratch* ws,
+                       const char* in_fn, const char* cb_fn, const char* enc_fn,
+                       EncResult* res) {
+    const int   use_mmap      = opt->use_mmap;
+    const int   canonical     = opt->canonical;
+    const int   max_code_len  = opt->max_code_len;
+    const int   cb_binary     = opt->cb_binary;
+    const int   cb_counts     = opt->cb_counts;
+    const char *export_csv_fn = opt->export_csv_fn;
+    const int   container     = opt->container;
+    const long  block_size    = opt->block_size;
+    const long  sync_interval = opt->sync_interval;
+    const int   streams       = opt->streams;
+    int  threads        = opt->threads;
+    int  write_codebook = strcmp(cb_fn, "-") != 0;   // container 可以不輸出 codebook
+
+    res->input_bytes  = 0;
+    res->output_bytes = 0;
 
     /* ========================================================================
-     * 步驟 2: 記錄程式開始執行
+     * 步驟 2: 記錄開始編碼這個檔案
      * ======================================================================== */
     
     log_info("encoder", "start input_file=%s cb_fn=%s enc_fn=%s",
@@ -195,29 +987,71 @@ int main(int argc, char **argv) {
 
     long freq[256] = {0};         // 每個 symbol 的出現次數
     long total_count = 0;         // 總符號數（包含重複）
-    int  i, c;
+    int  i;
 
-    // 3-1. 讀取輸入檔案並統計頻率
-    FILE *fin = fopen(in_fn, "rb");
-    if (!fin) {
-        log_error("encoder", "cannot_open_input_file file=%s", in_fn);
-        log_info("encoder", "finish status=error");
+    // 3-1. 讀取輸入檔案（只讀一次）並統計頻率
+    InputData input;
+    if (input_open(&input, in_fn, use_mmap) != 0) {
+        log_error("encoder", "cannot_open_input_file file=%s enc_fn=%s", in_fn, enc_fn);
+        log_info("encoder", "finish status=error enc_fn=%s", enc_fn);
         return 1;
     }
+    res->input_bytes = (long)input.size;
+    const unsigned char *data = input.data;
+    const char *input_mode = input.mapped ? "mmap" : "read";
+    const char *code_assignment = canonical ? "canonical" : "tree";
+    const char *codebook_format = !write_codebook ? "none" : cb_binary ? "bin" : "csv";
+    const char *output_format   = container ? "container" :
+                                  block_size > 0 ? "framed" : "raw";
+    long codebook_bytes = 0;
+    if (threads == 0) threads = huff_detect_threads();
 
-    while ((c = fgetc(fin)) != EOF) {
-        freq[(unsigned char)c]++;
-        total_count++;
-    }
-    fclose(fin);
+    double t_hist = now_seconds();
+    input_advise_sequential(&input);
+    int hist_threads = parallel_histogram(opt->pool, data, input.size, threads, freq);
+    total_count = (long)input.size;
+    double hist_bps = bytes_per_sec(input.size, now_seconds() - t_hist);
 
     // 若輸入檔案是空的，輸出空 codebook 與空 encoded 檔即可
     if (total_count == 0) {
-        log_info("encoder", "empty_input_file");
-        FILE *fcb_empty = fopen(cb_fn, "w");
-        if (fcb_empty) fclose(fcb_empty);
+        log_info("encoder", "empty_input_file enc_fn=%s", enc_fn);
+        input_close(&input);
+        FILE *fcb_empty = write_codebook ? fopen(cb_fn, cb_binary ? "wb" : "w") : NULL;
+        if (fcb_empty) {
+            HuffCodebook empty_cb;
+            memset(&empty_cb, 0, sizeof(empty_cb));
+            if (cb_binary) {
+                // 二進位格式仍要有 header，decoder 才認得出來
+                codebook_bytes = huff_codebook_write_bin(fcb_empty, &empty_cb);
+            } else {
+                // CSV 沒有任何 symbol；canonical 時仍要有註解行，canon engine 才肯解
+                huff_codebook_write_csv(fcb_empty, &empty_cb,
+                                        (const char (*)[HUFF_MAX_CODE_LEN + 1])ws->cb_codes,
+                                        canonical);
+                codebook_bytes = ftell(fcb_empty);
+            }
+            fclose(fcb_empty);
+        }
         FILE *fenc_empty = fopen(enc_fn, "wb");
-        if (fenc_empty) fclose(fenc_empty);
+        if (fenc_empty) {
+            if (block_size > 0) {
+                // 空的 framed 檔案：檔案 header 加上結束標記
+                unsigned char fr_buf[HUFF_FR_HEADER_SIZE + HUFF_FR_END_SIZE];
+                memset(fr_buf, 0, sizeof(fr_buf));
+                huff_frame_pack_header(fr_buf, block_size);
+                fwrite(fr_buf, 1, sizeof(fr_buf), fenc_empty);
+            } else if (container) {
+                // 空的 container 只有 header
+                HuffContainerHeader empty_hdr;
+                unsigned char hdr_buf[HUFF_CT_HEADER_SIZE];
+                memset(&empty_hdr, 0, sizeof(empty_hdr));
+                huff_container_pack_header(hdr_buf, &empty_hdr);
+                fwrite(hdr_buf, 1, sizeof(hdr_buf), fenc_empty);
+            }
+            res->output_bytes = ftell(fenc_empty);
+            fclose(fenc_empty);
+        }
+        res->output_bytes += codebook_bytes;
 
         // metrics 全部為 0
         log_info("metrics",
@@ -230,152 +1064,309 @@ int main(int argc, char **argv) {
                  "total_bits_huffman=%.15f "
                  "compression_ratio=%.15f "
                  "compression_factor=%.15f "
-                 "saving_percentage=%.15f",
+                 "saving_percentage=%.15f "
+                 "input_mode=%s "
+                 "histogram_bytes_per_sec=%.15f "
+                 "encode_bytes_per_sec=%.15f "
+                 "code_assignment=%s "
+                 "max_code_len=%d "
+                 "unrestricted_total_bits_huffman=%.15f "
+                 "length_limit_ratio_loss=%.15f "
+                 "codebook_format=%s "
+                 "codebook_bytes=%ld "
+                 "output_format=%s "
+                 "block_size=%ld "
+                 "num_blocks=%ld "
+                 "frame_header_bytes=%ld "
+                 "frame_payload_bits=%ld "
+                 "frame_ratio_gain=%.15f "
+                 "frame_header_overhead=%.15f "
+                 "threads=%d "
+                 "histogram_threads=%d "
+                 "encode_threads=%d "
+                 "sync_interval=%ld "
+                 "sync_points=%ld "
+                 "streams=%d "
+                 "stream_overhead_bytes=%ld",
                  in_fn,
                  (long)0,
                  0.0, 0.0, 0.0, 0.0,
-                 0.0, 0.0, 0.0, 0.0, 0.0);
+                 0.0, 0.0, 0.0, 0.0, 0.0,
+                 input_mode, 0.0, 0.0,
+                 code_assignment,
+                 max_code_len, 0.0, 0.0,
+                 codebook_format, codebook_bytes,
+                 output_format,
+                 block_size, 0L, 0L, 0L, 0.0, 0.0,
+                 threads, hist_threads, 1,
+                 sync_interval, 0L,
+                 streams, 0L);
 
-        log_info("encoder", "finish status=ok");
+        log_info("encoder", "finish status=ok enc_fn=%s", enc_fn);
         return 0;
     }
 
-    // 3-2. 建立 Huffman tree：為每個有出現的 symbol 建 leaf node
-    Node* leaf_nodes[256] = {0};
-    int distinct_count = 0;
-    heapSize = 0;
+    // 3-2. 算出每個 symbol 的 code 長度，並產生整數 code table
+    //      預設模式的 code 由 tree 的形狀決定；canonical 模式只需要長度
+    HuffCodeEntry code_table[256];
+    int  lens[HUFF_NUM_SYMBOLS] = {0};
+    int  distinct_count = 0;
+    if (canonical) {
+        distinct_count = huff_optimal_lengths(freq, lens);
+    } else {
+        HuffTree tree;
+        tree_code_table(&tree, tree_build(&tree, freq), code_table);
+        for (i = 0; i < 256; i++) {
+            lens[i] = code_table[i].len;
+            if (lens[i] > 0) distinct_count++;
+        }
+    }
 
+    long unrestricted_total_bits = 0;   // 不限長時 Huffman code 的總 bit 數
+    int  tree_max_len = 0;
     for (i = 0; i < 256; i++) {
-        if (freq[i] > 0) {
-            Node* n = (Node*)malloc(sizeof(Node));
-            n->symbol = (unsigned char)i;
-            n->count  = freq[i];
-            n->prob   = 0.0;
-            n->left   = n->right = NULL;
-            n->code[0] = '\0';
-            heap_push(n);
-            leaf_nodes[i] = n;
-            distinct_count++;
-        }
-    }
-
-    // 合併成一棵 Huffman tree
-    while (heapSize > 1) {
-        Node* a = heap_pop();
-        Node* b = heap_pop();
-        Node* parent = (Node*)malloc(sizeof(Node));
-        parent->symbol = 0;
-        parent->count  = a->count + b->count;
-        parent->prob   = 0.0;
-        parent->left   = a;
-        parent->right  = b;
-        parent->code[0] = '\0';
-        heap_push(parent);
-    }
-
-    Node* root = heap_pop();
-
-    // 3-3. 產生每個 symbol 的 Huffman code
-    generate_codes(root, "");
+        unrestricted_total_bits += (long)lens[i] * freq[i];
+        if (lens[i] > tree_max_len) tree_max_len = lens[i];
+    }
 
-    // 3-4. 計算機率與自資訊、entropy、平均 code 長度
-    Node* node_list[256];
-    int   node_idx = 0;
+    // 3-3. canonical 模式：超過長度上限才改用 package-merge，
+    //      再依 (長度, symbol) 指定 code
+    if (canonical && max_code_len > 0 && tree_max_len > max_code_len &&
+        huff_limited_lengths(freq, max_code_len, lens) != 0) {
+        log_error("encoder",
+                  "max_code_len_too_small max_code_len=%d distinct_symbols=%d enc_fn=%s",
+                  max_code_len, distinct_count, enc_fn);
+        log_info("encoder", "finish status=error enc_fn=%s", enc_fn);
+        input_close(&input);
+        return 1;
+    }
     for (i = 0; i < 256; i++) {
-        if (leaf_nodes[i]) {
-            leaf_nodes[i]->prob = (double)leaf_nodes[i]->count /
-                                  (double)total_count;
-            node_list[node_idx++] = leaf_nodes[i];
+        if (lens[i] > HUFF_MAX_TABLE_CODE_LEN) {
+            // 需要極度偏斜、數十 TB 等級的輸入才可能發生
+            log_error("encoder", "code_too_long symbol=%d code_len=%d max=%d enc_fn=%s",
+                      i, lens[i], HUFF_MAX_TABLE_CODE_LEN, enc_fn);
+            log_info("encoder", "finish status=error enc_fn=%s", enc_fn);
+            input_close(&input);
+            return 1;
         }
     }
+    if (canonical) huff_code_table(lens, code_table);
 
-    // 排序 codebook：依 count, symbol
-    qsort(node_list, node_idx, sizeof(Node*), compare_nodes);
+    // 3-4. 計算機率與自資訊、entropy、平均 code 長度
+    //      （依 count, symbol 的順序累加，與 codebook 的順序相同）
+    int syms[256];
+    int nsyms = huff_sort_symbols(freq, syms);
 
     double entropy = 0.0;
     double avg_code_len = 0.0;
     long   total_bits_huffman = 0;
 
-    for (i = 0; i < node_idx; i++) {
-        Node* n = node_list[i];
-        double p = n->prob;
+    for (i = 0; i < nsyms; i++) {
+        int s = syms[i];
+        double p = (double)freq[s] / (double)total_count;
         double self_info = 0.0;
         if (p > 0.0) {
             self_info = -log(p) / log(2.0);  // log2(1/p) = -log2(p)
             entropy  += p * self_info;
         }
-        int code_len = (int)strlen(n->code);
+        int code_len = code_table[s].len;
         avg_code_len += p * code_len;
-        total_bits_huffman += (long)code_len * n->count;
+        total_bits_huffman += (long)code_len * freq[s];
     }
 
     double perplexity = pow(2.0, entropy);
 
-    // 3-5. 輸出 codebook.csv
-    FILE *fcb = fopen(cb_fn, "w");
+    // 3-5. 輸出 codebook（CSV 或二進位）
+    HuffCodebook cb;
+    char (*cb_codes)[HUFF_MAX_CODE_LEN + 1] = ws->cb_codes;
+    memset(&cb, 0, sizeof(cb));
+    cb.total_symbols = total_count;
+    cb.has_counts    = cb_binary ? cb_counts : 1;
+    for (i = 0; i < 256; i++) {
+        int len = code_table[i].len;
+        for (int k = 0; k < len; k++) {
+            cb_codes[i][k] = (char)('0' + ((code_table[i].bits >> (len - 1 - k)) & 1));
+        }
+        cb_codes[i][len] = '\0';
+        if (len == 0) continue;
+        cb.lens[i]   = len;
+        cb.counts[i] = freq[i];
+    }
+
+    FILE *fcb = write_codebook ? fopen(cb_fn, cb_binary ? "wb" : "w") : NULL;
+    if (write_codebook && !fcb) {
+        log_error("encoder", "cannot_open_codebook_output file=%s enc_fn=%s", cb_fn, enc_fn);
+        log_info("encoder", "finish status=error enc_fn=%s", enc_fn);
+        input_close(&input);
+        return 1;
+    }
     if (!fcb) {
-        log_error("encoder", "cannot_open_codebook_output file=%s", cb_fn);
-        log_info("encoder", "finish status=error");
-        free_tree(root);
+        // container 模式且 cb_fn 為 "-"：不輸出 codebook
+    } else if (cb_binary) {
+        codebook_bytes = huff_codebook_write_bin(fcb, &cb);
+    } else {
+        huff_codebook_write_csv(fcb, &cb, (const char (*)[HUFF_MAX_CODE_LEN + 1])cb_codes,
+                                canonical);
+        codebook_bytes = ftell(fcb);
+    }
+    if ((fcb && fclose(fcb) != 0) || codebook_bytes < 0) {
+        log_error("encoder", "cannot_write_codebook_output file=%s enc_fn=%s", cb_fn, enc_fn);
+        log_info("encoder", "finish status=error enc_fn=%s", enc_fn);
+        input_close(&input);
         return 1;
     }
 
-    for (i = 0; i < node_idx; i++) {
-        Node* n = node_list[i];
-        double self_info = (n->prob > 0.0)
-                           ? -log(n->prob) / log(2.0)
-                           : 0.0;
-
-        print_symbol(fcb, n->symbol);
-        fprintf(fcb, ",%ld,%.15f,\"%s\",%.15f\n",
-                n->count,
-                n->prob,
-                n->code,
-                self_info);
+    if (export_csv_fn) {
+        // 除錯用的 CSV 匯出：一律附上 counts
+        FILE *fcsv = fopen(export_csv_fn, "w");
+        if (!fcsv) {
+            log_error("encoder", "cannot_open_csv_export file=%s enc_fn=%s",
+                      export_csv_fn, enc_fn);
+        } else {
+            cb.has_counts = 1;
+            huff_codebook_write_csv(fcsv, &cb,
+                                    (const char (*)[HUFF_MAX_CODE_LEN + 1])cb_codes,
+                                    canonical);
+            fclose(fcsv);
+        }
     }
-    fclose(fcb);
 
     // 3-6. 使用 Huffman code 編碼原始資料 → encoded.bin
-    fin = fopen(in_fn, "rb");
-    if (!fin) {
-        log_error("encoder", "cannot_reopen_input_file file=%s", in_fn);
-        log_info("encoder", "finish status=error");
-        free_tree(root);
-        return 1;
+    //      （直接掃描同一塊輸入，不再重新開檔）
+    long stream_bits[HUFF_CT_MAX_STREAMS];   // 多 stream 時各 stream 的 bit 數
+    long stream_overhead_bytes = 0;          // jump table 與各 stream 補齊的 bytes
+    long payload_bytes = (total_bits_huffman + 7) / 8;
+    if (streams > 0) {
+        stream_bit_counts(data, input.size, code_table, streams, stream_bits);
+        payload_bytes = stream_payload_bytes(streams, stream_bits);
+        stream_overhead_bytes = payload_bytes - (total_bits_huffman + 7) / 8;
     }
 
-    FILE *fenc = fopen(enc_fn, "wb");
-    if (!fenc) {
+    // sync index 只要累加 code 長度就能算出，先算好才知道輸出的總大小
+    long  sync_points = 0;      // sync index 的 checkpoint 數
+    long* sync_offs   = NULL;
+    if (sync_interval > 0) {
+        sync_offs = build_sync_index(data, input.size, code_table,
+                                     sync_interval, &sync_points);
+        if (!sync_offs) {
+            log_error("encoder", "memory_allocation_failed what=sync_index enc_fn=%s", enc_fn);
+            log_info("encoder", "finish status=error enc_fn=%s", enc_fn);
+            input_close(&input);
+            return 1;
+        }
+    }
+
+    EncOutput out;
+    if (output_open(&out, enc_fn) != 0) {
         log_error("encoder", "cannot_open_encoded_output file=%s", enc_fn);
-        log_info("encoder", "finish status=error");
-        fclose(fin);
-        free_tree(root);
+        log_info("encoder", "finish status=error enc_fn=%s", enc_fn);
+        free(sync_offs);
+        input_close(&input);
         return 1;
     }
 
-    unsigned char out_byte = 0;
-    int bit_count = 0;
-    while ((c = fgetc(fin)) != EOF) {
-        Node* n = leaf_nodes[(unsigned char)c];
-        const char* code = n->code;
-        for (int k = 0; code[k] != '\0'; k++) {
-            out_byte = (out_byte << 1) | (code[k] - '0');
-            bit_count++;
-            if (bit_count == 8) {
-                fwrite(&out_byte, 1, 1, fenc);
-                out_byte = 0;
-                bit_count = 0;
+    // framed 的大小要編完才知道，用串流的 bit writer；其他格式預留精確大小
+    long header_bytes = container ? HUFF_CT_HEADER_SIZE : 0;
+    long sync_bytes   = sync_offs ? HUFF_SYNC_SIZE(sync_points) : 0;
+    BitWriter bw;
+    int out_ok;
+    if (block_size > 0) {
+        out_ok = bw_init(&bw, out.fd) == 0;
+    } else {
+        out_ok = output_reserve(&out, (size_t)(header_bytes + payload_bytes +
+                                               sync_bytes)) == 0;
+        if (out_ok) bw_init_mem(&bw, out.buf + header_bytes, (size_t)payload_bytes);
+    }
+    if (!out_ok) {
+        log_error("encoder", "memory_allocation_failed what=output_buffer enc_fn=%s", enc_fn);
+        log_info("encoder", "finish status=error enc_fn=%s", enc_fn);
+        output_abort(&out);
+        free(sync_offs);
+        input_close(&input);
+        return 1;
+    }
+
+    if (container) {
+        // container header：payload 的精確 bit 數在編碼前就已知道
+        HuffContainerHeader hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.flags         = sync_interval > 0 ? HUFF_CT_HAS_SYNC : 0;
+        hdr.original_size = total_count;
+        hdr.payload_bits  = total_bits_huffman;
+        if (streams > 0) {
+            hdr.streams      = streams;
+            hdr.payload_bits = payload_bytes * 8;
+        }
+        for (i = 0; i < 256; i++) hdr.lens[i] = code_table[i].len;
+        huff_container_pack_header(out.buf, &hdr);
+    }
+
+    FrameStats frame;
+    memset(&frame, 0, sizeof(frame));
+    int enc_threads = 1;   // 編碼實際使用的執行緒數
+
+    double t_enc = now_seconds();
+    input_advise_sequential(&input);
+    if (block_size > 0) {
+        // framed：每個 block 各自建 codebook
+        int fr = encode_framed(opt->pool, data, input.size, block_size, max_code_len,
+                               &bw, &frame);
+        if (fr != 0) {
+            if (fr == -2) {
+                log_error("encoder", "memory_allocation_failed what=block_buffers enc_fn=%s",
+                          enc_fn);
+            } else {
+                log_error("encoder",
+                          "max_code_len_too_small max_code_len=%d reason=block enc_fn=%s",
+                          max_code_len, enc_fn);
             }
+            log_info("encoder", "finish status=error enc_fn=%s", enc_fn);
+            bw_finish(&bw);
+            output_abort(&out);
+            free(sync_offs);
+            input_close(&input);
+            return 1;
+        }
+    } else if (streams > 0) {
+        encode_streams(data, input.size, code_table, streams, stream_bits, &bw);
+    } else if (threads > 1 && input.size >= 2 * (size_t)PAR_ENC_MIN_CHUNK) {
+        // 平行編碼：各段直接打包進預留的輸出區，bit writer 沒有用到
+        enc_threads = parallel_encode(opt->pool, data, input.size, code_table, threads,
+                                      bw.buf);
+        if (enc_threads < 0) {
+            log_error("encoder", "memory_allocation_failed what=encode_tasks enc_fn=%s", enc_fn);
+            log_info("encoder", "finish status=error enc_fn=%s", enc_fn);
+            output_abort(&out);
+            free(sync_offs);
+            input_close(&input);
+            return 1;
         }
+    } else {
+        huff_pack(code_table, data, input.size, bw.buf);
+    }
+
+    if (sync_offs) {
+        // payload 之後接 sync index（--sync-interval 隱含 --container，不會是 framed）
+        huff_sync_pack(out.buf + header_bytes + payload_bytes, sync_interval,
+                       sync_offs, sync_points);
     }
-    fclose(fin);
+    free(sync_offs);
 
-    // 若最後不足 8 bits，用 0 padding
-    if (bit_count > 0) {
-        out_byte <<= (8 - bit_count);
-        fwrite(&out_byte, 1, 1, fenc);
+    // 寫出剩餘 bits（最後不足 8 bits 用 0 padding）
+    bw_finish(&bw);
+
+    if (output_close(&out) != 0) bw.io_error = 1;
+    if (bw.io_error) {
+        log_error("encoder", "cannot_write_encoded_output file=%s", enc_fn);
+        log_info("encoder", "finish status=error enc_fn=%s", enc_fn);
+        input_close(&input);
+        return 1;
     }
-    fclose(fenc);
+    double enc_bps = bytes_per_sec(input.size, now_seconds() - t_enc);
+    input_close(&input);
+    res->output_bytes = codebook_bytes + (block_size > 0 ? frame.header_bytes +
+                                          frame.payload_bytes
+                                        : header_bytes + payload_bytes + sync_bytes);
 
     /* ========================================================================
      * 步驟 4: 計算並輸出 Metrics 統計資訊
@@ -405,6 +1396,19 @@ int main(int argc, char **argv) {
     double compression_factor = total_bits_huff_d / total_bits_fixed;
     double saving_percentage  = 1.0 - compression_factor;
 
+    // 限長 code 相對於不限長 Huffman 損失的壓縮比例（0 表示沒有損失）
+    double length_limit_ratio_loss = 1.0 - (double)unrestricted_total_bits /
+                                           total_bits_huff_d;
+
+    // framed：各 block 自己的 codebook 相對於整檔單一 codebook 省下的比例，
+    // 以及 block header 佔的額外成本（都以整檔 Huffman 的 bit 數為分母）
+    double frame_ratio_gain      = 0.0;
+    double frame_header_overhead = 0.0;
+    if (block_size > 0) {
+        frame_ratio_gain      = 1.0 - (double)frame.payload_bits / total_bits_huff_d;
+        frame_header_overhead = (double)frame.header_bytes * 8.0 / total_bits_huff_d;
+    }
+
     log_info("metrics",
              "summary input_file=%s num_symbols=%ld "
              "fixed_code_bits_per_symbol=%.15f "
@@ -415,7 +1419,30 @@ int main(int argc, char **argv) {
              "total_bits_huffman=%.15f "
              "compression_ratio=%.15f "
              "compression_factor=%.15f "
-             "saving_percentage=%.15f",
+             "saving_percentage=%.15f "
+             "input_mode=%s "
+             "histogram_bytes_per_sec=%.15f "
+             "encode_bytes_per_sec=%.15f "
+             "code_assignment=%s "
+             "max_code_len=%d "
+             "unrestricted_total_bits_huffman=%.15f "
+             "length_limit_ratio_loss=%.15f "
+             "codebook_format=%s "
+             "codebook_bytes=%ld "
+             "output_format=%s "
+             "block_size=%ld "
+             "num_blocks=%ld "
+             "frame_header_bytes=%ld "
+             "frame_payload_bits=%ld "
+             "frame_ratio_gain=%.15f "
+             "frame_header_overhead=%.15f "
+             "threads=%d "
+             "histogram_threads=%d "
+             "encode_threads=%d "
+             "sync_interval=%ld "
+             "sync_points=%ld "
+             "streams=%d "
+             "stream_overhead_bytes=%ld",
              in_fn,
              num_symbols,
              fixed_bps,
@@ -426,14 +1453,361 @@ int main(int argc, char **argv) {
              total_bits_huff_d,
              compression_ratio,
              compression_factor,
-             saving_percentage);
+             saving_percentage,
+             input_mode,
+             hist_bps,
+             enc_bps,
+             code_assignment,
+             max_code_len,
+             (double)unrestricted_total_bits,
+             length_limit_ratio_loss,
+             codebook_format,
+             codebook_bytes,
+             output_format,
+             block_size,
+             frame.num_blocks,
+             frame.header_bytes,
+             frame.payload_bits,
+             frame_ratio_gain,
+             frame_header_overhead,
+             threads,
+             hist_threads,
+             enc_threads,
+             sync_interval,
+             sync_points,
+             streams,
+             stream_overhead_bytes);
 
     /* ========================================================================
-     * 步驟 5: 記錄程式成功結束
+     * 步驟 5: 記錄這個檔案成功結束
      * ======================================================================== */
     
-    log_info("encoder", "finish status=ok");
+    if (opt->pool->threads > 0) log_pool_stats(opt->pool->pool);   // 批次模式在 batch_finish 之前
+    log_info("encoder", "finish status=ok enc_fn=%s", enc_fn);
 
-    free_tree(root);
     return 0;
 }
+
+/* ============================================================================
+ * 批次模式：一個 process 編碼很多檔案
+ * ==========================================================================*/
+
+/*
+ * 省下每個檔案各開一個 process 的成本（啟動、logger 設定）。每個檔案是
+ * pool 裡的一個 task，由 -j 個 worker 依序領取、互相偷；每個 worker 整個
+ * 批次重複使用同一份工作區（等待時只會幫忙同一組的 task，一個 worker
+ * 同時只會編一個檔案）。每個檔案照常輸出自己的 metrics summary，全部
+ * 結束後再輸出一行 batch_summary。
+ */
+typedef struct BatchShared {
+    const EncOptions*   opt;
+    const HuffManifest* jobs;
+    EncScratch*         ws[MAX_THREADS];   // 依 worker 編號，第一次用到時配置
+    int*                status;    // 每個檔案 encode_file 的回傳值
+    EncResult*          results;
+} BatchShared;
+
+typedef struct BatchTask {
+    BatchShared* sh;
+    long         k;        // 第幾個檔案
+} BatchTask;
+
+static void* batch_worker(void* arg) {
+    BatchShared* sh = ((BatchTask*)arg)->sh;
+    long         k  = ((BatchTask*)arg)->k;
+    int          w  = huff_pool_worker(sh->opt->pool->pool);
+    const char** f  = sh->jobs->paths + 3 * k;
+
+    if (!sh->ws[w]) sh->ws[w] = (EncScratch*)malloc(sizeof(EncScratch));
+    if (!sh->ws[w]) {
+        log_error("encoder", "memory_allocation_failed what=scratch file=%s", f[0]);
+        return NULL;   // status 維持 1
+    }
+    sh->status[k] = encode_file(sh->opt, sh->ws[w], f[0], f[1], f[2], &sh->results[k]);
+    return NULL;
+}
+
+// 編碼 jobs 裡的所有檔案，全部成功回傳 0
+static int encode_batch(const EncOptions* opt, const HuffManifest* jobs) {
+    BatchShared sh;
+    int         num_jobs = huff_pool_threads(opt->pool->pool);
+
+    if (num_jobs > jobs->count) num_jobs = jobs->count > 0 ? (int)jobs->count : 1;
+    log_info("encoder", "batch_start files=%ld jobs=%d", jobs->count, num_jobs);
+
+    memset(&sh, 0, sizeof(sh));
+    sh.opt     = opt;
+    sh.jobs    = jobs;
+    sh.status  = (int*)malloc(sizeof(int) * (size_t)(jobs->count + 1));
+    sh.results = (EncResult*)calloc((size_t)jobs->count + 1, sizeof(EncResult));
+    BatchTask* tasks = (BatchTask*)malloc(sizeof(BatchTask) * (size_t)(jobs->count + 1));
+    if (!sh.status || !sh.results || !tasks) {
+        log_error("encoder", "memory_allocation_failed what=batch_results");
+        log_info("encoder", "batch_finish status=error");
+        free(sh.status);
+        free(sh.results);
+        free(tasks);
+        return 1;
+    }
+    for (long k = 0; k < jobs->count; k++) {
+        sh.status[k] = 1;
+        tasks[k].sh  = &sh;
+        tasks[k].k   = k;
+    }
+
+    double t0   = now_seconds();
+    int    used = huff_pool_run(opt->pool->pool, tasks, sizeof(BatchTask), jobs->count,
+                                batch_worker);
+    double secs = now_seconds() - t0;
+    free(tasks);
+    for (int w = 0; w < MAX_THREADS; w++) free(sh.ws[w]);
+
+    long failed = 0, input_bytes = 0, output_bytes = 0;
+    for (long k = 0; k < jobs->count; k++) {
+        if (sh.status[k] != 0) failed++;
+        input_bytes  += sh.results[k].input_bytes;
+        output_bytes += sh.results[k].output_bytes;
+    }
+    free(sh.status);
+    free(sh.results);
+
+    log_info("metrics",
+             "batch_summary files=%ld ok=%ld failed=%ld jobs=%d "
+             "input_bytes=%ld output_bytes=%ld seconds=%.15f "
+             "files_per_sec=%.15f input_bytes_per_sec=%.15f",
+             jobs->count, jobs->count - failed, failed, used,
+             input_bytes, output_bytes, secs,
+             secs > 0.0 ? (double)jobs->count / secs : 0.0,
+             bytes_per_sec((size_t)input_bytes, secs));
+    log_pool_stats(opt->pool->pool);
+    log_info("encoder", "batch_finish status=%s", failed ? "error" : "ok");
+    return failed ? 1 : 0;
+}
+
+/* ============================================================================
+ * 主程式
+ * ==========================================================================*/
+
+int main(int argc, char **argv) {
+    /* ========================================================================
+     * 步驟 1: 參數驗證
+     * ======================================================================== */
+    
+    int  num_args = 0;            // 位置參數（in_fn cb_fn enc_fn，可以有好幾組）的個數
+    int  use_mmap = 1;            // --no-mmap 時為 0
+    int  canonical = 0;           // --canonical 時為 1
+    int  max_code_len = 0;        // --max-code-len=N，0 表示不限制
+    int  cb_binary = 0;           // --codebook-format=bin 時為 1
+    int  cb_counts = 0;           // --codebook-counts 時為 1
+    const char *export_csv_fn = NULL;  // --export-csv=path
+    int  container = 0;           // --container 時為 1
+    long block_size = 0;          // --block-size=N，0 表示不分 block
+    int  threads = 0;             // --threads=N，0 表示自動偵測
+    long sync_interval = 0;       // --sync-interval=N，0 表示不輸出 sync index
+    int  streams = 0;             // --streams=N，0 表示單一 stream
+    const char *manifest_fn = NULL;   // --manifest=path，"-" 表示從 stdin 讀
+    int  num_jobs = 0;            // -j N / --jobs=N：批次模式同時編碼的檔案數，0 表示自動偵測
+
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "--no-mmap") == 0) {
+            use_mmap = 0;
+        } else if (strcmp(argv[a], "--canonical") == 0) {
+            canonical = 1;
+        } else if (strncmp(argv[a], "--max-code-len=", 15) == 0) {
+            max_code_len = atoi(argv[a] + 15);
+            if (max_code_len < 1 || max_code_len > HUFF_MAX_TABLE_CODE_LEN) {
+                log_error("encoder", "invalid_max_code_len value=%s", argv[a] + 15);
+                print_usage(argv[0]);
+                return 1;
+            }
+            canonical = 1;   // 限長 code 不是 tree 形狀，只能用 canonical 指定
+        } else if (strcmp(argv[a], "--codebook-format=csv") == 0) {
+            cb_binary = 0;
+        } else if (strcmp(argv[a], "--codebook-format=bin") == 0) {
+            cb_binary = 1;
+            canonical = 1;   // 二進位 codebook 只存長度
+        } else if (strcmp(argv[a], "--codebook-counts") == 0) {
+            cb_counts = 1;
+        } else if (strncmp(argv[a], "--export-csv=", 13) == 0) {
+            export_csv_fn = argv[a] + 13;
+        } else if (strncmp(argv[a], "--block-size=", 13) == 0) {
+            char* end = NULL;
+            block_size = strtol(argv[a] + 13, &end, 10);
+            if (*end == 'K' || *end == 'k') {
+                block_size *= 1024;
+                end++;
+            } else if (*end == 'M' || *end == 'm') {
+                block_size *= 1024 * 1024;
+                end++;
+            }
+            if (*end != '\0' || block_size < 1024 || block_size > (1L << 30)) {
+                log_error("encoder", "invalid_block_size value=%s", argv[a] + 13);
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (strncmp(argv[a], "--threads=", 10) == 0) {
+            char* end = NULL;
+            long n = strtol(argv[a] + 10, &end, 10);
+            if (end == argv[a] + 10 || *end != '\0' || n < 0 || n > MAX_THREADS) {
+                log_error("encoder", "invalid_threads value=%s", argv[a] + 10);
+                print_usage(argv[0]);
+                return 1;
+            }
+            threads = (int)n;
+        } else if (strncmp(argv[a], "--sync-interval=", 16) == 0) {
+            char* end = NULL;
+            sync_interval = strtol(argv[a] + 16, &end, 10);
+            if (end == argv[a] + 16 || *end != '\0' || sync_interval < 1) {
+                log_error("encoder", "invalid_sync_interval value=%s", argv[a] + 16);
+                print_usage(argv[0]);
+                return 1;
+            }
+            container = 1;   // sync index 放在 container 裡
+            canonical = 1;
+        } else if (strncmp(argv[a], "--streams=", 10) == 0) {
+            char* end = NULL;
+            long n = strtol(argv[a] + 10, &end, 10);
+            if (end == argv[a] + 10 || *end != '\0' || n < 2 ||
+                n > HUFF_CT_MAX_STREAMS) {
+                log_error("encoder", "invalid_streams value=%s", argv[a] + 10);
+                print_usage(argv[0]);
+                return 1;
+            }
+            streams   = (int)n;
+            container = 1;   // jump table 放在 container payload 開頭
+            canonical = 1;
+        } else if (strcmp(argv[a], "--container") == 0) {
+            container = 1;
+            canonical = 1;   // header 只存長度
+        } else if (strncmp(argv[a], "--manifest=", 11) == 0) {
+            manifest_fn = argv[a] + 11;
+        } else if (strcmp(argv[a], "-j") == 0 || strncmp(argv[a], "--jobs=", 7) == 0) {
+            const char* v = (argv[a][1] == 'j') ? (a + 1 < argc ? argv[++a] : "")
+                                                : argv[a] + 7;
+            char* end = NULL;
+            long n = strtol(v, &end, 10);
+            if (end == v || *end != '\0' || n < 0 || n > MAX_THREADS) {
+                log_error("encoder", "invalid_jobs value=%s", v);
+                print_usage(argv[0]);
+                return 1;
+            }
+            num_jobs = (int)n;
+        } else if (strncmp(argv[a], "--", 2) == 0) {
+            log_error("encoder", "unknown_option option=%s", argv[a]);
+            print_usage(argv[0]);
+            return 1;
+        } else {
+            // 位置參數往前搬到 argv[1..num_args]（永遠不會蓋到還沒看過的參數）
+            argv[++num_args] = argv[a];
+        }
+    }
+
+    if (num_args % 3 != 0 || (num_args == 0 && !manifest_fn)) {
+        log_error("encoder", "invalid_arguments argc=%d", argc);
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // 要編碼的檔案：先是命令列上的每三個一組，再接 manifest 的每一行
+    HuffManifest jobs;
+    huff_manifest_init(&jobs);
+    for (int a = 1; a < num_args; a += 3) {
+        if (huff_manifest_add(&jobs, argv[a], argv[a + 1], argv[a + 2]) != 0) {
+            log_error("encoder", "memory_allocation_failed what=manifest");
+            huff_manifest_free(&jobs);
+            return 1;
+        }
+    }
+    if (manifest_fn) {
+        FILE* fm = strcmp(manifest_fn, "-") == 0 ? stdin : fopen(manifest_fn, "r");
+        if (!fm) {
+            log_error("encoder", "cannot_open_manifest file=%s", manifest_fn);
+            huff_manifest_free(&jobs);
+            return 1;
+        }
+        long bad = huff_manifest_read(&jobs, fm);
+        if (fm != stdin) fclose(fm);
+        if (bad != 0) {
+            if (bad > 0) {
+                log_error("encoder", "invalid_manifest file=%s line=%ld reason=expected_3_paths",
+                          manifest_fn, bad);
+            } else {
+                log_error("encoder", "cannot_read_manifest file=%s", manifest_fn);
+            }
+            huff_manifest_free(&jobs);
+            return 1;
+        }
+    }
+    int batch = manifest_fn != NULL || jobs.count > 1;
+
+    const char* conflict = NULL;
+    if (container && block_size > 0) {
+        conflict = "--container,--block-size";
+    } else if (streams > 0 && sync_interval > 0) {
+        // sync index 的 bit offset 只對單一 stream 有意義
+        conflict = "--streams,--sync-interval";
+    } else if (batch && export_csv_fn) {
+        // 每個檔案都會寫到同一個路徑
+        conflict = "--export-csv,batch";
+    }
+    if (conflict) {
+        log_error("encoder", "conflicting_options options=%s", conflict);
+        print_usage(argv[0]);
+        huff_manifest_free(&jobs);
+        return 1;
+    }
+    for (long k = 0; k < jobs.count; k++) {
+        if (strcmp(jobs.paths[3 * k + 1], "-") == 0 && !container && block_size == 0) {
+            log_error("encoder", "codebook_required reason=not_self_contained");
+            print_usage(argv[0]);
+            huff_manifest_free(&jobs);
+            return 1;
+        }
+    }
+
+    EncOptions opt;
+    opt.use_mmap      = use_mmap;
+    opt.canonical     = canonical;
+    opt.max_code_len  = max_code_len;
+    opt.cb_binary     = cb_binary;
+    opt.cb_counts     = cb_counts;
+    opt.export_csv_fn = export_csv_fn;
+    opt.container     = container;
+    opt.block_size    = block_size;
+    opt.threads       = threads;
+    opt.sync_interval = sync_interval;
+    opt.streams       = streams;
+
+    // 所有平行工作共用一個 pool：單檔是 --threads 個 worker（第一次要分工
+    // 時才建立），批次是 -j 個（--threads 比較大時取 --threads）
+    EncPool pool = {NULL, 0, 0};
+    int pool_threads = threads ? threads : huff_detect_threads();
+    if (batch) {
+        // 檔案之間已經平行了；沒指定 --threads 時每個檔案只用一個執行緒
+        if (threads == 0) opt.threads = 1;
+        pool_threads = num_jobs ? num_jobs : huff_detect_threads();
+        if (pool_threads > jobs.count) pool_threads = (int)jobs.count;
+        if (pool_threads < opt.threads) pool_threads = opt.threads;
+    }
+    if (batch) pool.pool    = huff_pool_new(pool_threads, POOL_QUEUE_CAP);
+    else       pool.threads = pool_threads;
+    opt.pool = &pool;
+
+    int rc;
+    if (batch) {
+        rc = encode_batch(&opt, &jobs);
+    } else {
+        EncScratch* ws = (EncScratch*)malloc(sizeof(EncScratch));
+        EncResult   res;
+        if (!ws) {
+            log_error("encoder", "memory_allocation_failed what=scratch");
+            huff_manifest_free(&jobs);
+            return 1;
+        }
+        rc = encode_file(&opt, ws, jobs.paths[0], jobs.paths[1], jobs.paths[2], &res);
+        free(ws);
+    }
+    huff_pool_free(pool.pool);
+    huff_manifest_free(&jobs);
+    return rc;
+}
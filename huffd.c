@@ -0,0 +1,1040 @@
+/*
+ * ============================================================================
+ * 標頭檔引入說明
+ * ============================================================================
+ */
+
+#define _GNU_SOURCE      // F_GET_SEALS / F_SEAL_SHRINK
+
+#include <stdio.h>       // fprintf(), snprintf()
+#include <stdint.h>      // uint64_t：協定裡的 64-bit 欄位
+#include <stdlib.h>      // malloc(), free(), strtol()
+#include <string.h>      // memcpy(), memset(), strcmp()
+#include <time.h>        // clock_gettime(): 量測每個 request 的延遲
+#include <errno.h>       // EINTR
+#include <fcntl.h>       // open(), fcntl(F_GET_SEALS)
+#include <limits.h>      // PIPE_BUF
+#include <poll.h>        // poll(): 等連線 / request 時定期檢查是否該結束
+#include <signal.h>      // SIGINT / SIGTERM 結束 daemon，忽略 SIGPIPE
+#include <unistd.h>      // read(), write(), close(), unlink()
+#include <pthread.h>     // worker 執行緒
+#include <sys/mman.h>    // mmap(): 直接映射 client 傳來、封住不能縮小的 memfd
+#include <sys/socket.h>  // Unix domain socket、SCM_RIGHTS 傳遞 fd
+#include <sys/stat.h>    // fstat(), umask()
+#include <sys/un.h>      // struct sockaddr_un
+
+#include "logger.h"      // 自訂 logger 函式庫
+#include "libhuff.h"     // 記憶體對記憶體的編碼／解碼（HuffCtx）
+
+/*
+ * ============================================================================
+ * huffd：常駐的本機編碼／解碼服務
+ * ============================================================================
+ *
+ * 【程式目的】
+ * 其他語言寫的服務（Python、Go …）不必每次 fork encoder / decoder，
+ * 連上 Unix domain socket 送 request 即可。資料本身不經過 socket：
+ * client 用 SCM_RIGHTS 把輸入與輸出的 fd 一起傳過來（一般檔案，或
+ * memfd_create 建的共享記憶體），daemon 讀輸入、把結果寫進輸出 fd，
+ * socket 上只有固定 24 bytes 的 request / reply。輸入是加了
+ * F_SEAL_SHRINK 的 memfd 時直接 mmap，不必複製；其他檔案 client 隨時
+ * 可能截短，映射起來讀到被截掉的部分會 SIGBUS 讓整個 daemon 結束，
+ * 所以一律先讀進 worker 的緩衝區。
+ * 每個 worker 整個生命週期沿用同一個 HuffCtx 與緩衝區，解碼表依 code
+ * 長度快取，連續解同一份 codebook 的資料不必重建。只 listen 本機的
+ * socket 檔（權限 0600），不開任何網路連線。
+ *
+ * 【用法】
+ * ./huffd [--socket=path] [--workers=N]              啟動 daemon（前景執行）
+ * ./huffd [--socket=path] [--max-code-len=N] encode in_fn out_fn
+ * ./huffd [--socket=path] decode in_fn out_fn
+ * ./huffd [--socket=path] stats                      印出延遲統計
+ * ./huffd [--socket=path] shutdown                   讓 daemon 結束
+ *
+ * --socket=path : socket 檔的路徑，預設 huffd.sock（目前目錄）
+ * --workers=N   : 同時處理的 request 數；0（預設）表示依 CPU 核心數
+ * in_fn / out_fn 可以給 "-" 表示 stdin / stdout（pipe 時 daemon 改用
+ * read / write）
+ *
+ * 【協定】（所有整數皆為 little-endian，一個連線上可以連續送多個 request）
+ * request，24 bytes：
+ *   offset  size  內容
+ *   0       4     magic "HFDQ"
+ *   4       1     op：1 = encode，2 = decode，3 = stats，4 = shutdown
+ *   5       3     保留，寫 0
+ *   8       8     arg：encode 的 max_code_len（0 = 不限制），其他 op 寫 0
+ *   16      8     保留，寫 0
+ *   encode / decode 的 request 以 SCM_RIGHTS 附上兩個 fd：[輸入, 輸出]。
+ *   輸入是 fd 的整個檔案（從 offset 0 起）；輸出若是一般檔案（含 memfd），
+ *   daemon 會把它截成結果的大小並從 offset 0 寫入。
+ * reply，24 bytes：
+ *   0       4     magic "HFDR"
+ *   4       4     status：0 = 成功，負值為 libhuff.h 的 HUFF_ERR_*，
+ *                 或下面的 HUFFD_ERR_*
+ *   8       8     encode / decode：寫進輸出 fd 的 bytes；stats：後面文字的長度
+ *   16      8     daemon 處理這個 request 花的時間（ns）
+ *   stats 的 reply 後面接著一行 "key=value ..." 的文字。
+ * 一條連線上同時只處理一個 request（reply 送出後才讀下一個）。連線閒置
+ * 超過 60 秒，或一則 request 送了一半、5 秒內沒送齊，daemon 就關掉它。
+ * 輸入或輸出是 pipe 這類 fd 時，5 秒讀不到資料／寫不進去就回 timeout
+ * 錯誤；daemon 結束時進行中的 pipe 讀寫也會中斷，回 stopped 錯誤。
+ * encode 的輸出是 encoder --container 格式的 container（與 huff_encode
+ * 相同），decode 只接受單一 stream 的 container。
+ *
+ * 【編譯】
+ * gcc -O2 -o huffd huffd.c libhuff.c huffman.c logger.c -lm -lpthread
+ *
+ * 【執行範例】
+ * ./huffd --socket=/run/user/1000/huffd.sock > huffd.log 2>&1 &
+ * ./huffd --socket=/run/user/1000/huffd.sock encode input.txt encoded.huf
+ *
+ * ============================================================================
+ */
+
+#define HUFFD_MSG_SIZE   24
+#define HUFFD_REQ_MAGIC  "HFDQ"
+#define HUFFD_REP_MAGIC  "HFDR"
+
+#define HUFFD_OP_ENCODE   1
+#define HUFFD_OP_DECODE   2
+#define HUFFD_OP_STATS    3
+#define HUFFD_OP_SHUTDOWN 4
+
+#define HUFFD_ERR_IO      (-16)   /* 讀寫 client 傳來的 fd 失敗 */
+#define HUFFD_ERR_BAD_FD  (-17)   /* 沒有附上正好兩個 fd */
+#define HUFFD_ERR_OP      (-18)   /* 不認得的 op 或 magic */
+#define HUFFD_ERR_TIMEOUT (-19)   /* pipe 等輸入／輸出太久沒有進展 */
+#define HUFFD_ERR_STOPPED (-20)   /* daemon 正在結束，request 沒做完 */
+
+#define MAX_WORKERS   HUFF_POOL_MAX_THREADS
+#define MAX_CONNS     1024       // 同時開著的連線數上限，滿了先不 accept
+#define POLL_MS       200        // 等待時每隔多久檢查一次是否該結束
+#define CONN_IDLE_MS    60000    // 連線上多久沒有 request 就關掉
+#define CONN_PARTIAL_MS 5000     // 一則 request 送了一半，多久沒送齊就關掉連線
+#define CONN_SEND_MS    5000     // reply 寫不進 socket（或結果寫不進 pipe）時最多等多久
+#define LAT_BUCKETS   48         // 延遲分桶：第 k 桶是 [2^k, 2^(k+1)) ns
+
+static void put_le32(unsigned char* p, uint32_t v) {
+    for (int k = 0; k < 4; k++) p[k] = (unsigned char)(v >> (8 * k));
+}
+
+static void put_le64(unsigned char* p, uint64_t v) {
+    for (int k = 0; k < 8; k++) p[k] = (unsigned char)(v >> (8 * k));
+}
+
+static uint64_t get_le64(const unsigned char* p) {
+    uint64_t v = 0;
+    for (int k = 7; k >= 0; k--) v = (v << 8) | p[k];
+    return v;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// 把 n bytes 全部從 fd 的 offset 0 開始寫（處理部分寫入與 EINTR，不動
+// fd 的位置），失敗回傳 -1
+static int pwrite_all(int fd, const unsigned char* p, size_t n) {
+    off_t off = 0;
+    while (n > 0) {
+        ssize_t w = pwrite(fd, p, n, off);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p   += w;
+        n   -= (size_t)w;
+        off += w;
+    }
+    return 0;
+}
+
+/* ------------------------------ socket 訊息 -------------------------------- */
+
+// daemon 的連線是非阻塞的：暫時寫不進去時最多等 CONN_SEND_MS，可以再寫回傳 0
+static int wait_writable(int sock) {
+    struct pollfd pfd = {sock, POLLOUT, 0};
+    int pr;
+    do {
+        pr = poll(&pfd, 1, CONN_SEND_MS);
+    } while (pr < 0 && errno == EINTR);
+    return pr > 0 ? 0 : -1;
+}
+
+/*
+ * 送出一則 HUFFD_MSG_SIZE bytes 的訊息（後面可以再接 extra_len bytes），
+ * nfds > 0 時以 SCM_RIGHTS 附上 fds。失敗回傳 -1
+ */
+static int msg_send(int sock, const unsigned char* msg, const char* extra, size_t extra_len,
+                    const int* fds, int nfds) {
+    struct iovec iov[2];
+    iov[0].iov_base = (void*)msg;
+    iov[0].iov_len  = HUFFD_MSG_SIZE;
+    iov[1].iov_base = (void*)extra;
+    iov[1].iov_len  = extra_len;
+
+    union {
+        struct cmsghdr align;
+        char           buf[CMSG_SPACE(2 * sizeof(int))];
+    } ctl;
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov    = iov;
+    mh.msg_iovlen = extra_len > 0 ? 2 : 1;
+    if (nfds > 0) {
+        memset(&ctl, 0, sizeof(ctl));
+        mh.msg_control    = ctl.buf;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * (size_t)nfds);
+        struct cmsghdr* c = CMSG_FIRSTHDR(&mh);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type  = SCM_RIGHTS;
+        c->cmsg_len   = CMSG_LEN(sizeof(int) * (size_t)nfds);
+        memcpy(CMSG_DATA(c), fds, sizeof(int) * (size_t)nfds);
+    }
+
+    size_t total = HUFFD_MSG_SIZE + extra_len;
+    ssize_t w;
+    do {
+        w = sendmsg(sock, &mh, MSG_NOSIGNAL);
+    } while (w < 0 && (errno == EINTR ||
+                       (errno == EAGAIN && wait_writable(sock) == 0)));
+    if (w < 0) return -1;
+    if ((size_t)w == total) return 0;
+
+    // 沒一次送完：fd 已經跟著第一段送出去了，剩下的直接寫
+    unsigned char* all = (unsigned char*)malloc(total);
+    if (!all) return -1;
+    memcpy(all, msg, HUFFD_MSG_SIZE);
+    if (extra_len > 0) memcpy(all + HUFFD_MSG_SIZE, extra, extra_len);
+    int ret = 0;
+    for (size_t off = (size_t)w; off < total; ) {
+        ssize_t n = send(sock, all + off, total - off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN && wait_writable(sock) == 0) continue;
+        if (n <= 0) {
+            ret = -1;
+            break;
+        }
+        off += (size_t)n;
+    }
+    free(all);
+    return ret;
+}
+
+/*
+ * 收一次 recvmsg，接在 msg 已經收到的 *got bytes 後面；附帶的 fd 放進
+ * fds（最多 2 個，多出來的直接關掉），個數累加在 *nfds。回傳這次收到的
+ * bytes，0 = 對方關閉連線，-1 = 錯誤（非阻塞 socket 沒資料時 errno 是 EAGAIN）
+ */
+static ssize_t msg_recv_part(int sock, unsigned char* msg, size_t* got, int* fds, int* nfds) {
+    union {
+        struct cmsghdr align;
+        char           buf[CMSG_SPACE(8 * sizeof(int))];
+    } ctl;
+    struct iovec  iov;
+    struct msghdr mh;
+    ssize_t       n;
+
+    iov.iov_base = msg + *got;
+    iov.iov_len  = HUFFD_MSG_SIZE - *got;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov        = &iov;
+    mh.msg_iovlen     = 1;
+    mh.msg_control    = ctl.buf;
+    mh.msg_controllen = sizeof(ctl.buf);
+
+    do {
+        n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) return n;
+    *got += (size_t)n;
+
+    for (struct cmsghdr* c = CMSG_FIRSTHDR(&mh); c; c = CMSG_NXTHDR(&mh, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+        int cnt = (int)((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        for (int k = 0; k < cnt; k++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(c) + sizeof(int) * (size_t)k, sizeof(int));
+            if (*nfds < 2) fds[(*nfds)++] = fd;
+            else close(fd);
+        }
+    }
+    return n;
+}
+
+/*
+ * 收一則完整的訊息（阻塞，client 用）。回傳 1 = 收到，0 = 對方關閉連線，
+ * -1 = 錯誤或訊息不完整
+ */
+static int msg_recv(int sock, unsigned char* msg, int* fds, int* nfds) {
+    size_t got = 0;
+
+    *nfds = 0;
+    while (got < HUFFD_MSG_SIZE) {
+        ssize_t n = msg_recv_part(sock, msg, &got, fds, nfds);
+        if (n <= 0) {
+            for (int k = 0; k < *nfds; k++) close(fds[k]);
+            *nfds = 0;
+            return (n == 0 && got == 0) ? 0 : -1;
+        }
+    }
+    return 1;
+}
+
+/* ------------------------------ 延遲統計 ----------------------------------- */
+
+/*
+ * 每種 op 各一份：次數、失敗數、bytes、總延遲與最大延遲，以及 2 的次方
+ * 分桶的延遲分布（百分位數取所在分桶的上界，是近似值）。
+ */
+typedef struct OpStats {
+    long     requests;
+    long     errors;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    long     buckets[LAT_BUCKETS];
+} OpStats;
+
+static void op_stats_add(OpStats* s, uint64_t ns, int ok, uint64_t in, uint64_t out) {
+    int b = 0;
+    while (b + 1 < LAT_BUCKETS && (ns >> (b + 1)) != 0) b++;
+    s->requests++;
+    if (!ok) s->errors++;
+    s->bytes_in  += in;
+    s->bytes_out += out;
+    s->total_ns  += ns;
+    if (ns > s->max_ns) s->max_ns = ns;
+    s->buckets[b]++;
+}
+
+// 第 p 百分位（0~100）延遲的近似值（ns）
+static uint64_t op_stats_percentile(const OpStats* s, double p) {
+    if (s->requests == 0) return 0;
+    long want = (long)((double)s->requests * p / 100.0 + 0.999999);
+    if (want < 1) want = 1;
+    long seen = 0;
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+        seen += s->buckets[b];
+        if (seen >= want) {
+            uint64_t upper = ((uint64_t)2 << b) - 1;
+            return upper < s->max_ns ? upper : s->max_ns;
+        }
+    }
+    return s->max_ns;
+}
+
+/* ------------------------------- daemon ------------------------------------ */
+
+/*
+ * worker 領的是 request 而不是連線：主執行緒用 poll 看著 listen socket 與
+ * 所有閒著的連線（都是非阻塞的），收齊一則 request 就把那條連線放進
+ * 佇列交給 worker，worker 送完 reply 再把連線還給主執行緒繼續看。
+ * 閒置或只送了半則 request 的 client 只佔一個 Conn，不會卡住 worker，
+ * 逾時就被關掉；結束時也不必等它們。
+ */
+typedef struct Conn {
+    int           fd;
+    unsigned char msg[HUFFD_MSG_SIZE];   // 收到一半的 request
+    size_t        got;
+    int           fds[2];                // request 附帶的 fd
+    int           nfds;
+    uint64_t      last_ns;               // 上次收到資料或送出 reply 的時間
+    int           busy;                  // request 在 worker 手上（受 lock 保護）
+    int           dead;                  // 要關掉這條連線（受 lock 保護）
+} Conn;
+
+typedef struct Server {
+    int             listen_fd;
+    int             wake[2];        // worker 還回連線或要結束時寫一個 byte，叫醒主執行緒
+    int             stopping;       // 收到 signal 或 shutdown request 後設為 1（受 lock 保護）
+    pthread_mutex_t lock;           // 保護 request 佇列、Conn 的 busy / dead 與統計
+    pthread_cond_t  cond;
+    Conn*           queue[MAX_CONNS];   // 收齊、等 worker 處理的 request（每條連線最多一個）
+    int             q_head;
+    int             q_len;
+    long            connections;    // 累計的連線數
+    OpStats         stats[HUFFD_OP_SHUTDOWN + 1];   // 依 op 編號
+    uint64_t        start_ns;
+    int             workers;
+} Server;
+
+static volatile sig_atomic_t g_stop = 0;   // 只有 signal handler 寫、主執行緒讀
+
+static void on_signal(int sig) {
+    (void)sig;
+    g_stop = 1;
+}
+
+static void server_wake(Server* srv) {
+    ssize_t n = write(srv->wake[1], "", 1);   // pipe 滿了也沒關係：主執行緒本來就會醒
+    (void)n;
+}
+
+static void server_stop(Server* srv) {
+    pthread_mutex_lock(&srv->lock);
+    srv->stopping = 1;
+    pthread_cond_broadcast(&srv->cond);
+    pthread_mutex_unlock(&srv->lock);
+    server_wake(srv);
+}
+
+static int server_stopping(Server* srv) {
+    pthread_mutex_lock(&srv->lock);
+    int stopping = srv->stopping;
+    pthread_mutex_unlock(&srv->lock);
+    return stopping;
+}
+
+/*
+ * client 傳來的 pipe、char device 等不是一般檔案的 fd 可能永遠等不到資料
+ * （例如 `sleep 20 | huffd encode - out`），所以和 socket 一樣不直接阻塞：
+ * 先 poll 等它可以讀／寫，最多等 limit_ms 沒有進展就放棄，每 POLL_MS
+ * 檢查一次 daemon 是否要結束。可以讀寫（或對方已關閉，留給 read / write
+ * 回報）回傳 0，否則回傳負的錯誤碼
+ */
+static long wait_fd(Server* srv, int fd, short events, int limit_ms) {
+    struct pollfd pfd = {fd, events, 0};
+    uint64_t deadline = now_ns() + (uint64_t)limit_ms * 1000000u;
+
+    while (1) {
+        if (server_stopping(srv)) return HUFFD_ERR_STOPPED;
+        uint64_t now = now_ns();
+        if (now >= deadline) return HUFFD_ERR_TIMEOUT;
+        uint64_t left = (deadline - now + 999999u) / 1000000u;
+        int pr = poll(&pfd, 1, left < POLL_MS ? (int)left : POLL_MS);
+        if (pr > 0) return 0;
+        if (pr < 0 && errno != EINTR) return HUFFD_ERR_IO;
+    }
+}
+
+// 把 n bytes 寫進不是一般檔案的 fd：每次等到可以寫才寫最多 PIPE_BUF bytes，
+// pipe 有空位時這樣的 write 不會阻塞。成功回傳 0，否則回傳負的錯誤碼
+static long write_stream(Server* srv, int fd, const unsigned char* p, size_t n) {
+    while (n > 0) {
+        long r = wait_fd(srv, fd, POLLOUT, CONN_SEND_MS);
+        if (r != 0) return r;
+        ssize_t w = write(fd, p, n < PIPE_BUF ? n : PIPE_BUF);
+        if (w < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            return HUFFD_ERR_IO;
+        }
+        p += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+// 每個 worker 自己的狀態：整個 daemon 生命週期重複使用
+typedef struct Worker {
+    pthread_t      tid;
+    Server*        srv;
+    HuffCtx*       ctx;        // 頻率表、code table、上一份 codebook 的解碼表
+    unsigned char* in_buf;     // 輸入不是封住的 memfd 時讀進這裡
+    size_t         in_cap;
+    unsigned char* out_buf;    // 結果先寫到這裡
+    size_t         out_cap;
+} Worker;
+
+// 確保 *buf 至少有 n bytes（只會變大），失敗回傳 -1
+static int buf_reserve(unsigned char** buf, size_t* cap, size_t n) {
+    if (n <= *cap) return 0;
+    size_t ncap = *cap ? *cap : 1 << 16;
+    while (ncap < n) ncap *= 2;
+    unsigned char* nb = (unsigned char*)realloc(*buf, ncap);
+    if (!nb) return -1;
+    *buf = nb;
+    *cap = ncap;
+    return 0;
+}
+
+/*
+ * 把 in_fd 的整個內容讀進 worker 的緩衝區：一般檔案從 offset 0 用 pread
+ * 讀到檔尾（讀的途中被截短只是讀到比較少），pipe 等先 wait_fd 再 read，
+ * 每次最多等 CONN_PARTIAL_MS。成功回傳 0，失敗回傳負的錯誤碼
+ */
+static long read_input(Worker* w, int fd, int regular, size_t hint, size_t* len) {
+    *len = 0;
+    if (buf_reserve(&w->in_buf, &w->in_cap, hint + 1) != 0) return HUFF_ERR_NOMEM;
+    while (1) {
+        if (buf_reserve(&w->in_buf, &w->in_cap, *len + 1) != 0) return HUFF_ERR_NOMEM;
+        if (!regular) {
+            long r = wait_fd(w->srv, fd, POLLIN, CONN_PARTIAL_MS);
+            if (r != 0) return r;
+        }
+        ssize_t n = regular ? pread(fd, w->in_buf + *len, w->in_cap - *len, (off_t)*len)
+                            : read(fd, w->in_buf + *len, w->in_cap - *len);
+        if (n < 0 && (errno == EINTR || (!regular && errno == EAGAIN))) continue;
+        if (n < 0) return HUFFD_ERR_IO;
+        if (n == 0) return 0;
+        *len += (size_t)n;
+    }
+}
+
+// fd 是不能再縮小的 memfd（F_SEAL_SHRINK）：映射它不會因為被截短而 SIGBUS
+static int input_sealed(int fd) {
+    int seals = fcntl(fd, F_GET_SEALS);
+    return seals >= 0 && (seals & F_SEAL_SHRINK);
+}
+
+/*
+ * 執行一個 encode / decode：in_fd 的整個內容 → out_fd。
+ * 封住不能縮小的 memfd 直接 mmap，其他輸入讀進 worker 的緩衝區；結果先
+ * 寫到 worker 的緩衝區，輸出是一般檔案時截成結果的大小再從 offset 0
+ * pwrite（輸出檔同樣可能被 client 截短，所以也不 mmap），pipe 則
+ * write_stream。
+ * 回傳寫出的 bytes，失敗回傳負的錯誤碼
+ */
+static long run_codec(Worker* w, int op, int max_len, int in_fd, int out_fd,
+                      uint64_t* in_bytes) {
+    struct stat st;
+    const unsigned char* src = NULL;
+    size_t len    = 0;
+    int    in_map = 0;
+    long   ret;
+
+    if (fstat(in_fd, &st) != 0) return HUFFD_ERR_IO;
+    int in_reg = S_ISREG(st.st_mode);
+    if (in_reg && st.st_size > 0 && input_sealed(in_fd)) {
+        len = (size_t)st.st_size;
+        void* p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, in_fd, 0);
+        if (p == MAP_FAILED) return HUFFD_ERR_IO;
+        src    = (const unsigned char*)p;
+        in_map = 1;
+    } else {
+        ret = read_input(w, in_fd, in_reg, in_reg ? (size_t)st.st_size : 0, &len);
+        if (ret != 0) return ret;
+        src = w->in_buf;
+    }
+    *in_bytes = len;
+
+    // 輸出大小的上限：Huffman code 的平均長度不超過 8 bits（不會比固定
+    // 長度的 code 差），所以 container 最多是 header 加上原始大小；
+    // 解碼的大小寫在 header 裡，每個 symbol 至少 1 bit
+    size_t bound;
+    if (op == HUFFD_OP_ENCODE) {
+        ret = huff_ctx_set_max_code_len(w->ctx, max_len);
+        bound = (size_t)HUFF_CT_HEADER_SIZE + len;
+    } else {
+        ret = huff_decoded_size(src, len);
+        if (ret >= 0 && (uint64_t)ret > (uint64_t)(len - HUFF_CT_HEADER_SIZE) * 8) {
+            ret = HUFF_ERR_CORRUPT;
+        }
+        bound = ret >= 0 ? (size_t)ret : 0;
+    }
+
+    unsigned char* dst = NULL;
+    if (ret >= 0) {
+        if (buf_reserve(&w->out_buf, &w->out_cap, bound + 1) != 0) ret = HUFF_ERR_NOMEM;
+        dst = w->out_buf;
+    }
+    if (ret >= 0) {
+        if (op == HUFFD_OP_ENCODE) ret = huff_encode(w->ctx, src, len, dst, bound);
+        else                       ret = huff_decode(w->ctx, src, len, dst, bound);
+        if (ret > (long)bound) ret = HUFF_ERR_DST_SMALL;   // 上限算錯時不要寫出界
+    }
+    if (in_map) munmap((void*)src, len);
+
+    if (fstat(out_fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        // 截成結果的大小（失敗時清空），一般檔案一律從 offset 0 寫
+        if (ftruncate(out_fd, ret > 0 ? (off_t)ret : 0) != 0 && ret >= 0) ret = HUFFD_ERR_IO;
+        if (ret > 0 && pwrite_all(out_fd, dst, (size_t)ret) != 0) ret = HUFFD_ERR_IO;
+    } else if (ret > 0) {
+        long r = write_stream(w->srv, out_fd, dst, (size_t)ret);
+        if (r != 0) ret = r;
+    }
+    return ret;
+}
+
+// 統計的文字版本（stats reply 與結束時的 log 共用），回傳長度
+static int stats_format(Server* srv, char* buf, size_t cap) {
+    static const char* names[] = {NULL, "encode", "decode", "stats", "shutdown"};
+    int n = snprintf(buf, cap, "uptime_sec=%.3f workers=%d connections=%ld",
+                     (double)(now_ns() - srv->start_ns) / 1e9, srv->workers,
+                     srv->connections);
+    for (int op = HUFFD_OP_ENCODE; op <= HUFFD_OP_DECODE; op++) {
+        const OpStats* s = &srv->stats[op];
+        if (n < 0 || (size_t)n >= cap) break;
+        n += snprintf(buf + n, cap - (size_t)n,
+                      " %s_requests=%ld %s_errors=%ld %s_bytes_in=%llu %s_bytes_out=%llu"
+                      " %s_avg_us=%.3f %s_p50_us=%.3f %s_p99_us=%.3f %s_max_us=%.3f",
+                      names[op], s->requests, names[op], s->errors,
+                      names[op], (unsigned long long)s->bytes_in,
+                      names[op], (unsigned long long)s->bytes_out,
+                      names[op], s->requests ? (double)s->total_ns / s->requests / 1e3 : 0.0,
+                      names[op], (double)op_stats_percentile(s, 50.0) / 1e3,
+                      names[op], (double)op_stats_percentile(s, 99.0) / 1e3,
+                      names[op], (double)s->max_ns / 1e3);
+    }
+    return (n < 0) ? 0 : ((size_t)n >= cap ? (int)cap - 1 : n);
+}
+
+// 處理 c 上收齊的一則 request 並送出 reply；reply 送不出去回傳 -1
+static int handle_request(Worker* w, Conn* c) {
+    Server*        srv = w->srv;
+    unsigned char* msg = c->msg;
+    uint64_t t0     = now_ns();
+    int      op     = msg[4];
+    long     status = 0;
+    uint64_t value  = 0, in_bytes = 0;
+    char     text[2048];
+    int      text_len = 0;
+
+    if (memcmp(msg, HUFFD_REQ_MAGIC, 4) != 0 || op < HUFFD_OP_ENCODE ||
+        op > HUFFD_OP_SHUTDOWN) {
+        status = HUFFD_ERR_OP;
+        op     = 0;
+    } else if (op == HUFFD_OP_ENCODE || op == HUFFD_OP_DECODE) {
+        uint64_t arg = get_le64(msg + 8);
+        if (c->nfds != 2) {
+            status = HUFFD_ERR_BAD_FD;
+        } else if (op == HUFFD_OP_ENCODE && arg > HUFF_MAX_TABLE_CODE_LEN) {
+            status = HUFF_ERR_ARG;
+        } else {
+            long r = run_codec(w, op, (int)arg, c->fds[0], c->fds[1], &in_bytes);
+            if (r < 0) status = r;
+            else       value  = (uint64_t)r;
+        }
+    } else if (op == HUFFD_OP_STATS) {
+        pthread_mutex_lock(&srv->lock);
+        text_len = stats_format(srv, text, sizeof(text));
+        pthread_mutex_unlock(&srv->lock);
+        value = (uint64_t)text_len;
+    } else {
+        log_info("huffd", "shutdown_request");
+        server_stop(srv);
+    }
+    for (int k = 0; k < c->nfds; k++) close(c->fds[k]);
+    c->nfds = 0;
+    c->got  = 0;
+
+    uint64_t ns = now_ns() - t0;
+    if (op != 0) {
+        pthread_mutex_lock(&srv->lock);
+        op_stats_add(&srv->stats[op], ns, status == 0, in_bytes, value);
+        pthread_mutex_unlock(&srv->lock);
+    }
+
+    unsigned char rep[HUFFD_MSG_SIZE];
+    memcpy(rep, HUFFD_REP_MAGIC, 4);
+    put_le32(rep + 4, (uint32_t)(int32_t)status);
+    put_le64(rep + 8, value);
+    put_le64(rep + 16, ns);
+    return msg_send(c->fd, rep, text, (size_t)text_len, NULL, 0);
+}
+
+static void* worker_main(void* arg) {
+    Worker* w   = (Worker*)arg;
+    Server* srv = w->srv;
+
+    while (1) {
+        pthread_mutex_lock(&srv->lock);
+        while (srv->q_len == 0 && !srv->stopping) pthread_cond_wait(&srv->cond, &srv->lock);
+        if (srv->q_len == 0) {
+            pthread_mutex_unlock(&srv->lock);
+            break;
+        }
+        Conn* c = srv->queue[srv->q_head];
+        srv->q_head = (srv->q_head + 1) % MAX_CONNS;
+        srv->q_len--;
+        pthread_mutex_unlock(&srv->lock);
+
+        int failed = handle_request(w, c) != 0;
+
+        // 把連線還給主執行緒
+        pthread_mutex_lock(&srv->lock);
+        c->busy    = 0;
+        c->dead    = failed;
+        c->last_ns = now_ns();
+        pthread_mutex_unlock(&srv->lock);
+        server_wake(srv);
+    }
+    return NULL;
+}
+
+static void conn_close(Conn* c) {
+    for (int k = 0; k < c->nfds; k++) close(c->fds[k]);
+    close(c->fd);
+    free(c);
+}
+
+// 建立並 listen socket 檔；舊的 socket 檔（上次沒清掉）先刪掉
+static int listen_unix(const char* path) {
+    struct sockaddr_un addr;
+    struct stat st;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) return -1;   // 不要刪掉一般檔案
+        unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, strlen(path) + 1);
+
+    mode_t old = umask(077);   // 只有自己能連：socket 檔權限 0600
+    int rc = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    umask(old);
+    if (rc != 0 || listen(fd, 128) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int run_server(const char* sock_path, int workers) {
+    Server srv;
+    memset(&srv, 0, sizeof(srv));
+    srv.start_ns = now_ns();
+    srv.workers  = workers;
+    pthread_mutex_init(&srv.lock, NULL);
+    pthread_cond_init(&srv.cond, NULL);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);   // client 先斷線時 write 回傳錯誤就好
+
+    if (pipe2(srv.wake, O_NONBLOCK | O_CLOEXEC) != 0) {
+        log_error("huffd", "cannot_create_pipe");
+        log_info("huffd", "finish status=error");
+        return 1;
+    }
+    srv.listen_fd = listen_unix(sock_path);
+    if (srv.listen_fd < 0) {
+        log_error("huffd", "cannot_listen socket=%s", sock_path);
+        log_info("huffd", "finish status=error");
+        close(srv.wake[0]);
+        close(srv.wake[1]);
+        return 1;
+    }
+    log_info("huffd", "start socket=%s workers=%d", sock_path, workers);
+
+    Worker*        ws     = (Worker*)calloc((size_t)workers, sizeof(Worker));
+    Conn**         conns  = (Conn**)malloc(sizeof(Conn*) * MAX_CONNS);
+    Conn**         polled = (Conn**)malloc(sizeof(Conn*) * (MAX_CONNS + 2));
+    struct pollfd* pfds   = (struct pollfd*)malloc(sizeof(struct pollfd) * (MAX_CONNS + 2));
+    int            nconns = 0;
+    if (!ws || !conns || !polled || !pfds) {
+        fprintf(stderr, "huffd: memory allocation failed\n");
+        exit(1);
+    }
+    int started = 0;
+    for (int k = 0; k < workers; k++) {
+        ws[k].srv = &srv;
+        ws[k].ctx = huff_ctx_new();
+        if (!ws[k].ctx || pthread_create(&ws[k].tid, NULL, worker_main, &ws[k]) != 0) {
+            huff_ctx_free(ws[k].ctx);
+            ws[k].ctx = NULL;
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        log_error("huffd", "cannot_start_workers");
+        server_stop(&srv);
+    }
+
+    while (1) {
+        if (g_stop) server_stop(&srv);
+
+        // 關掉該關的連線（對方斷線、reply 送不出去、逾時），其餘不在
+        // worker 手上的連線都放進這一輪的 poll
+        uint64_t now = now_ns();
+        int      np  = 2;
+        pthread_mutex_lock(&srv.lock);
+        int stopping = srv.stopping;
+        for (int k = 0; k < nconns && !stopping; ) {
+            Conn* c = conns[k];
+            if (c->busy) {
+                k++;
+                continue;
+            }
+            uint64_t idle = (now - c->last_ns) / 1000000u;
+            if (!c->dead && c->got > 0 && idle >= CONN_PARTIAL_MS) {
+                log_error("huffd", "drop_connection reason=partial_request_timeout bytes=%zu",
+                          c->got);
+                c->dead = 1;
+            }
+            if (c->dead || (c->got == 0 && idle >= CONN_IDLE_MS)) {
+                conn_close(c);
+                conns[k] = conns[--nconns];
+                continue;
+            }
+            pfds[np].fd     = c->fd;
+            pfds[np].events = POLLIN;
+            polled[np++]    = c;
+            k++;
+        }
+        pthread_mutex_unlock(&srv.lock);
+        if (stopping) break;
+
+        pfds[0].fd     = srv.wake[0];
+        pfds[0].events = POLLIN;
+        pfds[1].fd     = nconns < MAX_CONNS ? srv.listen_fd : -1;   // 滿了連線留在 backlog
+        pfds[1].events = POLLIN;
+        int pr = poll(pfds, (nfds_t)np, POLL_MS);
+        if (pr <= 0) continue;   // 逾時或被 signal 打斷：回到上面檢查
+
+        if (pfds[0].revents & POLLIN) {
+            char drain[64];
+            while (read(srv.wake[0], drain, sizeof(drain)) > 0) {}
+        }
+        if (pfds[1].revents & POLLIN) {
+            int fd = accept4(srv.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            Conn* c = fd >= 0 ? (Conn*)calloc(1, sizeof(Conn)) : NULL;
+            if (c) {
+                c->fd      = fd;
+                c->last_ns = now_ns();
+                conns[nconns++] = c;
+                pthread_mutex_lock(&srv.lock);
+                srv.connections++;
+                pthread_mutex_unlock(&srv.lock);
+            } else if (fd >= 0) {
+                close(fd);
+            }
+        }
+        for (int k = 2; k < np; k++) {
+            if (!pfds[k].revents) continue;
+            Conn*   c = polled[k];
+            ssize_t n = msg_recv_part(c->fd, c->msg, &c->got, c->fds, &c->nfds);
+            if (n < 0 && errno == EAGAIN) continue;
+            pthread_mutex_lock(&srv.lock);
+            if (n <= 0) {
+                // 對方關閉連線或出錯；送了一半的 request 就不管了
+                c->dead = 1;
+            } else if (c->got == HUFFD_MSG_SIZE) {
+                // 收齊了：交給 worker（每條連線最多一則在佇列裡，不會滿）
+                c->busy = 1;
+                srv.queue[(srv.q_head + srv.q_len) % MAX_CONNS] = c;
+                srv.q_len++;
+                pthread_cond_signal(&srv.cond);
+            } else {
+                c->last_ns = now_ns();
+            }
+            pthread_mutex_unlock(&srv.lock);
+        }
+    }
+
+    // 已經收齊的 request 會做完（等在 pipe 上的立刻回 HUFFD_ERR_STOPPED）；
+    // 閒置或只送了一半的連線直接關掉
+    server_stop(&srv);
+    for (int k = 0; k < started; k++) {
+        pthread_join(ws[k].tid, NULL);
+        huff_ctx_free(ws[k].ctx);
+        free(ws[k].in_buf);
+        free(ws[k].out_buf);
+    }
+    free(ws);
+    for (int k = 0; k < nconns; k++) conn_close(conns[k]);
+    free(conns);
+    free(polled);
+    free(pfds);
+    close(srv.listen_fd);
+    close(srv.wake[0]);
+    close(srv.wake[1]);
+    unlink(sock_path);
+
+    char text[2048];
+    stats_format(&srv, text, sizeof(text));
+    log_info("metrics", "summary %s", text);
+    log_info("huffd", "finish status=ok");
+    pthread_cond_destroy(&srv.cond);
+    pthread_mutex_destroy(&srv.lock);
+    return 0;
+}
+
+/* ------------------------------- client ------------------------------------ */
+
+static const char* status_string(long status) {
+    switch (status) {
+    case HUFFD_ERR_IO:      return "cannot read or write the passed file descriptors";
+    case HUFFD_ERR_BAD_FD:  return "request needs exactly two file descriptors";
+    case HUFFD_ERR_OP:      return "unknown request";
+    case HUFFD_ERR_TIMEOUT: return "timed out reading or writing the passed file descriptors";
+    case HUFFD_ERR_STOPPED: return "daemon is shutting down";
+    default:                return huff_strerror(status);
+    }
+}
+
+/* 送一個 request 並等 reply：encode / decode 附上 in_fn、out_fn 的 fd，
+   stats 把回傳的文字印到 stdout。成功回傳 0 */
+static int run_client(const char* sock_path, int op, int max_len,
+                      const char* in_fn, const char* out_fn) {
+    static const char* names[] = {NULL, "encode", "decode", "stats", "shutdown"};
+    struct sockaddr_un addr;
+    int fds[2] = {-1, -1};
+    int nfds   = 0;
+
+    if (op == HUFFD_OP_ENCODE || op == HUFFD_OP_DECODE) {
+        fds[0] = strcmp(in_fn, "-") == 0 ? STDIN_FILENO : open(in_fn, O_RDONLY);
+        if (fds[0] < 0) {
+            log_error("huffd", "cannot_open_input_file file=%s", in_fn);
+            return 1;
+        }
+        // 輸出到 stdout 時 log 改寫 stderr
+        if (strcmp(out_fn, "-") == 0) {
+            fds[1] = STDOUT_FILENO;
+            log_set_info_fp(stderr);
+        } else {
+            fds[1] = open(out_fn, O_RDWR | O_CREAT | O_TRUNC, 0666);
+        }
+        if (fds[1] < 0) {
+            log_error("huffd", "cannot_open_output_file file=%s", out_fn);
+            if (fds[0] != STDIN_FILENO) close(fds[0]);
+            return 1;
+        }
+        nfds = 2;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    int ok = sock >= 0 && strlen(sock_path) < sizeof(addr.sun_path);
+    if (ok) {
+        memcpy(addr.sun_path, sock_path, strlen(sock_path) + 1);
+        ok = connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    }
+    if (!ok) {
+        log_error("huffd", "cannot_connect socket=%s", sock_path);
+        if (sock >= 0) close(sock);
+        if (fds[0] > STDIN_FILENO) close(fds[0]);
+        if (fds[1] > STDOUT_FILENO) close(fds[1]);
+        return 1;
+    }
+
+    unsigned char msg[HUFFD_MSG_SIZE];
+    memset(msg, 0, sizeof(msg));
+    memcpy(msg, HUFFD_REQ_MAGIC, 4);
+    msg[4] = (unsigned char)op;
+    put_le64(msg + 8, (uint64_t)max_len);
+
+    uint64_t t0 = now_ns();
+    int rfds[2];
+    int rn = 0;
+    int rc = msg_send(sock, msg, NULL, 0, fds, nfds) == 0 &&
+             msg_recv(sock, msg, rfds, &rn) == 1 &&
+             memcmp(msg, HUFFD_REP_MAGIC, 4) == 0;
+    uint64_t rtt = now_ns() - t0;
+    for (int k = 0; k < rn; k++) close(rfds[k]);
+    if (fds[0] > STDIN_FILENO) close(fds[0]);
+    if (fds[1] > STDOUT_FILENO) close(fds[1]);
+    if (!rc) {
+        log_error("huffd", "bad_reply socket=%s", sock_path);
+        close(sock);
+        return 1;
+    }
+
+    long     status = (long)(int32_t)(msg[4] | msg[5] << 8 | msg[6] << 16 |
+                                      (uint32_t)msg[7] << 24);
+    uint64_t value  = get_le64(msg + 8);
+    uint64_t ns     = get_le64(msg + 16);
+
+    if (status == 0 && op == HUFFD_OP_STATS) {
+        // reply 後面接著 value bytes 的文字
+        char* text = (char*)malloc(value + 1);
+        size_t got = 0;
+        while (text && got < value) {
+            ssize_t n = recv(sock, text + got, value - got, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            got += (size_t)n;
+        }
+        if (text && got == value) {
+            text[value] = '\0';
+            printf("%s\n", text);
+        } else {
+            status = HUFFD_ERR_IO;
+        }
+        free(text);
+    }
+    close(sock);
+
+    if (status != 0) {
+        log_error("huffd", "request_failed op=%s status=%ld reason=\"%s\"",
+                  names[op], status, status_string(status));
+        return 1;
+    }
+    if (op != HUFFD_OP_STATS) {
+        log_info("huffd", "reply op=%s status=ok output_bytes=%llu server_us=%.3f "
+                 "round_trip_us=%.3f", names[op], (unsigned long long)value,
+                 (double)ns / 1e3, (double)rtt / 1e3);
+    }
+    return 0;
+}
+
+/* ============================================================================
+ * 主程式
+ * ==========================================================================*/
+
+static void print_usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [--socket=path] [--workers=N]\n"
+                    "       %s [--socket=path] [--max-code-len=N] encode|decode in_fn out_fn\n"
+                    "       %s [--socket=path] stats|shutdown\n", prog, prog, prog);
+}
+
+int main(int argc, char **argv) {
+    const char *sock_path = "huffd.sock";   // --socket=path
+    int  workers  = 0;                      // --workers=N，0 表示自動偵測
+    int  max_len  = 0;                      // --max-code-len=N（encode），0 表示不限制
+    const char *args[3];                    // 位置參數：command [in_fn out_fn]
+    int  num_args = 0;
+
+    for (int a = 1; a < argc; a++) {
+        if (strncmp(argv[a], "--socket=", 9) == 0) {
+            sock_path = argv[a] + 9;
+        } else if (strncmp(argv[a], "--workers=", 10) == 0) {
+            char* end = NULL;
+            long n = strtol(argv[a] + 10, &end, 10);
+            if (end == argv[a] + 10 || *end != '\0' || n < 0 || n > MAX_WORKERS) {
+                log_error("huffd", "invalid_workers value=%s", argv[a] + 10);
+                print_usage(argv[0]);
+                return 1;
+            }
+            workers = (int)n;
+        } else if (strncmp(argv[a], "--max-code-len=", 15) == 0) {
+            char* end = NULL;
+            long n = strtol(argv[a] + 15, &end, 10);
+            if (end == argv[a] + 15 || *end != '\0' || n < 1 ||
+                n > HUFF_MAX_TABLE_CODE_LEN) {
+                log_error("huffd", "invalid_max_code_len value=%s", argv[a] + 15);
+                print_usage(argv[0]);
+                return 1;
+            }
+            max_len = (int)n;
+        } else if (strncmp(argv[a], "--", 2) == 0) {
+            log_error("huffd", "unknown_option option=%s", argv[a]);
+            print_usage(argv[0]);
+            return 1;
+        } else {
+            if (num_args < 3) args[num_args] = argv[a];
+            num_args++;
+        }
+    }
+
+    if (num_args == 0) {
+        if (workers == 0) workers = huff_detect_threads();
+        return run_server(sock_path, workers);
+    }
+
+    int op = 0, want_args = 1;
+    if (strcmp(args[0], "encode") == 0)        { op = HUFFD_OP_ENCODE;   want_args = 3; }
+    else if (strcmp(args[0], "decode") == 0)   { op = HUFFD_OP_DECODE;   want_args = 3; }
+    else if (strcmp(args[0], "stats") == 0)    { op = HUFFD_OP_STATS; }
+    else if (strcmp(args[0], "shutdown") == 0) { op = HUFFD_OP_SHUTDOWN; }
+    if (op == 0 || num_args != want_args) {
+        log_error("huffd", "invalid_arguments argc=%d", argc);
+        print_usage(argv[0]);
+        return 1;
+    }
+    return run_client(sock_path, op, max_len,
+                      want_args == 3 ? args[1] : NULL, want_args == 3 ? args[2] : NULL);
+}
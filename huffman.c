@@ -0,0 +1,914 @@
+#include "huffman.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * package-merge（Larmore & Hirschberg）：
+ *   把每個 symbol 看成寬度 2^-l 的「硬幣」，從最深的一層（長度 max_len）
+ *   開始，每層把上一層的項目兩兩打包，再和所有 leaf 依權重合併排序。
+ *   最上層取前 2n-2 個項目，一個 symbol 在所有被選到的層中出現幾次，
+ *   它的 code 長度就是多少。
+ *
+ * 因為每層都是排序後的序列、package 又是由上一層連續兩項組成，
+ * 「在某層取前 k 項」等於「取前 c 個 leaf 與前 k-c 個 package」，
+ * 往下一層就是取前 2(k-c) 項。所以每層只需要記錄每個位置是不是 leaf。
+ */
+int huff_limited_lengths(const long freq[HUFF_NUM_SYMBOLS], int max_len,
+                         int lens[HUFF_NUM_SYMBOLS]) {
+    int  sym[HUFF_NUM_SYMBOLS];     // 依 (freq, symbol) 由小到大排序的 symbol
+    long weight[HUFF_NUM_SYMBOLS];
+    int  n = 0;
+
+    for (int s = 0; s < HUFF_NUM_SYMBOLS; s++) {
+        lens[s] = 0;
+        if (freq[s] <= 0) continue;
+
+        // 插入排序：n 最多 256
+        int k = n++;
+        while (k > 0 && weight[k - 1] > freq[s]) {
+            weight[k] = weight[k - 1];
+            sym[k]    = sym[k - 1];
+            k--;
+        }
+        weight[k] = freq[s];
+        sym[k]    = s;
+    }
+
+    if (n == 0) return 0;
+    if (n == 1) {
+        lens[sym[0]] = 1;
+        return 0;
+    }
+    if (max_len < 1 || (max_len < 9 && (1 << max_len) < n)) return -1;
+    if (max_len > n - 1) max_len = n - 1;   // 再長也用不到
+
+    int   max_items = 2 * n;
+    long *cur       = (long*)malloc(sizeof(long) * (size_t)max_items);
+    long *prev      = (long*)malloc(sizeof(long) * (size_t)max_items);
+    char *is_leaf   = (char*)malloc((size_t)max_len * (size_t)max_items);
+    int  *num_items = (int*)malloc(sizeof(int) * (size_t)max_len);
+    if (!cur || !prev || !is_leaf || !num_items) {
+        free(cur);
+        free(prev);
+        free(is_leaf);
+        free(num_items);
+        return -1;
+    }
+
+    // level 0 = 長度 max_len 那層，level max_len-1 = 長度 1 那層
+    int prev_n = 0;
+    for (int level = 0; level < max_len; level++) {
+        int  num_pkg = prev_n / 2;
+        int  li = 0, pi = 0, k = 0;
+        char *flags = is_leaf + (size_t)level * (size_t)max_items;
+
+        while (li < n || pi < num_pkg) {
+            long pw = (pi < num_pkg) ? prev[2 * pi] + prev[2 * pi + 1] : 0;
+            if (pi >= num_pkg || (li < n && weight[li] <= pw)) {
+                cur[k]   = weight[li++];
+                flags[k] = 1;
+            } else {
+                cur[k]   = pw;
+                flags[k] = 0;
+                pi++;
+            }
+            k++;
+        }
+        num_items[level] = k;
+
+        long *tmp = prev;
+        prev   = cur;
+        cur    = tmp;
+        prev_n = k;
+    }
+
+    // 從最上層往下，統計每個 symbol 被選中的次數
+    int take = 2 * n - 2;
+    for (int level = max_len - 1; level >= 0 && take > 0; level--) {
+        const char *flags = is_leaf + (size_t)level * (size_t)max_items;
+        int leaves = 0;
+        if (take > num_items[level]) take = num_items[level];
+        for (int k = 0; k < take; k++) leaves += flags[k];
+        for (int k = 0; k < leaves; k++) lens[sym[k]]++;
+        take = 2 * (take - leaves);
+    }
+
+    free(cur);
+    free(prev);
+    free(is_leaf);
+    free(num_items);
+    return 0;
+}
+
+/*
+ * key = freq << 8 | symbol，排序一次就同時決定兩層順序；最多 256 個，
+ * 直接插入排序，不需要 qsort 的暫存空間。
+ */
+int huff_sort_symbols(const long freq[HUFF_NUM_SYMBOLS], int syms[HUFF_NUM_SYMBOLS]) {
+    uint64_t key[HUFF_NUM_SYMBOLS];
+    int n = 0;
+    for (int s = 0; s < HUFF_NUM_SYMBOLS; s++) {
+        if (freq[s] <= 0) continue;
+        uint64_t k = ((uint64_t)freq[s] << 8) | (uint64_t)s;
+        int j = n++;
+        while (j > 0 && key[j - 1] > k) {
+            key[j] = key[j - 1];
+            j--;
+        }
+        key[j] = k;
+    }
+    for (int j = 0; j < n; j++) syms[j] = (int)(key[j] & 0xFF);
+    return n;
+}
+
+/*
+ * Moffat–Katajainen：a[0..n-1] 是由小到大排好的 freq，原地算出每一項的
+ * code 長度（結果仍放在 a，非遞增）。第一趟由左到右兩兩合併，把合併後的
+ * 內部節點放在已經用完的位置、記下 parent；第二趟由右到左算出內部節點的
+ * 深度；第三趟依各層內部節點數把深度分給葉節點。O(n)，不需要額外空間。
+ */
+static void min_redundancy_lengths(long *a, int n) {
+    if (n == 1) {
+        a[0] = 1;   // 只有一種 symbol 時給長度 1
+        return;
+    }
+    if (n < 1) return;
+
+    // 第一趟：root 是下一個還沒合併的內部節點，leaf 是下一個葉節點
+    int root = 0, leaf = 2;
+    a[0] += a[1];
+    for (int next = 1; next < n - 1; next++) {
+        if (leaf >= n || a[root] < a[leaf]) {
+            a[next]   = a[root];
+            a[root++] = next;
+        } else {
+            a[next] = a[leaf++];
+        }
+        if (leaf >= n || (root < next && a[root] < a[leaf])) {
+            a[next]  += a[root];
+            a[root++] = next;
+        } else {
+            a[next] += a[leaf++];
+        }
+    }
+
+    // 第二趟：內部節點的深度（a[n-2] 是 root）
+    a[n - 2] = 0;
+    for (int next = n - 3; next >= 0; next--) a[next] = a[a[next]] + 1;
+
+    // 第三趟：每一層可用的位置扣掉內部節點，剩下的就是這一層的葉節點
+    int avail = 1, used = 0, depth = 0, next = n - 1;
+    root = n - 2;
+    while (avail > 0) {
+        while (root >= 0 && a[root] == depth) {
+            used++;
+            root--;
+        }
+        while (avail > used) {
+            a[next--] = depth;
+            avail--;
+        }
+        avail = 2 * used;
+        depth++;
+        used  = 0;
+    }
+}
+
+int huff_optimal_lengths(const long freq[HUFF_NUM_SYMBOLS], int lens[HUFF_NUM_SYMBOLS]) {
+    int  syms[HUFF_NUM_SYMBOLS];
+    long a[HUFF_NUM_SYMBOLS];
+    int  n = huff_sort_symbols(freq, syms);
+
+    for (int j = 0; j < n; j++) a[j] = freq[syms[j]];
+    min_redundancy_lengths(a, n);
+    for (int s = 0; s < HUFF_NUM_SYMBOLS; s++) lens[s] = 0;
+    for (int j = 0; j < n; j++) lens[syms[j]] = (int)a[j];
+    return n;
+}
+
+int huff_code_lengths(const long freq[HUFF_NUM_SYMBOLS], int max_len,
+                      int lens[HUFF_NUM_SYMBOLS]) {
+    huff_optimal_lengths(freq, lens);
+
+    int longest = 0;
+    for (int s = 0; s < HUFF_NUM_SYMBOLS; s++) {
+        if (lens[s] > longest) longest = lens[s];
+    }
+    if (max_len > 0 && longest > max_len) {
+        return huff_limited_lengths(freq, max_len, lens);
+    }
+    return 0;
+}
+
+/*
+ * canonical code 的規則：
+ *   1. symbol 依 (長度, symbol 值) 排序
+ *   2. 第一個 symbol 的 code 為全 0
+ *   3. 之後每個 code = 前一個 code + 1，再在右邊補 0 補到自己的長度
+ * 這裡直接在 '0'/'1' 字串上做加一，因此任何長度（<= 255）都適用。
+ */
+int huff_canonical_codes(const int lens[HUFF_NUM_SYMBOLS],
+                         char codes[HUFF_NUM_SYMBOLS][HUFF_MAX_CODE_LEN + 1]) {
+    char cur[HUFF_MAX_CODE_LEN + 1];
+    int  cur_len = 0;
+    int  first   = 1;
+
+    for (int s = 0; s < HUFF_NUM_SYMBOLS; s++) {
+        if (lens[s] < 0 || lens[s] > HUFF_MAX_CODE_LEN) return -1;
+        codes[s][0] = '\0';
+    }
+
+    // 依長度由短到長，同長度內依 symbol 值由小到大
+    for (int len = 1; len <= HUFF_MAX_CODE_LEN; len++) {
+        for (int s = 0; s < HUFF_NUM_SYMBOLS; s++) {
+            if (lens[s] != len) continue;
+
+            if (first) {
+                first = 0;
+            } else {
+                // 前一個 code 加一；進位超出最高位代表 code 空間用完了
+                int k = cur_len - 1;
+                while (k >= 0 && cur[k] == '1') {
+                    cur[k] = '0';
+                    k--;
+                }
+                if (k < 0) return -1;
+                cur[k] = '1';
+            }
+
+            // 右邊補 0 到目前長度
+            while (cur_len < len) cur[cur_len++] = '0';
+            cur[cur_len] = '\0';
+
+            memcpy(codes[s], cur, (size_t)cur_len + 1);
+        }
+    }
+    return 0;
+}
+
+int huff_code_table(const int lens[HUFF_NUM_SYMBOLS], HuffCodeEntry table[HUFF_NUM_SYMBOLS]) {
+    uint64_t code     = 0;
+    int      prev_len = 0;
+
+    memset(table, 0, sizeof(HuffCodeEntry) * HUFF_NUM_SYMBOLS);
+    for (int len = 1; len <= HUFF_MAX_TABLE_CODE_LEN; len++) {
+        for (int s = 0; s < HUFF_NUM_SYMBOLS; s++) {
+            if (lens[s] != len) continue;
+            code = (len - prev_len >= 64) ? 0 : code << (len - prev_len);
+            prev_len = len;
+            if (len < 64 && (code >> len) != 0) return -1;
+            table[s].bits = code;
+            table[s].len  = len;
+            code++;
+        }
+    }
+    for (int s = 0; s < HUFF_NUM_SYMBOLS; s++) {
+        if (lens[s] > HUFF_MAX_TABLE_CODE_LEN) return -1;
+    }
+    return 0;
+}
+
+/* ----------------------------- 二進位 codebook ---------------------------- */
+
+static void put_le64(unsigned char *p, uint64_t v) {
+    for (int k = 0; k < 8; k++) p[k] = (unsigned char)(v >> (8 * k));
+}
+
+static uint64_t get_le64(const unsigned char *p) {
+    uint64_t v = 0;
+    for (int k = 7; k >= 0; k--) v = (v << 8) | p[k];
+    return v;
+}
+
+long huff_codebook_write_bin(FILE *fp, const HuffCodebook *cb) {
+    unsigned char hdr[HUFF_CB_HEADER_SIZE];
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, HUFF_CB_MAGIC, 4);
+    hdr[4] = HUFF_CB_VERSION;
+    hdr[5] = cb->has_counts ? HUFF_CB_HAS_COUNTS : 0;
+    put_le64(hdr + 8, (uint64_t)cb->total_symbols);
+    for (int s = 0; s < HUFF_NUM_SYMBOLS; s++) {
+        if (cb->lens[s] < 0 || cb->lens[s] > HUFF_MAX_CODE_LEN) return -1;
+        hdr[16 + s] = (unsigned char)cb->lens[s];
+    }
+    if (fwrite(hdr, 1, sizeof(hdr), fp) != sizeof(hdr)) return -1;
+
+    long written = (long)sizeof(hdr);
+    if (cb->has_counts) {
+        for (int s = 0; s < HUFF_NUM_SYMBOLS; s++) {
+            if (cb->lens[s] == 0) continue;
+            unsigned char buf[8];
+            put_le64(buf, (uint64_t)cb->counts[s]);
+            if (fwrite(buf, 1, 8, fp) != 8) return -1;
+            written += 8;
+        }
+    }
+    return written;
+}
+
+int huff_codebook_is_bin(const unsigned char *buf) {
+    return memcmp(buf, HUFF_CB_MAGIC, 4) == 0;
+}
+
+int huff_codebook_read_bin(FILE *fp, HuffCodebook *cb) {
+    unsigned char hdr[HUFF_CB_HEADER_SIZE];
+    if (fread(hdr, 1, sizeof(hdr), fp) != sizeof(hdr)) return -1;
+    if (!huff_codebook_is_bin(hdr) || hdr[4] != HUFF_CB_VERSION) return -1;
+
+    memset(cb, 0, sizeof(*cb));
+    cb->has_counts    = (hdr[5] & HUFF_CB_HAS_COUNTS) ? 1 : 0;
+    cb->total_symbols = (long)get_le64(hdr + 8);
+    if (cb->total_symbols < 0) return -1;
+    for (int s = 0; s < HUFF_NUM_SYMBOLS; s++) cb->lens[s] = hdr[16 + s];
+
+    if (cb->has_counts) {
+        for (int s = 0; s < HUFF_NUM_SYMBOLS; s++) {
+            if (cb->lens[s] == 0) continue;
+            unsigned char buf[8];
+            if (fread(buf, 1, 8, fp) != 8) return -1;
+            cb->counts[s] = (long)get_le64(buf);
+        }
+    }
+    return 0;
+}
+
+/* ------------------------------ container header -------------------------- */
+
+int huff_container_pack_header(unsigned char *buf, const HuffContainerHeader *hdr) {
+    memset(buf, 0, HUFF_CT_HEADER_SIZE);
+    memcpy(buf, HUFF_CT_MAGIC, 4);
+    if (hdr->streams > 1) {
+        if (hdr->streams > HUFF_CT_MAX_STREAMS) return -1;
+        buf[4] = HUFF_CT_VERSION_MS;
+        buf[6] = (unsigned char)hdr->streams;
+    } else {
+        buf[4] = HUFF_CT_VERSION;
+    }
+    buf[5] = (unsigned char)hdr->flags;
+    put_le64(buf + 8,  (uint64_t)hdr->original_size);
+    put_le64(buf + 16, (uint64_t)hdr->payload_bits);
+    for (int s = 0; s < HUFF_NUM_SYMBOLS; s++) {
+        if (hdr->lens[s] < 0 || hdr->lens[s] > HUFF_MAX_CODE_LEN) return -1;
+        buf[24 + s] = (unsigned char)hdr->lens[s];
+    }
+    return 0;
+}
+
+int huff_container_is(const unsigned char *buf) {
+    return memcmp(buf, HUFF_CT_MAGIC, 4) == 0;
+}
+
+int huff_container_parse_header(const unsigned char *buf, HuffContainerHeader *hdr) {
+    if (!huff_container_is(buf)) return -1;
+    if (buf[4] == HUFF_CT_VERSION) {
+        hdr->streams = 0;
+    } else if (buf[4] == HUFF_CT_VERSION_MS && buf[6] >= 2 &&
+               buf[6] <= HUFF_CT_MAX_STREAMS) {
+        hdr->streams = buf[6];
+    } else {
+        return -1;
+    }
+
+    hdr->flags         = buf[5];
+    hdr->original_size = (long)get_le64(buf + 8);
+    hdr->payload_bits  = (long)get_le64(buf + 16);
+    if (hdr->original_size < 0 || hdr->payload_bits < 0) return -1;
+    for (int s = 0; s < HUFF_NUM_SYMBOLS; s++) hdr->lens[s] = buf[24 + s];
+    return 0;
+}
+
+/* ------------------------------- sync index -------------------------------- */
+
+long huff_sync_pack(unsigned char *buf, long interval, const long *offsets, long count) {
+    put_le64(buf,     (uint64_t)interval);
+    put_le64(buf + 8, (uint64_t)count);
+    for (long k = 0; k < count; k++) {
+        put_le64(buf + HUFF_SYNC_HEADER_SIZE + 8 * k, (uint64_t)offsets[k]);
+    }
+    return HUFF_SYNC_SIZE(count);
+}
+
+int huff_sync_read(FILE *fp, long *interval, long **offsets, long *count) {
+    unsigned char buf[HUFF_SYNC_HEADER_SIZE];
+
+    *offsets = NULL;
+    if (fread(buf, 1, sizeof(buf), fp) != sizeof(buf)) return -1;
+    *interval = (long)get_le64(buf);
+    *count    = (long)get_le64(buf + 8);
+    if (*interval <= 0 || *count < 0 || *count > (1L << 40)) return -1;
+    if (*count == 0) return 0;
+
+    long *offs = (long *)malloc(sizeof(long) * (size_t)*count);
+    if (!offs) return -1;
+    long prev = 0;
+    for (long k = 0; k < *count; k++) {
+        if (fread(buf, 1, 8, fp) != 8) {
+            free(offs);
+            return -1;
+        }
+        offs[k] = (long)get_le64(buf);
+        if (offs[k] < prev) {   // offset 必須遞增
+            free(offs);
+            return -1;
+        }
+        prev = offs[k];
+    }
+    *offsets = offs;
+    return 0;
+}
+
+/* ------------------------------- framed 格式 ------------------------------- */
+
+static void put_le32(unsigned char *p, uint32_t v) {
+    for (int k = 0; k < 4; k++) p[k] = (unsigned char)(v >> (8 * k));
+}
+
+static uint32_t get_le32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+void huff_frame_pack_header(unsigned char *buf, long block_size) {
+    memset(buf, 0, HUFF_FR_HEADER_SIZE);
+    memcpy(buf, HUFF_FR_MAGIC, 4);
+    buf[4] = HUFF_FR_VERSION;
+    put_le32(buf + 8, (uint32_t)block_size);
+}
+
+int huff_frame_is(const unsigned char *buf) {
+    return memcmp(buf, HUFF_FR_MAGIC, 4) == 0;
+}
+
+int huff_frame_parse_header(const unsigned char *buf, long *block_size) {
+    if (!huff_frame_is(buf) || buf[4] != HUFF_FR_VERSION) return -1;
+    *block_size = (long)get_le32(buf + 8);
+    return (*block_size > 0) ? 0 : -1;
+}
+
+int huff_frame_pack_block(unsigned char *buf, const HuffFrameBlock *blk) {
+    memset(buf, 0, HUFF_FR_BLOCK_HEADER_SIZE);
+    put_le32(buf, (uint32_t)blk->raw_len);
+    put_le64(buf + 8, (uint64_t)blk->payload_bits);
+    for (int s = 0; s < HUFF_NUM_SYMBOLS; s++) {
+        if (blk->lens[s] < 0 || blk->lens[s] > HUFF_MAX_CODE_LEN) return -1;
+        buf[16 + s] = (unsigned char)blk->lens[s];
+    }
+    return 0;
+}
+
+long huff_frame_raw_len(const unsigned char *buf) {
+    return (long)get_le32(buf);
+}
+
+int huff_frame_parse_block(const unsigned char *buf, HuffFrameBlock *blk) {
+    blk->raw_len      = (long)get_le32(buf);
+    blk->payload_bits = (long)get_le64(buf + 8);
+    if (blk->raw_len <= 0 || blk->payload_bits < 0) return -1;
+    for (int s = 0; s < HUFF_NUM_SYMBOLS; s++) blk->lens[s] = buf[16 + s];
+    return 0;
+}
+
+/* ------------------------------- CSV codebook ----------------------------- */
+
+// 輸出 symbol 欄位（含跳脫），配合 decoder 的 parse_symbol
+static void print_symbol(FILE *fp, unsigned char s) {
+    if (s == '\n') {
+        fprintf(fp, "\"\\n\"");
+    } else if (s == '\t') {
+        fprintf(fp, "\"\\t\"");
+    } else if (s == '\r') {
+        fprintf(fp, "\"\\r\"");
+    } else if (s == '\"') {
+        fprintf(fp, "\"\\\"\"");
+    } else if (s == '\\') {
+        fprintf(fp, "\"\\\\\"");
+    } else {
+        fprintf(fp, "\"%c\"", s);
+    }
+}
+
+void huff_codebook_write_csv(FILE *fp, const HuffCodebook *cb,
+                             const char codes[HUFF_NUM_SYMBOLS][HUFF_MAX_CODE_LEN + 1],
+                             int canonical) {
+    int order[HUFF_NUM_SYMBOLS];
+    int n = 0;
+
+    // 依 (count, symbol) 由小到大排序（插入排序，n 最多 256）
+    for (int s = 0; s < HUFF_NUM_SYMBOLS; s++) {
+        if (cb->lens[s] == 0) continue;
+        int k = n++;
+        while (k > 0 && cb->counts[order[k - 1]] > cb->counts[s]) {
+            order[k] = order[k - 1];
+            k--;
+        }
+        order[k] = s;
+    }
+
+    if (canonical) {
+        // 註解行：舊版 decoder 找不到雙引號會直接跳過這一行
+        fprintf(fp, "# code_assignment=canonical\n");
+    }
+    for (int k = 0; k < n; k++) {
+        int    s    = order[k];
+        double prob = (cb->total_symbols > 0)
+                      ? (double)cb->counts[s] / (double)cb->total_symbols
+                      : 0.0;
+        double self_info = (prob > 0.0) ? -log(prob) / log(2.0) : 0.0;
+
+        print_symbol(fp, (unsigned char)s);
+        fprintf(fp, ",%ld,%.15f,\"%s\",%.15f\n",
+                cb->counts[s],
+                prob,
+                codes[s],
+                self_info);
+    }
+}
+
+/* -------------------------------- manifest -------------------------------- */
+
+void huff_manifest_init(HuffManifest *m) {
+    m->paths = NULL;
+    m->count = 0;
+    m->cap   = 0;
+    m->text  = NULL;
+}
+
+int huff_manifest_add(HuffManifest *m, const char *a, const char *b, const char *c) {
+    if (m->count == m->cap) {
+        long ncap = m->cap ? m->cap * 2 : 64;
+        const char **np = (const char **)realloc((void *)m->paths,
+                                                 sizeof(*np) * 3 * (size_t)ncap);
+        if (!np) return -1;
+        m->paths = np;
+        m->cap   = ncap;
+    }
+    m->paths[3 * m->count]     = a;
+    m->paths[3 * m->count + 1] = b;
+    m->paths[3 * m->count + 2] = c;
+    m->count++;
+    return 0;
+}
+
+long huff_manifest_read(HuffManifest *m, FILE *fp) {
+    size_t cap = 1 << 16;
+    size_t len = 0;
+    char  *text;
+
+    if (m->text) return -1;
+    text = (char *)malloc(cap);
+    if (!text) return -1;
+    while (1) {
+        if (len + 1 == cap) {
+            char *nt = (char *)realloc(text, cap * 2);
+            if (!nt) {
+                free(text);
+                return -1;
+            }
+            text = nt;
+            cap *= 2;
+        }
+        size_t n = fread(text + len, 1, cap - 1 - len, fp);
+        if (n == 0) break;
+        len += n;
+    }
+    if (ferror(fp)) {
+        free(text);
+        return -1;
+    }
+    text[len] = '\0';
+    m->text = text;
+
+    // 就地切開：每個路徑結尾的空白改成 '\0'，paths 直接指進 text
+    long  line_no = 0;
+    char *line    = text;
+    while (*line) {
+        char *next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        else next = line + strlen(line);
+        line_no++;
+
+        const char *f[3];
+        int   nf = 0;
+        char *p  = line;
+        while (1) {
+            while (*p == ' ' || *p == '\t' || *p == '\r') p++;
+            if (*p == '\0' || (nf == 0 && *p == '#')) break;
+            if (nf == 3) return line_no;   // 多出來的欄位
+            f[nf++] = p;
+            while (*p && *p != ' ' && *p != '\t' && *p != '\r') p++;
+            if (*p) *p++ = '\0';
+        }
+        if (nf != 0 && nf != 3) return line_no;
+        if (nf == 3 && huff_manifest_add(m, f[0], f[1], f[2]) != 0) return -1;
+        line = next;
+    }
+    return 0;
+}
+
+void huff_manifest_free(HuffManifest *m) {
+    free((void *)m->paths);
+    free(m->text);
+    huff_manifest_init(m);
+}
+
+/* ------------------------------ 執行緒池 ------------------------------------ */
+
+typedef struct PoolTask {
+    void          *(*fn)(void *);
+    void           *arg;
+    HuffPoolGroup  *group;
+} PoolTask;
+
+/*
+ * 固定容量的環狀 deque：head 是最舊的（被偷的一端），head + len - 1 是
+ * 最新的（自己取的一端）。task 都很粗（至少 1 MB 的資料或整個檔案），
+ * 每個 deque 用自己的 mutex 就夠了。
+ */
+typedef struct PoolWorker {
+    struct HuffPool *pool;
+    int              id;
+    pthread_t        tid;
+    pthread_mutex_t  lock;     // 保護 ring / head / len
+    PoolTask        *ring;
+    int              head;
+    int              len;
+    long             tasks;    // 以下統計受 pool->lock 保護
+    long             steals;
+    uint64_t         busy_ns;
+    uint64_t         idle_ns;
+} PoolWorker;
+
+struct HuffPool {
+    int             nworkers;
+    int             started;   // 實際在跑的 worker 數（含 worker 0）
+    int             queue_cap;
+    PoolWorker     *w;
+    pthread_key_t   self;      // 執行緒 → 自己的 PoolWorker（worker 0 沒有設定）
+    pthread_mutex_t lock;      // 保護 seq / stop / 所有 group 與統計
+    pthread_cond_t  cond;      // 有新 task 或某一組做完時 broadcast
+    unsigned long   seq;       // 每丟一個 task 加一，睡之前比對，避免漏掉喚醒
+    int             sleepers;
+    int             stop;
+};
+
+static uint64_t pool_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static PoolWorker *pool_self(const HuffPool *p) {
+    PoolWorker *me = (PoolWorker *)pthread_getspecific(p->self);
+    return me ? me : &p->w[0];
+}
+
+// 從 me 自己的尾端取，或從別人的頭端偷；g 不是 NULL 時只取這一組的 task
+static int pool_take(HuffPool *p, PoolWorker *me, const HuffPoolGroup *g,
+                     PoolTask *t, int *stolen) {
+    pthread_mutex_lock(&me->lock);
+    if (me->len > 0) {
+        PoolTask *last = &me->ring[(me->head + me->len - 1) % p->queue_cap];
+        if (!g || last->group == g) {
+            *t = *last;
+            me->len--;
+            pthread_mutex_unlock(&me->lock);
+            *stolen = 0;
+            return 1;
+        }
+    }
+    pthread_mutex_unlock(&me->lock);
+
+    for (int k = 1; k < p->nworkers; k++) {
+        PoolWorker *v = &p->w[(me->id + k) % p->nworkers];
+        pthread_mutex_lock(&v->lock);
+        if (v->len > 0 && (!g || v->ring[v->head].group == g)) {
+            *t = v->ring[v->head];
+            v->head = (v->head + 1) % p->queue_cap;
+            v->len--;
+            pthread_mutex_unlock(&v->lock);
+            *stolen = 1;
+            return 1;
+        }
+        pthread_mutex_unlock(&v->lock);
+    }
+    return 0;
+}
+
+static void pool_exec(HuffPool *p, PoolWorker *me, const PoolTask *t, int stolen) {
+    uint64_t t0 = pool_now_ns();
+    t->fn(t->arg);
+    uint64_t dt = pool_now_ns() - t0;
+
+    pthread_mutex_lock(&p->lock);
+    me->tasks++;
+    me->steals  += stolen;
+    me->busy_ns += dt;
+    t->group->ran[me->id / 64] |= (uint64_t)1 << (me->id % 64);
+    if (--t->group->pending == 0 && p->sleepers > 0) pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// 在 cond 上睡到 seq 改變（有新 task）或 g 做完；呼叫時持有 p->lock
+static void pool_sleep(HuffPool *p, PoolWorker *me, unsigned long seq,
+                       const HuffPoolGroup *g) {
+    uint64_t t0 = pool_now_ns();
+    p->sleepers++;
+    while (p->seq == seq && !p->stop && (!g || g->pending > 0)) {
+        pthread_cond_wait(&p->cond, &p->lock);
+    }
+    p->sleepers--;
+    me->idle_ns += pool_now_ns() - t0;
+}
+
+static void *pool_worker_main(void *arg) {
+    PoolWorker *me = (PoolWorker *)arg;
+    HuffPool   *p  = me->pool;
+    PoolTask    t;
+    int         stolen;
+
+    pthread_setspecific(p->self, me);
+    while (1) {
+        pthread_mutex_lock(&p->lock);
+        unsigned long seq = p->seq;
+        int stop = p->stop;
+        pthread_mutex_unlock(&p->lock);
+        if (stop) break;
+
+        if (pool_take(p, me, NULL, &t, &stolen)) {
+            pool_exec(p, me, &t, stolen);
+            continue;
+        }
+        pthread_mutex_lock(&p->lock);
+        pool_sleep(p, me, seq, NULL);
+        pthread_mutex_unlock(&p->lock);
+    }
+    return NULL;
+}
+
+HuffPool *huff_pool_new(int threads, int queue_cap) {
+    if (threads <= 1) return NULL;
+    if (threads > HUFF_POOL_MAX_THREADS) threads = HUFF_POOL_MAX_THREADS;
+    if (queue_cap < 1) queue_cap = 1;
+
+    HuffPool *p = (HuffPool *)calloc(1, sizeof(HuffPool));
+    if (!p) return NULL;
+    p->nworkers  = threads;
+    p->queue_cap = queue_cap;
+    p->w = (PoolWorker *)calloc((size_t)threads, sizeof(PoolWorker));
+    int ok = p->w && pthread_key_create(&p->self, NULL) == 0;
+    for (int k = 0; ok && k < threads; k++) {
+        p->w[k].ring = (PoolTask *)malloc(sizeof(PoolTask) * (size_t)queue_cap);
+        if (!p->w[k].ring) {
+            pthread_key_delete(p->self);
+            ok = 0;
+        }
+    }
+    if (!ok) {
+        for (int k = 0; p->w && k < threads; k++) free(p->w[k].ring);
+        free(p->w);
+        free(p);
+        return NULL;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    for (int k = 0; k < threads; k++) {
+        p->w[k].pool = p;
+        p->w[k].id   = k;
+        pthread_mutex_init(&p->w[k].lock, NULL);
+    }
+
+    // worker 0 是呼叫端。開不了的執行緒只是 deque 永遠是空的（只有
+    // 自己會往自己的 deque 丟 task），不影響其他 worker
+    p->started = 1;
+    for (int k = 1; k < threads; k++) {
+        if (pthread_create(&p->w[k].tid, NULL, pool_worker_main, &p->w[k]) != 0) break;
+        p->started++;
+    }
+    return p;
+}
+
+void huff_pool_free(HuffPool *p) {
+    if (!p) return;
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    for (int k = 1; k < p->started; k++) pthread_join(p->w[k].tid, NULL);
+
+    for (int k = 0; k < p->nworkers; k++) {
+        pthread_mutex_destroy(&p->w[k].lock);
+        free(p->w[k].ring);
+    }
+    pthread_key_delete(p->self);
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    free(p->w);
+    free(p);
+}
+
+int huff_pool_threads(const HuffPool *p) {
+    return p ? p->started : 1;
+}
+
+int huff_pool_worker(const HuffPool *p) {
+    return p ? pool_self(p)->id : 0;
+}
+
+void huff_pool_group_init(HuffPoolGroup *g) {
+    memset(g, 0, sizeof(*g));
+}
+
+void huff_pool_submit(HuffPool *p, HuffPoolGroup *g, void *(*fn)(void *), void *arg) {
+    if (!p) {
+        fn(arg);
+        g->ran[0] |= 1;
+        return;
+    }
+
+    PoolWorker *me = pool_self(p);
+    PoolTask    t  = {fn, arg, g};
+
+    pthread_mutex_lock(&p->lock);
+    g->pending++;
+    pthread_mutex_unlock(&p->lock);
+
+    pthread_mutex_lock(&me->lock);
+    int queued = me->len < p->queue_cap;
+    if (queued) {
+        me->ring[(me->head + me->len) % p->queue_cap] = t;
+        me->len++;
+    }
+    pthread_mutex_unlock(&me->lock);
+
+    if (!queued) {
+        // deque 滿了：自己先做，丟 task 的一方自然慢下來
+        pool_exec(p, me, &t, 0);
+        return;
+    }
+    pthread_mutex_lock(&p->lock);
+    p->seq++;
+    if (p->sleepers > 0) pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+int huff_pool_wait(HuffPool *p, HuffPoolGroup *g) {
+    if (p) {
+        PoolWorker *me = pool_self(p);
+        PoolTask    t;
+        int         stolen;
+
+        while (1) {
+            pthread_mutex_lock(&p->lock);
+            unsigned long seq  = p->seq;
+            long          left = g->pending;
+            pthread_mutex_unlock(&p->lock);
+            if (left == 0) break;
+
+            if (pool_take(p, me, g, &t, &stolen)) {
+                pool_exec(p, me, &t, stolen);
+                continue;
+            }
+            // 剩下的都在別人手上：睡到有新 task 或這組做完
+            pthread_mutex_lock(&p->lock);
+            pool_sleep(p, me, seq, g);
+            pthread_mutex_unlock(&p->lock);
+        }
+    }
+
+    int used = 0;
+    for (size_t k = 0; k < sizeof(g->ran) / sizeof(g->ran[0]); k++) {
+        for (uint64_t b = g->ran[k]; b; b &= b - 1) used++;
+    }
+    return used > 0 ? used : 1;
+}
+
+int huff_pool_run(HuffPool *p, void *tasks, size_t stride, long n, void *(*fn)(void *)) {
+    HuffPoolGroup g;
+    huff_pool_group_init(&g);
+    for (long k = 0; k < n; k++) huff_pool_submit(p, &g, fn, (char *)tasks + stride * (size_t)k);
+    return huff_pool_wait(p, &g);
+}
+
+void huff_pool_stats(HuffPool *p, int worker, HuffPoolStats *st) {
+    memset(st, 0, sizeof(*st));
+    if (!p || worker < 0 || worker >= p->nworkers) return;
+    pthread_mutex_lock(&p->lock);
+    st->tasks    = p->w[worker].tasks;
+    st->steals   = p->w[worker].steals;
+    st->busy_sec = (double)p->w[worker].busy_ns / 1e9;
+    st->idle_sec = (double)p->w[worker].idle_ns / 1e9;
+    pthread_mutex_unlock(&p->lock);
+}
+
+int huff_detect_threads(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    if (n > HUFF_POOL_MAX_THREADS) n = HUFF_POOL_MAX_THREADS;
+    return (int)n;
+}
@@ -0,0 +1,323 @@
+#ifndef HUFFMAN_H
+#define HUFFMAN_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * encoder 與 decoder 共用的 Huffman 工具函式
+ * - code 長度計算：最佳長度（Moffat–Katajainen）與限制最長 code 長度
+ *   的版本（package-merge）
+ * - canonical code 指定：只要知道每個 symbol 的 code 長度，
+ *   兩邊就能各自算出完全相同的 code（字串或整數 table）
+ * - codebook 的讀寫：精簡的二進位格式，以及方便人看的 CSV
+ * - 單檔 container 的 header（codebook 與 payload 放在同一個檔案）
+ * - 分 block 的 framed 格式（每個 block 有自己的 codebook）
+ * - 批次模式的 manifest（一個 process 處理很多檔案）
+ * - 所有平行階段共用的 work-stealing 執行緒池
+ */
+
+#define HUFF_NUM_SYMBOLS  256   /* byte-oriented：symbol 0~255 */
+#define HUFF_MAX_CODE_LEN 255   /* code 字串最長 255 個 '0'/'1'（含 '\0' 共 256） */
+
+/* 計算長度不超過 max_len 的最佳（total bits 最小）code 長度，使用
+   package-merge 演算法
+   - freq[s]  : symbol s 的出現次數，0 表示沒有出現
+   - lens[s]  : 輸出每個 symbol 的 code 長度（未出現的為 0）
+   只有一種 symbol 時長度為 1。回傳 0 表示成功；
+   2^max_len 小於出現的 symbol 種類數（無解）時回傳 -1 */
+int huff_limited_lengths(const long freq[HUFF_NUM_SYMBOLS], int max_len,
+                         int lens[HUFF_NUM_SYMBOLS]);
+
+/* 把出現過的 symbol 依 (freq, symbol) 由小到大排進 syms，回傳種類數 */
+int huff_sort_symbols(const long freq[HUFF_NUM_SYMBOLS], int syms[HUFF_NUM_SYMBOLS]);
+
+/* 計算最佳（不限長）的 code 長度，使用 Moffat–Katajainen 原地演算法：
+   排序後 O(n)，不配置記憶體、沒有全域狀態，可以同時在多個執行緒呼叫。
+   只有一種 symbol 時長度為 1。回傳出現的 symbol 種類數 */
+int huff_optimal_lengths(const long freq[HUFF_NUM_SYMBOLS], int lens[HUFF_NUM_SYMBOLS]);
+
+/* huff_optimal_lengths；max_len > 0 且最長的 code 超過時改用
+   huff_limited_lengths。無解時回傳 -1 */
+int huff_code_lengths(const long freq[HUFF_NUM_SYMBOLS], int max_len,
+                      int lens[HUFF_NUM_SYMBOLS]);
+
+/* 依 (code 長度, symbol) 的順序指定 canonical code
+   - lens[s]  : symbol s 的 code 長度，0 表示沒有出現
+   - codes[s] : 輸出 '0'/'1' 字串；未出現的 symbol 設為空字串
+   回傳 0 表示成功；長度超過 HUFF_MAX_CODE_LEN 或不滿足 Kraft 不等式
+   （code 空間不夠分配）時回傳 -1 */
+int huff_canonical_codes(const int lens[HUFF_NUM_SYMBOLS],
+                         char codes[HUFF_NUM_SYMBOLS][HUFF_MAX_CODE_LEN + 1]);
+
+/* 整數形式的 canonical code（編碼迴圈查這張表，不走 '0'/'1' 字串） */
+#define HUFF_MAX_TABLE_CODE_LEN 64   /* HuffCodeEntry.bits 能容納的最長 code */
+
+typedef struct HuffCodeEntry {
+    uint64_t bits;   /* code 的位元值（靠右對齊，MSB 先輸出） */
+    int      len;    /* code 長度（0 = 此 symbol 未出現） */
+} HuffCodeEntry;
+
+/* 由 code 長度算出 canonical code 的整數 table（與 huff_canonical_codes
+   的字串版本結果相同）；長度超過 HUFF_MAX_TABLE_CODE_LEN 或 code 空間
+   不足時回傳 -1 */
+int huff_code_table(const int lens[HUFF_NUM_SYMBOLS], HuffCodeEntry table[HUFF_NUM_SYMBOLS]);
+
+/* ------------------------------------------------------------------------
+ * 二進位 codebook 格式（所有整數皆為 little-endian）
+ *
+ *   offset  size  內容
+ *   0       4     magic "HUFB"
+ *   4       1     version（目前為 1）
+ *   5       1     flags：bit0 = 後面附有 counts
+ *   6       2     保留，寫 0
+ *   8       8     total_symbols：原始資料的 symbol 總數
+ *   16      256   每個 symbol 的 code 長度（0 = 未出現）
+ *   272     8*k   （有 counts 時）長度不為 0 的 symbol 依 symbol 值
+ *                 順序各一個 u64 出現次數
+ *
+ * 只存長度，因此 code 一律是 canonical code。
+ * ------------------------------------------------------------------------ */
+
+#define HUFF_CB_MAGIC       "HUFB"
+#define HUFF_CB_VERSION     1
+#define HUFF_CB_HAS_COUNTS  0x01
+#define HUFF_CB_HEADER_SIZE (16 + HUFF_NUM_SYMBOLS)
+
+typedef struct HuffCodebook {
+    int  lens[HUFF_NUM_SYMBOLS];    /* code 長度，0 = 未出現 */
+    long counts[HUFF_NUM_SYMBOLS];  /* 出現次數；沒有 counts 時全為 0 */
+    long total_symbols;             /* 原始資料的 symbol 總數 */
+    int  has_counts;                /* counts 是否有效 */
+} HuffCodebook;
+
+/* 寫出二進位 codebook；has_counts 為 0 時不寫 counts
+   回傳寫出的 byte 數，失敗回傳 -1 */
+long huff_codebook_write_bin(FILE *fp, const HuffCodebook *cb);
+
+/* 檢查 buf（至少 4 bytes）是不是二進位 codebook 的 magic */
+int huff_codebook_is_bin(const unsigned char *buf);
+
+/* 從目前位置讀二進位 codebook（含 magic），成功回傳 0，格式錯誤回傳 -1 */
+int huff_codebook_read_bin(FILE *fp, HuffCodebook *cb);
+
+/* 寫出 CSV codebook（除錯用、人看得懂的格式）
+   每行：symbol,count,prob,"code",self_info，依 (count, symbol) 排序；
+   canonical 為 1 時第一行加上 "# code_assignment=canonical" */
+void huff_codebook_write_csv(FILE *fp, const HuffCodebook *cb,
+                             const char codes[HUFF_NUM_SYMBOLS][HUFF_MAX_CODE_LEN + 1],
+                             int canonical);
+
+/* ------------------------------------------------------------------------
+ * 單檔 container 格式（所有整數皆為 little-endian）
+ *
+ *   offset  size  內容
+ *   0       4     magic "HUFC"
+ *   4       1     version：1；多 stream payload 為 2（舊版 decoder 會直接拒絕）
+ *   5       1     flags：bit0 = payload 後面接著 sync index
+ *   6       1     streams：交錯的 stream 數（version 2 才有，2~16；否則寫 0）
+ *   7       1     保留，寫 0
+ *   8       8     original_size：原始資料的 byte 數（= symbol 數）
+ *   16      8     payload_bits：payload 的精確 bit 數（不含最後的 padding）
+ *   24      256   每個 symbol 的 code 長度（canonical code）
+ *   280     ...   payload：(payload_bits + 7) / 8 bytes，MSB 先
+ *
+ * decoder 只要開一次檔、從頭循序讀完就能解碼，不需要另外的 codebook。
+ *
+ * sync index（flags 有 HUFF_CT_HAS_SYNC 時，緊接在 payload 之後）：
+ *   0       8     interval：每隔幾個 symbol 記一個 checkpoint
+ *   8       8     count：checkpoint 數
+ *   16      8*k   第 k 個 checkpoint（第 (k+1) * interval 個 symbol）
+ *                 在 payload 中開始的 bit offset
+ * 解碼器可以從任一個 checkpoint 開始解，把 payload 分給多個執行緒。
+ * 舊的 decoder 解完 original_size 個 symbol 就停，不會讀到 index。
+ *
+ * 多 stream payload（version 2）：第 i 個 symbol 編進第 i % streams 個
+ * stream，decoder 同一輪迴圈裡各 stream 各解一個 symbol，彼此沒有相依。
+ *   0       8*n   jump table：每個 stream 的精確 bit 數
+ *   8*n     ...   各 stream 依序存放，每個都補 0 到 byte 邊界
+ * 此時 payload_bits 是整個 payload（含 jump table 與 padding）的 bit 數。
+ * ------------------------------------------------------------------------ */
+
+#define HUFF_CT_MAGIC       "HUFC"
+#define HUFF_CT_VERSION     1
+#define HUFF_CT_VERSION_MS  2   /* 多 stream payload */
+#define HUFF_CT_MAX_STREAMS 16
+#define HUFF_CT_HEADER_SIZE (24 + HUFF_NUM_SYMBOLS)
+#define HUFF_CT_HAS_SYNC    0x01
+#define HUFF_SYNC_HEADER_SIZE 16
+
+typedef struct HuffContainerHeader {
+    int  flags;
+    int  streams;                   /* 0 = 單一 stream；2~16 = 多 stream payload */
+    long original_size;
+    long payload_bits;
+    int  lens[HUFF_NUM_SYMBOLS];
+} HuffContainerHeader;
+
+/* 把 header 編成 HUFF_CT_HEADER_SIZE bytes，長度不合法時回傳 -1 */
+int huff_container_pack_header(unsigned char *buf, const HuffContainerHeader *hdr);
+
+/* 檢查 buf（至少 4 bytes）是不是 container 的 magic */
+int huff_container_is(const unsigned char *buf);
+
+/* 解析 HUFF_CT_HEADER_SIZE bytes 的 header，格式錯誤回傳 -1 */
+int huff_container_parse_header(const unsigned char *buf, HuffContainerHeader *hdr);
+
+/* sync index 的總 byte 數（count 個 checkpoint） */
+#define HUFF_SYNC_SIZE(count) (HUFF_SYNC_HEADER_SIZE + 8 * (long)(count))
+
+/* 把 sync index（count 個 bit offset）編進 buf（至少 HUFF_SYNC_SIZE(count)
+   bytes），回傳寫入的 byte 數 */
+long huff_sync_pack(unsigned char *buf, long interval, const long *offsets, long count);
+
+/* 從目前位置讀 sync index；*offsets 由這裡 malloc（count 為 0 時是 NULL），
+   呼叫端負責 free。格式錯誤回傳 -1 */
+int huff_sync_read(FILE *fp, long *interval, long **offsets, long *count);
+
+/* ------------------------------------------------------------------------
+ * framed 格式：輸入切成固定大小的 block，每個 block 各自統計頻率、
+ * 各自帶一份 codebook，因此可以獨立編碼、解碼與串流
+ * （所有整數皆為 little-endian）
+ *
+ * 檔案 header：
+ *   offset  size  內容
+ *   0       4     magic "HUFF"
+ *   4       1     version（目前為 1）
+ *   5       3     保留，寫 0
+ *   8       4     block_size：切 block 的大小（最後一個 block 可以比較小）
+ *   12      4     保留，寫 0
+ *
+ * 之後是一連串 block，每個 block：
+ *   0       4     raw_len：這個 block 原始資料的 byte 數；0 表示串流結束
+ *                 （結束標記只有這 4 bytes）
+ *   4       4     保留，寫 0
+ *   8       8     payload_bits：這個 block payload 的精確 bit 數
+ *   16      256   每個 symbol 的 code 長度（canonical code）
+ *   272     ...   payload：(payload_bits + 7) / 8 bytes，MSB 先
+ * ------------------------------------------------------------------------ */
+
+#define HUFF_FR_MAGIC             "HUFF"
+#define HUFF_FR_VERSION           1
+#define HUFF_FR_HEADER_SIZE       16
+#define HUFF_FR_BLOCK_HEADER_SIZE (16 + HUFF_NUM_SYMBOLS)
+#define HUFF_FR_END_SIZE          4
+
+typedef struct HuffFrameBlock {
+    long raw_len;
+    long payload_bits;
+    int  lens[HUFF_NUM_SYMBOLS];
+} HuffFrameBlock;
+
+/* 檔案 header：編成 HUFF_FR_HEADER_SIZE bytes */
+void huff_frame_pack_header(unsigned char *buf, long block_size);
+
+/* 檢查 buf（至少 4 bytes）是不是 framed 格式的 magic */
+int huff_frame_is(const unsigned char *buf);
+
+/* 解析檔案 header，格式錯誤回傳 -1 */
+int huff_frame_parse_header(const unsigned char *buf, long *block_size);
+
+/* block header：編成 HUFF_FR_BLOCK_HEADER_SIZE bytes，長度不合法時回傳 -1 */
+int huff_frame_pack_block(unsigned char *buf, const HuffFrameBlock *blk);
+
+/* 解析 HUFF_FR_BLOCK_HEADER_SIZE bytes 的 block header（raw_len 不為 0），
+   格式錯誤回傳 -1 */
+int huff_frame_parse_block(const unsigned char *buf, HuffFrameBlock *blk);
+
+/* 讀 block 開頭 4 bytes 的 raw_len（0 表示串流結束） */
+long huff_frame_raw_len(const unsigned char *buf);
+
+/* ------------------------------------------------------------------------
+ * 批次模式的 manifest：一行一個檔案，三個以空白分隔的路徑，順序與命令列
+ * 的位置參數相同（encoder：in_fn cb_fn enc_fn；decoder：enc_fn cb_fn
+ * out_fn）。空行與 '#' 開頭的行略過；路徑本身不能含空白。
+ * ------------------------------------------------------------------------ */
+
+typedef struct HuffManifest {
+    const char **paths;   /* 第 i 個檔案的三個路徑是 paths[3*i .. 3*i+2] */
+    long         count;   /* 檔案數 */
+    long         cap;
+    char        *text;    /* huff_manifest_read 讀進來的內容，paths 指進這裡 */
+} HuffManifest;
+
+/* 初始化成空的 manifest */
+void huff_manifest_init(HuffManifest *m);
+
+/* 加入一個檔案（三個路徑只保存指標，不複製）；記憶體不足回傳 -1 */
+int huff_manifest_add(HuffManifest *m, const char *a, const char *b, const char *c);
+
+/* 讀入整個 manifest 檔並逐行加入。成功回傳 0，記憶體不足或讀取失敗
+   回傳 -1，某一行不是三個路徑時回傳該行的行號（從 1 起算）。
+   每個 manifest 只能讀一次 */
+long huff_manifest_read(HuffManifest *m, FILE *fp);
+
+void huff_manifest_free(HuffManifest *m);
+
+/* ------------------------------------------------------------------------
+ * work-stealing 執行緒池：頻率統計、平行打包、framed 的 block 與批次的
+ * 檔案都丟進同一個 pool，不再各自開關執行緒。
+ *
+ * 每個 worker 有自己的 deque：自己丟進去的 task 從尾端取（LIFO），閒著
+ * 的 worker 從別人的頭端偷（FIFO）。deque 容量固定（queue_cap），滿了
+ * 丟 task 的人就自己先做一個，讀輸入、丟 task 的一方因此不會跑得比
+ * worker 快太多。建立 pool 的執行緒當作 worker 0，只在等待時幫忙執行。
+ *
+ * task 的結果由呼叫端依 task 的順序存放、合併，執行的順序與執行緒數
+ * 不影響輸出。等待一組 task 時只會幫忙執行同一組的 task，巢狀使用
+ * （例如批次的檔案裡再做平行頻率統計）不會把別的檔案疊到同一個 stack 上。
+ * pool 為 NULL 時所有函式都在呼叫端循序執行。
+ * ------------------------------------------------------------------------ */
+
+#define HUFF_POOL_MAX_THREADS 256
+
+typedef struct HuffPool HuffPool;
+
+/* 一組 task：huff_pool_submit 丟進去、huff_pool_wait 等全部做完 */
+typedef struct HuffPoolGroup {
+    long     pending;                                 /* 還沒做完的 task 數 */
+    uint64_t ran[(HUFF_POOL_MAX_THREADS + 63) / 64];  /* 做過這組 task 的 worker */
+} HuffPoolGroup;
+
+/* 每個 worker 的累計統計（worker 0 是建立 pool 的執行緒） */
+typedef struct HuffPoolStats {
+    long   tasks;      /* 執行的 task 數 */
+    long   steals;     /* 其中從別的 worker 偷來的 */
+    double busy_sec;   /* 執行 task 的時間 */
+    double idle_sec;   /* 沒有 task 可做、睡著等待的時間 */
+} HuffPoolStats;
+
+/* 建立 threads 個 worker 的 pool（含呼叫端，另開 threads - 1 個執行緒），
+   每個 deque 最多 queue_cap 個 task。threads <= 1 或記憶體不足回傳 NULL；
+   執行緒開不了時 pool 就只有開成功的那些 */
+HuffPool *huff_pool_new(int threads, int queue_cap);
+
+/* 停下所有 worker 並釋放 pool（之前丟的 task 必須都已等過） */
+void huff_pool_free(HuffPool *p);
+
+/* worker 數（含 worker 0）；NULL 回傳 1 */
+int huff_pool_threads(const HuffPool *p);
+
+/* 目前執行緒在 pool 裡的編號；不是 pool 的執行緒回傳 0 */
+int huff_pool_worker(const HuffPool *p);
+
+void huff_pool_group_init(HuffPoolGroup *g);
+
+/* 把 fn(arg) 丟進目前執行緒的 deque；deque 滿了就直接在這裡執行 */
+void huff_pool_submit(HuffPool *p, HuffPoolGroup *g, void *(*fn)(void *), void *arg);
+
+/* 等 g 的所有 task 做完（期間幫忙執行 g 的 task），回傳做過這組 task
+   的 worker 數 */
+int huff_pool_wait(HuffPool *p, HuffPoolGroup *g);
+
+/* 執行 n 個 task（tasks 陣列每個元素 stride bytes）並等全部結束，
+   回傳實際用到的 worker 數 */
+int huff_pool_run(HuffPool *p, void *tasks, size_t stride, long n, void *(*fn)(void *));
+
+/* 第 worker 個 worker 到目前為止的統計 */
+void huff_pool_stats(HuffPool *p, int worker, HuffPoolStats *st);
+
+/* 線上的 CPU 核心數，介於 1 與 HUFF_POOL_MAX_THREADS 之間 */
+int huff_detect_threads(void);
+
+#endif /* HUFFMAN_H */
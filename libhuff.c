@@ -0,0 +1,497 @@
+#include "libhuff.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct HuffCtx {
+    int           max_code_len;                 // 0 = 不限制
+    long          freq[HUFF_NUM_SYMBOLS];       // 編碼用
+    int           lens[HUFF_NUM_SYMBOLS];
+    HuffCodeEntry table[HUFF_NUM_SYMBOLS];
+    int           dec_valid;                    // dec_tree / dec_lut 是否對應 dec_lens
+    int           dec_lens[HUFF_NUM_SYMBOLS];
+    HuffDTree     dec_tree;
+    HuffLutTable  dec_lut;
+    char          codes[HUFF_NUM_SYMBOLS][HUFF_MAX_CODE_LEN + 1];   // 建樹用的暫存
+};
+
+HuffCtx *huff_ctx_new(void) {
+    return (HuffCtx *)calloc(1, sizeof(HuffCtx));
+}
+
+static void dec_drop(HuffCtx *ctx) {
+    if (!ctx->dec_valid) return;
+    huff_lut_free(&ctx->dec_lut);
+    huff_dtree_free(&ctx->dec_tree);
+    ctx->dec_valid = 0;
+}
+
+void huff_ctx_free(HuffCtx *ctx) {
+    if (!ctx) return;
+    dec_drop(ctx);
+    free(ctx);
+}
+
+int huff_ctx_set_max_code_len(HuffCtx *ctx, int max_len) {
+    if (max_len < 0 || max_len > HUFF_MAX_TABLE_CODE_LEN) return HUFF_ERR_ARG;
+    ctx->max_code_len = max_len;
+    return 0;
+}
+
+const char *huff_strerror(long err) {
+    switch (err) {
+    case HUFF_ERR_NOMEM:     return "out of memory";
+    case HUFF_ERR_ARG:       return "invalid argument";
+    case HUFF_ERR_FORMAT:    return "not a supported container";
+    case HUFF_ERR_CORRUPT:   return "corrupt payload";
+    case HUFF_ERR_CODE_LEN:  return "code length limit too small";
+    case HUFF_ERR_DST_SMALL: return "destination buffer too small";
+    default:                 return err >= 0 ? "ok" : "unknown error";
+    }
+}
+
+/* ------------------------------- 共用函式 ----------------------------------- */
+
+/*
+ * 交錯累加到 4 張子表，連續相同的 byte 不會一直對同一個計數器做
+ * load → add → store，最後再把 4 張表加總。
+ */
+void huff_histogram(const unsigned char *p, size_t n, long freq[HUFF_NUM_SYMBOLS]) {
+    long   sub[4][HUFF_NUM_SYMBOLS];
+    size_t k = 0;
+
+    memset(sub, 0, sizeof(sub));
+    for (; k + 4 <= n; k += 4) {
+        sub[0][p[k]]++;
+        sub[1][p[k + 1]]++;
+        sub[2][p[k + 2]]++;
+        sub[3][p[k + 3]]++;
+    }
+    for (; k < n; k++) sub[0][p[k]]++;
+
+    for (int s = 0; s < HUFF_NUM_SYMBOLS; s++) {
+        freq[s] = sub[0][s] + sub[1][s] + sub[2][s] + sub[3][s];
+    }
+}
+
+/*
+ * 64-bit 累加器裝滿時整個 word 以 big-endian 寫出；每個 word 裡都是
+ * 真正的 payload bit，所以不會寫超過這段的最後一個 byte。第一個 word
+ * 含 head byte，先拆開；最後不滿 64 bits 的部分再逐 byte 寫出。
+ */
+uint64_t huff_pack_span(const HuffCodeEntry table[HUFF_NUM_SYMBOLS],
+                        const unsigned char *src, size_t len, unsigned char *dst,
+                        int lead, unsigned char *head, unsigned char *tail) {
+    uint64_t acc   = 0;      // 尚未寫出的位元（靠左對齊）
+    int      nbits = lead;   // acc 中有效的 bit 數（0~63）；前 lead 個 bit 先當成 0
+    size_t   pos   = 0;      // acc 的第一個 byte 對應的位置
+    unsigned char word[8];
+
+    *head = *tail = 0;
+    for (size_t k = 0; k < len; k++) {
+        const HuffCodeEntry *e = &table[src[k]];
+        int room = 64 - nbits;
+        if (e->len < room) {
+            acc   |= e->bits << (room - e->len);
+            nbits += e->len;
+            continue;
+        }
+        int rest = e->len - room;
+        acc |= e->bits >> rest;
+        if (pos == 0) {
+            huff_store_be64(word, acc);
+            *head = word[0];
+            memcpy(dst + 1, word + 1, 7);
+        } else {
+            huff_store_be64(dst + pos, acc);
+        }
+        pos  += 8;
+        acc   = rest ? e->bits << (64 - rest) : 0;
+        nbits = rest;
+    }
+
+    uint64_t bits = (uint64_t)pos * 8 + (uint64_t)nbits - (uint64_t)lead;
+    if (bits == 0) return 0;
+
+    // 剛好在 word 邊界結束時，tail byte 已經在上面寫進 dst 了
+    size_t last = (size_t)(((uint64_t)lead + bits - 1) / 8);
+    huff_store_be64(word, acc);
+    if (last < pos) *tail = dst[last];
+    for (size_t b = pos; b <= last; b++) {
+        if (b == 0)    *head = word[b - pos];
+        if (b == last) *tail = word[b - pos];
+        if (b != 0 && b != last) dst[b] = word[b - pos];
+    }
+    return bits;
+}
+
+uint64_t huff_pack(const HuffCodeEntry table[HUFF_NUM_SYMBOLS],
+                   const unsigned char *src, size_t len, unsigned char *dst) {
+    unsigned char head, tail;
+    uint64_t bits = huff_pack_span(table, src, len, dst, 0, &head, &tail);
+    if (bits > 0) {
+        dst[0] = head;
+        dst[(bits - 1) / 8] = tail;
+    }
+    return bits;
+}
+
+/* ---------------------------------- 編碼 ----------------------------------- */
+
+long huff_encode(HuffCtx *ctx, const unsigned char *src, size_t len,
+                 unsigned char *dst, size_t cap) {
+    HuffContainerHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    if (!ctx || (!src && len > 0)) return HUFF_ERR_ARG;
+
+    huff_histogram(src, len, ctx->freq);
+    if (huff_code_lengths(ctx->freq, ctx->max_code_len, ctx->lens) != 0 ||
+        huff_code_table(ctx->lens, ctx->table) != 0) {
+        return HUFF_ERR_CODE_LEN;
+    }
+
+    uint64_t bits = 0;
+    for (int s = 0; s < HUFF_NUM_SYMBOLS; s++) {
+        bits += (uint64_t)ctx->lens[s] * (uint64_t)ctx->freq[s];
+        hdr.lens[s] = ctx->lens[s];
+    }
+    long need = HUFF_CT_HEADER_SIZE + (long)((bits + 7) / 8);
+    if ((size_t)need > cap) return need;
+
+    hdr.original_size = (long)len;
+    hdr.payload_bits  = (long)bits;
+    huff_container_pack_header(dst, &hdr);
+    huff_pack(ctx->table, src, len, dst + HUFF_CT_HEADER_SIZE);
+    return need;
+}
+
+/* --------------------------------- 解碼樹 ---------------------------------- */
+
+// 將一個 codeword 插入解碼樹；節點不夠用時回傳 -1
+static int dtree_insert(HuffDTree *t, const char *code, unsigned char symbol) {
+    int node = 0;
+    for (int i = 0; code[i] != '\0'; i++) {
+        int       bit = (code[i] == '1');
+        HuffDRef *k   = &t->kids[node][bit];
+
+        if (code[i + 1] == '\0') {
+            *k = (HuffDRef)(HUFF_DT_LEAF | symbol);   // 原本是內部節點的話，後面的路徑就走不到了
+            break;
+        }
+        if (*k & HUFF_DT_LEAF) break;   // 前綴已經是別的 symbol，這個 code 永遠解不到
+        if (*k == HUFF_DT_NONE) {
+            if (t->nnodes == t->cap) return -1;
+            t->kids[t->nnodes][0] = HUFF_DT_NONE;
+            t->kids[t->nnodes][1] = HUFF_DT_NONE;
+            *k = (HuffDRef)t->nnodes++;
+        }
+        node = *k;
+    }
+    return 0;
+}
+
+/* 內部節點數不會超過 code 長度總和 + 1，先一次配好，建完再縮回實際大小 */
+int huff_dtree_build(HuffDTree *t, char codes[HUFF_NUM_SYMBOLS][HUFF_MAX_CODE_LEN + 1]) {
+    long cap = 1;
+    for (int s = 0; s < HUFF_NUM_SYMBOLS; s++) cap += (long)strlen(codes[s]);
+    if (cap > HUFF_DT_MAX_NODES) cap = HUFF_DT_MAX_NODES;
+
+    t->kids   = (HuffDRef (*)[2])malloc(sizeof(HuffDRef[2]) * (size_t)cap);
+    t->nnodes = 1;
+    t->cap    = (int)cap;
+    if (!t->kids) {
+        t->nnodes = t->cap = 0;
+        return HUFF_ERR_NOMEM;
+    }
+    t->kids[0][0] = t->kids[0][1] = HUFF_DT_NONE;
+
+    for (int s = 0; s < HUFF_NUM_SYMBOLS; s++) {
+        if (codes[s][0] != '\0' && dtree_insert(t, codes[s], (unsigned char)s) != 0) {
+            huff_dtree_free(t);
+            return HUFF_ERR_CODE_LEN;
+        }
+    }
+    HuffDRef (*shrunk)[2] = (HuffDRef (*)[2])realloc(t->kids, sizeof(HuffDRef[2]) * (size_t)t->nnodes);
+    if (shrunk) {
+        t->kids = shrunk;
+        t->cap  = t->nnodes;
+    }
+    return 0;
+}
+
+int huff_dtree_from_lengths(HuffDTree *t, const int lens[HUFF_NUM_SYMBOLS],
+                            char codes[HUFF_NUM_SYMBOLS][HUFF_MAX_CODE_LEN + 1]) {
+    if (huff_canonical_codes(lens, codes) != 0) return HUFF_ERR_CODE_LEN;
+    return huff_dtree_build(t, codes);
+}
+
+void huff_dtree_free(HuffDTree *t) {
+    free(t->kids);
+    t->kids   = NULL;
+    t->nnodes = t->cap = 0;
+}
+
+// 用來決定第二層表格要幾個 bit
+int huff_dtree_depth(const HuffDTree *t, int node) {
+    int d = 0;
+    for (int bit = 0; bit < 2; bit++) {
+        HuffDRef k = t->kids[node][bit];
+        if (k != HUFF_DT_NONE && !(k & HUFF_DT_LEAF)) {
+            int c = huff_dtree_depth(t, k);
+            if (c > d) d = c;
+        }
+    }
+    return 1 + d;
+}
+
+/* ---------------------------------- 查表 ----------------------------------- */
+
+// 在 entries 尾端配 n 個 entry，回傳起點；記憶體不足回傳 (size_t)-1
+static size_t lut_alloc(HuffLutTable *t, size_t n) {
+    if (t->size + n > t->cap) {
+        size_t ncap = t->cap ? t->cap : 4096;
+        while (ncap < t->size + n) ncap *= 2;
+        HuffLutEntry *ne = (HuffLutEntry *)realloc(t->entries, ncap * sizeof(HuffLutEntry));
+        if (!ne) return (size_t)-1;
+        t->entries = ne;
+        t->cap     = ncap;
+    }
+    size_t start = t->size;
+    t->size += n;
+    return start;
+}
+
+// 以內部節點 node 為起點、用 bits 個 bit 為索引，填滿從 base 開始的一張表
+static int lut_fill(HuffLutTable *t, size_t base, const HuffDTree *tree, int node, int bits) {
+    size_t count = (size_t)1 << bits;
+    for (size_t idx = 0; idx < count; idx++) {
+        int cur = node;
+        HuffLutEntry e;
+        memset(&e, 0, sizeof(e));
+        e.kind = HUFF_LUT_SUB;
+        e.len  = (uint8_t)bits;
+
+        for (int b = 0; b < bits; b++) {
+            int      bit = (int)((idx >> (bits - 1 - b)) & 1);
+            HuffDRef k   = tree->kids[cur][bit];
+            if (k == HUFF_DT_NONE) {
+                e.kind = HUFF_LUT_INVALID;
+                e.len  = (uint8_t)(b + 1);
+                break;
+            }
+            if (k & HUFF_DT_LEAF) {
+                e.kind   = HUFF_LUT_LEAF;
+                e.symbol = (uint8_t)k;
+                e.len    = (uint8_t)(b + 1);
+                break;
+            }
+            cur = k;
+        }
+
+        if (e.kind == HUFF_LUT_SUB) {
+            // 用完 bits 個 bit 還停在內部節點：為這棵子樹建下一層表
+            int depth = huff_dtree_depth(tree, cur);
+            int sub   = depth < HUFF_LUT_SUB_BITS ? depth : HUFF_LUT_SUB_BITS;
+            size_t sub_base = lut_alloc(t, (size_t)1 << sub);
+            if (sub_base == (size_t)-1 || lut_fill(t, sub_base, tree, cur, sub) != 0) {
+                return HUFF_ERR_NOMEM;
+            }
+            e.next     = (uint32_t)sub_base;
+            e.sub_bits = (uint8_t)sub;
+        }
+        t->entries[base + idx] = e;
+    }
+    return 0;
+}
+
+int huff_lut_build(HuffLutTable *t, const HuffDTree *tree) {
+    t->entries = NULL;
+    t->size = t->cap = 0;
+    size_t base = lut_alloc(t, (size_t)1 << HUFF_LUT_ROOT_BITS);
+    if (base == (size_t)-1 || lut_fill(t, base, tree, 0, HUFF_LUT_ROOT_BITS) != 0) {
+        huff_lut_free(t);
+        return HUFF_ERR_NOMEM;
+    }
+    return 0;
+}
+
+void huff_lut_free(HuffLutTable *t) {
+    free(t->entries);
+    t->entries = NULL;
+    t->size = t->cap = 0;
+}
+
+/* ------------------------------- bit reader -------------------------------- */
+
+int huff_br_init(HuffBitReader *br, FILE *fp, long total_bits) {
+    br->fp           = fp;
+    br->own_buf      = (unsigned char *)malloc(HUFF_BR_BUF_SIZE);
+    br->buf          = br->own_buf;
+    br->buf_len      = 0;
+    br->buf_pos      = 0;
+    br->acc          = 0;
+    br->nbits        = 0;
+    br->eof          = 0;
+    br->bytes_loaded = 0;
+    br->total_bits   = total_bits;
+    return br->own_buf ? 0 : HUFF_ERR_NOMEM;
+}
+
+void huff_br_init_mem(HuffBitReader *br, const unsigned char *data, size_t len,
+                      long total_bits) {
+    br->fp           = NULL;
+    br->own_buf      = NULL;
+    br->buf          = data;
+    br->buf_len      = len;
+    br->buf_pos      = 0;
+    br->acc          = 0;
+    br->nbits        = 0;
+    br->eof          = 1;
+    br->bytes_loaded = 0;
+    br->total_bits   = total_bits;
+}
+
+long huff_br_init_at(HuffBitReader *br, const unsigned char *payload, size_t len,
+                     long total_bits, long bit) {
+    size_t byte0 = (size_t)(bit / 8);
+    huff_br_init_mem(br, payload + byte0, len - byte0, total_bits - (long)byte0 * 8);
+    huff_br_refill(br);
+    huff_br_consume(br, (int)(bit % 8));
+    return (long)byte0 * 8;
+}
+
+void huff_br_free(HuffBitReader *br) {
+    free(br->own_buf);
+    br->own_buf = NULL;
+}
+
+// 檔案模式：把還沒放進 acc 的幾個 byte 搬到緩衝區開頭，後面接著 fread
+void huff_br_fill_buf(HuffBitReader *br) {
+    size_t left = br->buf_len - br->buf_pos;
+    memmove(br->own_buf, br->buf + br->buf_pos, left);
+    size_t got = fread(br->own_buf + left, 1, HUFF_BR_BUF_SIZE - left, br->fp);
+    br->buf_len = left + got;
+    br->buf_pos = 0;
+    if (got == 0) {
+        long file_bits = (br->bytes_loaded + (long)left) * 8;
+        br->eof = 1;
+        if (br->total_bits < 0 || file_bits < br->total_bits) {
+            br->total_bits = file_bits;
+        }
+    }
+}
+
+// 資料尾端（剩不到 8 bytes）：逐 byte 補，用完之後補 0
+void huff_br_refill_tail(HuffBitReader *br) {
+    while (br->nbits <= 56) {
+        if (br->buf_pos == br->buf_len && !br->eof) huff_br_fill_buf(br);
+        uint64_t byte = (br->buf_pos < br->buf_len) ? br->buf[br->buf_pos++] : 0;
+        br->acc   |= byte << (56 - br->nbits);
+        br->nbits += 8;
+        br->bytes_loaded++;
+    }
+}
+
+/* ---------------------------------- 解碼 ----------------------------------- */
+
+long huff_decode_lut(const HuffLutTable *t, HuffBitReader *br,
+                     unsigned char *out, long max_syms, long *bad_bit) {
+    const HuffLutEntry *tab = t->entries;
+    long n = 0;
+
+    while (n < max_syms) {
+        huff_br_refill(br);
+        const HuffLutEntry *e = &tab[huff_br_peek(br, HUFF_LUT_ROOT_BITS)];
+
+        while (e->kind == HUFF_LUT_SUB) {
+            huff_br_consume(br, e->len);
+            huff_br_refill(br);
+            e = &tab[e->next + huff_br_peek(br, e->sub_bits)];
+        }
+
+        long end = huff_br_consumed(br) + e->len;
+        if (!huff_br_within(br, end)) break;   // 剩下的 bit 不足一個完整 codeword
+
+        if (e->kind == HUFF_LUT_INVALID) {
+            *bad_bit = end;
+            break;
+        }
+        huff_br_consume(br, e->len);
+        out[n++] = e->symbol;
+    }
+    return n;
+}
+
+long huff_decode_tree(const HuffDTree *tree, HuffBitReader *br,
+                      unsigned char *out, long max_syms, long *bad_bit) {
+    const HuffDRef (*kids)[2] = (const HuffDRef (*)[2])tree->kids;
+    int  cur = 0;
+    long n = 0;
+
+    while (n < max_syms) {
+        huff_br_refill(br);
+        long pos = huff_br_consumed(br) + 1;
+        if (!huff_br_within(br, pos)) break;
+
+        HuffDRef k = kids[cur][huff_br_peek(br, 1)];
+        huff_br_consume(br, 1);
+
+        if (k == HUFF_DT_NONE) {
+            *bad_bit = pos;
+            break;
+        }
+        if (k & HUFF_DT_LEAF) {
+            out[n++] = (unsigned char)k;
+            cur = 0;
+        } else {
+            cur = k;
+        }
+    }
+    return n;
+}
+
+long huff_decoded_size(const unsigned char *src, size_t len) {
+    HuffContainerHeader hdr;
+    if (!src || len < HUFF_CT_HEADER_SIZE ||
+        huff_container_parse_header(src, &hdr) != 0) {
+        return HUFF_ERR_FORMAT;
+    }
+    return hdr.original_size;
+}
+
+long huff_decode(HuffCtx *ctx, const unsigned char *src, size_t len,
+                 unsigned char *dst, size_t cap) {
+    HuffContainerHeader hdr;
+    if (!ctx) return HUFF_ERR_ARG;
+    if (!src || len < HUFF_CT_HEADER_SIZE ||
+        huff_container_parse_header(src, &hdr) != 0 || hdr.streams > 0) {
+        return HUFF_ERR_FORMAT;
+    }
+    if ((uint64_t)hdr.original_size > cap) return HUFF_ERR_DST_SMALL;
+    if (hdr.original_size == 0) return 0;
+
+    const unsigned char *payload = src + HUFF_CT_HEADER_SIZE;
+    size_t nbytes = len - HUFF_CT_HEADER_SIZE;
+    if (((uint64_t)hdr.payload_bits + 7) / 8 > nbytes) return HUFF_ERR_CORRUPT;
+
+    // 同一份 code 長度沿用上次建好的樹與表
+    if (!ctx->dec_valid || memcmp(ctx->dec_lens, hdr.lens, sizeof(hdr.lens)) != 0) {
+        dec_drop(ctx);
+        int rc = huff_dtree_from_lengths(&ctx->dec_tree, hdr.lens, ctx->codes);
+        if (rc != 0) return rc == HUFF_ERR_NOMEM ? HUFF_ERR_NOMEM : HUFF_ERR_CORRUPT;
+        if (huff_lut_build(&ctx->dec_lut, &ctx->dec_tree) != 0) {
+            huff_dtree_free(&ctx->dec_tree);
+            return HUFF_ERR_NOMEM;
+        }
+        memcpy(ctx->dec_lens, hdr.lens, sizeof(hdr.lens));
+        ctx->dec_valid = 1;
+    }
+
+    HuffBitReader br;
+    long bad_bit = 0;
+    huff_br_init_mem(&br, payload, nbytes, hdr.payload_bits);
+    long n = huff_decode_lut(&ctx->dec_lut, &br, dst, hdr.original_size, &bad_bit);
+    if (bad_bit || n < hdr.original_size) return HUFF_ERR_CORRUPT;
+    return hdr.original_size;
+}
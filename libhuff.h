@@ -0,0 +1,260 @@
+#ifndef LIBHUFF_H
+#define LIBHUFF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "huffman.h"
+
+/*
+ * libhuff：記憶體對記憶體的 Huffman 編碼／解碼
+ * - 不開檔、不 fork，直接把 src 緩衝區編碼到 dst 緩衝區（或反過來）
+ * - 輸出就是 huffman.h 的單檔 container（version 1、canonical code），
+ *   與 encoder --container 產生的檔案完全相同，decoder 也能直接解
+ * - HuffCtx 保存可以重複使用的狀態（頻率表、code table、解碼表），沒有
+ *   file-static 狀態；每個執行緒各用自己的 context 就能同時呼叫
+ * - 解碼表依 code 長度快取：連續解同一份 codebook 的資料時不必重建
+ *
+ * encoder 執行檔也用這裡的頻率統計與打包函式，decoder 執行檔的解碼樹、
+ * 查表與 bit reader 也在這裡（見檔尾的低階函式）；huff_decode 就是建在
+ * 同一套解碼樹與查表上。
+ *
+ * 編譯：gcc -O2 -c libhuff.c huffman.c
+ */
+
+/* 錯誤碼（回傳值 < 0） */
+#define HUFF_ERR_NOMEM     (-1)   /* 記憶體不足 */
+#define HUFF_ERR_ARG       (-2)   /* 參數不合法 */
+#define HUFF_ERR_FORMAT    (-3)   /* 不是 container，或是不支援的版本（多 stream） */
+#define HUFF_ERR_CORRUPT   (-4)   /* payload 有 invalid codeword 或長度不符 */
+#define HUFF_ERR_CODE_LEN  (-5)   /* max_code_len 太小，或 code 超過 64 bits */
+#define HUFF_ERR_DST_SMALL (-6)   /* 解碼：dst 放不下原始資料 */
+
+typedef struct HuffCtx HuffCtx;
+
+/* 建立／釋放 context；失敗回傳 NULL */
+HuffCtx *huff_ctx_new(void);
+void     huff_ctx_free(HuffCtx *ctx);
+
+/* 限制編碼時最長的 code（1~64），0 表示不限制（預設）。
+   成功回傳 0，不合法回傳 HUFF_ERR_ARG */
+int huff_ctx_set_max_code_len(HuffCtx *ctx, int max_len);
+
+/* 把 src 的 len bytes 編碼成 container 寫進 dst（容量 cap）。
+   回傳 container 的總 byte 數；這個數字大於 cap 時 dst 完全不會被寫入，
+   呼叫端可以依回傳值配好緩衝區再呼叫一次（同 snprintf）。
+   失敗回傳負的錯誤碼 */
+long huff_encode(HuffCtx *ctx, const unsigned char *src, size_t len,
+                 unsigned char *dst, size_t cap);
+
+/* container 解碼後的大小（讀 header 就知道）；格式錯誤回傳 HUFF_ERR_FORMAT */
+long huff_decoded_size(const unsigned char *src, size_t len);
+
+/* 解碼 container（len bytes）到 dst（容量 cap），回傳原始資料的 byte 數；
+   失敗回傳負的錯誤碼。container 尾端的 sync index 會被忽略 */
+long huff_decode(HuffCtx *ctx, const unsigned char *src, size_t len,
+                 unsigned char *dst, size_t cap);
+
+/* 錯誤碼的說明文字 */
+const char *huff_strerror(long err);
+
+/* ------------------------------------------------------------------------
+ * encoder / decoder 執行檔共用的低階函式
+ * ------------------------------------------------------------------------ */
+
+/* 統計 p[0..n-1] 每個 byte 的出現次數（freq 由這裡清為 0） */
+void huff_histogram(const unsigned char *p, size_t n, long freq[HUFF_NUM_SYMBOLS]);
+
+/* 從 p 讀 8 bytes 組成 big-endian 的 uint64（p 不必對齊） */
+static inline uint64_t huff_load_be64(const unsigned char *p) {
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t w;
+    memcpy(&w, p, 8);
+    return __builtin_bswap64(w);
+#elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    uint64_t w;
+    memcpy(&w, p, 8);
+    return w;
+#else
+    uint64_t w = 0;
+    for (int i = 0; i < 8; i++) w = (w << 8) | p[i];
+    return w;
+#endif
+}
+
+/* 把 v 以 big-endian 寫成 8 bytes（p 不必對齊） */
+static inline void huff_store_be64(unsigned char *p, uint64_t v) {
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    v = __builtin_bswap64(v);
+    memcpy(p, &v, 8);
+#elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    memcpy(p, &v, 8);
+#else
+    for (int k = 0; k < 8; k++) p[k] = (unsigned char)(v >> (56 - 8 * k));
+#endif
+}
+
+/* 依 table 把 src 的 len 個 symbol 打包進 dst（MSB 先，最後不足 8 bits
+   的 byte 以 0 padding）。dst 必須剛好放得下 (總 bit 數 + 7) / 8 bytes，
+   回傳總 bit 數 */
+uint64_t huff_pack(const HuffCodeEntry table[HUFF_NUM_SYMBOLS],
+                   const unsigned char *src, size_t len, unsigned char *dst);
+
+/* 同 huff_pack，但從 dst[0] 的第 lead 個 bit（0~7）開始打包，供多個執行緒
+   各自打包相鄰的段落：頭尾兩個可能和鄰段共用的 byte 不寫進 dst，改放到
+   *head / *tail（不屬於這段的 bit 為 0），由呼叫端合併。回傳這段的 bit 數 */
+uint64_t huff_pack_span(const HuffCodeEntry table[HUFF_NUM_SYMBOLS],
+                        const unsigned char *src, size_t len, unsigned char *dst,
+                        int lead, unsigned char *head, unsigned char *tail);
+
+/* ---------------------------------- 解碼樹 ----------------------------------
+ * 整棵樹放在一個連續陣列裡：每個內部節點只存兩個 16-bit 的子節點參照
+ * kids[node][bit]，root 固定是 0 號節點。參照的值：
+ *   HUFF_DT_NONE          : 沒有這條路徑（root 不會是別人的子節點，所以 0 可以借用）
+ *   HUFF_DT_LEAF | symbol : 葉節點，低 8 bit 是 symbol
+ *   其他                  : 內部節點的編號
+ */
+#define HUFF_DT_NONE      0
+#define HUFF_DT_LEAF      0x8000u
+#define HUFF_DT_MAX_NODES 0x8000   /* 內部節點編號只有 15 bit */
+
+typedef uint16_t HuffDRef;
+
+typedef struct HuffDTree {
+    HuffDRef (*kids)[2];   /* kids[node][bit] */
+    int        nnodes;     /* 已使用的內部節點數（含 root） */
+    int        cap;
+} HuffDTree;
+
+/* 由每個 symbol 的 code 字串（空字串 = 未出現）建出解碼樹。成功回傳 0；
+   節點超過 HUFF_DT_MAX_NODES 回傳 HUFF_ERR_CODE_LEN，記憶體不足回傳
+   HUFF_ERR_NOMEM（兩者都不必再 free） */
+int  huff_dtree_build(HuffDTree *t, char codes[HUFF_NUM_SYMBOLS][HUFF_MAX_CODE_LEN + 1]);
+
+/* 由 code 長度重建 canonical code（存進 codes）再建樹；長度不合法時回傳
+   HUFF_ERR_CODE_LEN，其餘同 huff_dtree_build */
+int  huff_dtree_from_lengths(HuffDTree *t, const int lens[HUFF_NUM_SYMBOLS],
+                             char codes[HUFF_NUM_SYMBOLS][HUFF_MAX_CODE_LEN + 1]);
+void huff_dtree_free(HuffDTree *t);
+
+/* 以內部節點 node 為根的子樹最大深度 */
+int  huff_dtree_depth(const HuffDTree *t, int node);
+
+/* ---------------------------------- 查表 ------------------------------------
+ * 一次 peek HUFF_LUT_ROOT_BITS 個 bit，查第一層表就能得到 symbol 與 code 長度；
+ * 更長的 code 落在第一層 entry 指向的子表。表格是走解碼樹建出來的，對任何
+ * codebook 都和逐 bit 走樹的結果完全一致。
+ */
+#define HUFF_LUT_ROOT_BITS 11   /* 第一層表：2^11 個 entry */
+#define HUFF_LUT_SUB_BITS  11   /* 子表每層最多查幾個 bit */
+
+enum { HUFF_LUT_LEAF = 0, HUFF_LUT_SUB = 1, HUFF_LUT_INVALID = 2 };
+
+typedef struct HuffLutEntry {
+    uint32_t next;     /* HUFF_LUT_SUB：子表在 entries 中的起點 */
+    uint8_t  symbol;   /* HUFF_LUT_LEAF：解出的 symbol */
+    uint8_t  len;      /* HUFF_LUT_LEAF：這一層用掉的 bit 數
+                          HUFF_LUT_INVALID：第幾個 bit 走到不存在的路徑
+                          HUFF_LUT_SUB：這一層用掉的 bit 數（= 本層表格 bit 數） */
+    uint8_t  sub_bits; /* HUFF_LUT_SUB：子表的索引 bit 數 */
+    uint8_t  kind;     /* HUFF_LUT_LEAF / HUFF_LUT_SUB / HUFF_LUT_INVALID */
+} HuffLutEntry;
+
+typedef struct HuffLutTable {
+    HuffLutEntry *entries;   /* 第一層在最前面，子表接在後面 */
+    size_t        size;
+    size_t        cap;
+} HuffLutTable;
+
+/* 成功回傳 0；記憶體不足回傳 HUFF_ERR_NOMEM（不必再 free） */
+int  huff_lut_build(HuffLutTable *t, const HuffDTree *tree);
+void huff_lut_free(HuffLutTable *t);
+
+/* -------------------------------- bit reader --------------------------------
+ * 以 64-bit 緩衝（靠左對齊）讀 bit。來源可以是記憶體，也可以是不能 mmap
+ * 的檔案（pipe 等，背後用大區塊 fread）。補 bit 時一次從 buf 以 big-endian
+ * 讀 8 bytes，剩不到 8 bytes 的資料尾端才逐 byte 補；資料結尾之後補 0，讓
+ * peek 永遠有足夠的 bit，是否讀過頭由 huff_br_consumed() 與 total_bits 判斷。
+ */
+#define HUFF_BR_BUF_SIZE (1 << 16)   /* 檔案模式的 fread 緩衝區大小 */
+
+typedef struct HuffBitReader {
+    FILE                *fp;       /* NULL 表示直接讀記憶體 */
+    const unsigned char *buf;      /* 目前的資料區塊 */
+    unsigned char       *own_buf;  /* 檔案模式下 fread 用的緩衝區 */
+    size_t               buf_len;  /* buf 內有效 byte 數 */
+    size_t               buf_pos;  /* 下一個要放進 acc 的 byte */
+    uint64_t             acc;      /* 靠左對齊的 bit 緩衝 */
+    int                  nbits;    /* acc 內有效 bit 數 */
+    int                  eof;      /* 已經沒有更多資料可讀 */
+    long                 bytes_loaded; /* 已放進 acc 的 byte 數（含補的 0） */
+    long                 total_bits;   /* 有效 bit 數上限；未知時為 -1 */
+} HuffBitReader;
+
+/* 從 fp 讀（total_bits 未知時給 -1）；記憶體不足回傳 HUFF_ERR_NOMEM */
+int  huff_br_init(HuffBitReader *br, FILE *fp, long total_bits);
+
+/* 直接從記憶體讀；total_bits 為有效 bit 數（不可超過 len * 8） */
+void huff_br_init_mem(HuffBitReader *br, const unsigned char *data, size_t len,
+                      long total_bits);
+
+/* 從記憶體中 payload 的第 bit 個 bit 開始讀；reader 內的位置都相對於回傳的
+   起點，加上回傳值就是 payload 中的絕對 bit 位置 */
+long huff_br_init_at(HuffBitReader *br, const unsigned char *payload, size_t len,
+                     long total_bits, long bit);
+void huff_br_free(HuffBitReader *br);
+
+/* huff_br_refill 的慢速路徑 */
+void huff_br_fill_buf(HuffBitReader *br);
+void huff_br_refill_tail(HuffBitReader *br);
+
+/*
+ * 補到 acc 至少有 57 個 bit。只要還有 8 bytes 可讀，就不管 acc 剩多少 bit、
+ * 直接補到 56~63 個：一次放進 (63 - nbits) / 8 個完整的 byte，多讀進來的
+ * 低位 bit 下次補的時候會再 OR 一次同樣的值，沒有「要不要補」的分支。
+ */
+static inline void huff_br_refill(HuffBitReader *br) {
+    if (br->buf_len - br->buf_pos < 8) {
+        if (br->nbits > 56) return;
+        if (!br->eof) huff_br_fill_buf(br);
+        if (br->buf_len - br->buf_pos < 8) {
+            huff_br_refill_tail(br);
+            return;
+        }
+    }
+    int take = (63 - br->nbits) >> 3;
+    br->acc |= huff_load_be64(br->buf + br->buf_pos) >> br->nbits;
+    br->buf_pos      += (size_t)take;
+    br->nbits        += take * 8;
+    br->bytes_loaded += take;
+}
+
+static inline uint32_t huff_br_peek(const HuffBitReader *br, int n) {
+    return (uint32_t)(br->acc >> (64 - n));
+}
+
+static inline void huff_br_consume(HuffBitReader *br, int n) {
+    br->acc  <<= n;
+    br->nbits -= n;
+}
+
+/* 到目前為止已消耗的 bit 數 */
+static inline long huff_br_consumed(const HuffBitReader *br) {
+    return br->bytes_loaded * 8 - br->nbits;
+}
+
+/* 前 pos 個 bit 是否都是有效資料（不是檔尾補的 0 或 container 的 padding） */
+static inline int huff_br_within(const HuffBitReader *br, long pos) {
+    return br->total_bits < 0 || pos <= br->total_bits;
+}
+
+/* 用查表／逐 bit 走樹解碼最多 max_syms 個 symbol 到 out。回傳實際解出的
+   數量；遇到 invalid codeword 時 *bad_bit 設為出錯的 bit 位置（從 1 起算），
+   否則維持原值 */
+long huff_decode_lut(const HuffLutTable *t, HuffBitReader *br,
+                     unsigned char *out, long max_syms, long *bad_bit);
+long huff_decode_tree(const HuffDTree *tree, HuffBitReader *br,
+                      unsigned char *out, long max_syms, long *bad_bit);
+
+#endif /* LIBHUFF_H */
@@ -51,7 +51,8 @@ static void log_vwrite(log_level_t level,
 
     /* 取得目前時間 */
     time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now); /* 使用 local time */
+    struct tm tm_buf;
+    struct tm *tm_info = localtime_r(&now, &tm_buf); /* 使用 local time（可重入版本） */
 
     char time_buf[20]; /* "YYYY-MM-DD HH:MM:SS" => 19 chars + '\0' */
     if (tm_info) {
@@ -61,6 +62,9 @@ static void log_vwrite(log_level_t level,
         snprintf(time_buf, sizeof(time_buf), "0000-00-00 00:00:00");
     }
 
+    /* 整行持有 stream 的鎖：多個執行緒同時寫 log 時各行不會交錯 */
+    flockfile(out);
+
     /* 印出前綴：時間、等級、component */
     fprintf(out, "%s [%s] %s: ",
             time_buf,
@@ -75,6 +79,7 @@ static void log_vwrite(log_level_t level,
 
     /* 立刻 flush，避免程式當掉時 log 還在 buffer 裡 */
     fflush(out);
+    funlockfile(out);
 }
 
 /* 對外介面：INFO / WARN / ERROR */